@@ -0,0 +1,224 @@
+// pe-file: library for reading and manipulating pe-files
+// Copyright (C) 2012  Jeffrey Bush  jeff@coderforlife.com
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef __cplusplus_cli
+#pragma unmanaged
+#endif
+
+#include "PEAnalysis.h"
+#include "PEFile.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PE_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+using namespace PE;
+using namespace PE::Analysis;
+using namespace PE::Image;
+
+// Work is split into chunks of this size so that large sections are spread across threads and each chunk stays in the
+// cache between the histogram and zero-run passes, it also keeps the 32-bit histogram lanes from overflowing
+#define CHUNK_SIZE (256*1024)
+
+#pragma region Byte Stats
+///////////////////////////////////////////////////////////////////////////////
+///// Byte Stats
+///////////////////////////////////////////////////////////////////////////////
+ByteStats::ByteStats() : Size(0), Entropy(0.0), ZeroRuns(0), LongestZeroRun(0), LeadingZeros(0), TrailingZeros(0) { memset(this->Histogram, 0, sizeof(this->Histogram)); }
+void ByteStats::append(const ByteStats& next) {
+	if (next.Size == 0) { return; }
+	if (this->Size == 0) { *this = next; return; }
+	for (int i = 0; i < 256; ++i) { this->Histogram[i] += next.Histogram[i]; }
+	uint64_t joined = this->TrailingZeros + next.LeadingZeros; // a run that continues across the boundary
+	this->ZeroRuns += next.ZeroRuns - ((this->TrailingZeros && next.LeadingZeros) ? 1 : 0);
+	if (next.LongestZeroRun > this->LongestZeroRun) { this->LongestZeroRun = next.LongestZeroRun; }
+	if (joined > this->LongestZeroRun) { this->LongestZeroRun = joined; }
+	if (this->LeadingZeros == this->Size) { this->LeadingZeros += next.LeadingZeros; }
+	this->TrailingZeros = (next.TrailingZeros == next.Size) ? joined : next.TrailingZeros;
+	this->Size += next.Size;
+}
+void ByteStats::finish() {
+	double e = 0.0, n = (double)this->Size;
+	for (int i = 0; i < 256; ++i) {
+		if (this->Histogram[i]) {
+			double p = this->Histogram[i] / n;
+			e -= p * log(p);
+		}
+	}
+	this->Entropy = e / log(2.0);
+}
+
+// Counts into 4 separate tables so that runs of the same byte do not stall on a single counter, each table sees every
+// 4th byte of the data which is read 8 bytes at a time
+static void Histogram(const_bytes d, size_t n, uint64_t hist[256]) {
+	uint32_t h[4][256];
+	memset(h, 0, sizeof(h));
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint64_t a, b;
+		memcpy(&a, d+i, 8); memcpy(&b, d+i+8, 8);
+		++h[0][a & 0xFF]; ++h[1][(a >>  8) & 0xFF]; ++h[2][(a >> 16) & 0xFF]; ++h[3][(a >> 24) & 0xFF];
+		++h[0][(a >> 32) & 0xFF]; ++h[1][(a >> 40) & 0xFF]; ++h[2][(a >> 48) & 0xFF]; ++h[3][a >> 56];
+		++h[0][b & 0xFF]; ++h[1][(b >>  8) & 0xFF]; ++h[2][(b >> 16) & 0xFF]; ++h[3][(b >> 24) & 0xFF];
+		++h[0][(b >> 32) & 0xFF]; ++h[1][(b >> 40) & 0xFF]; ++h[2][(b >> 48) & 0xFF]; ++h[3][b >> 56];
+	}
+	for (; i < n; ++i) { ++h[0][d[i]]; }
+	for (int j = 0; j < 256; ++j) { hist[j] += (uint64_t)h[0][j] + h[1][j] + h[2][j] + h[3][j]; }
+}
+
+// Tracks the runs of zeros while scanning data
+struct ZeroRunCounter {
+	ByteStats* s;
+	uint64_t run;
+	bool atStart;
+	inline ZeroRunCounter(ByteStats* s) : s(s), run(0), atStart(true) { }
+	inline void endRun() {
+		if (this->atStart) { this->s->LeadingZeros = this->run; this->atStart = false; }
+		++this->s->ZeroRuns;
+		if (this->run > this->s->LongestZeroRun) { this->s->LongestZeroRun = this->run; }
+		this->run = 0;
+	}
+	inline void step(bool zero) {
+		if (zero) { ++this->run; }
+		else { if (this->run) { this->endRun(); } this->atStart = false; }
+	}
+	inline void finish(size_t n) {
+		if (this->run) {
+			bool all = this->atStart;
+			this->s->TrailingZeros = this->run;
+			this->endRun();
+			if (all) { this->s->LeadingZeros = n; }
+		}
+	}
+};
+static void ZeroRuns(const_bytes d, size_t n, ByteStats* s) {
+	ZeroRunCounter c(s);
+	size_t i = 0;
+#ifdef PE_USE_SSE2
+	// Compare 16 bytes at a time, blocks that are all zero or all non-zero (the common cases) are handled at once
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16) {
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(d+i)), zero));
+		if (mask == 0xFFFF) { c.run += 16; }
+		else if (mask == 0) { c.step(false); }
+		else { for (int j = 0; j < 16; ++j) { c.step(((mask >> j) & 1) != 0); } }
+	}
+#endif
+	for (; i < n; ++i) { c.step(d[i] == 0); }
+	c.finish(n);
+}
+
+static void ComputeChunk(const_bytes d, size_t n, ByteStats* s) {
+	*s = ByteStats();
+	s->Size = n;
+	Histogram(d, n, s->Histogram);
+	uint64_t zeros = s->Histogram[0];
+	if (zeros == n && n) { s->ZeroRuns = 1; s->LongestZeroRun = s->LeadingZeros = s->TrailingZeros = n; }
+	else if (zeros) { ZeroRuns(d, n, s); } // the zero-run pass is skipped for data without any zeros
+}
+
+void PE::Analysis::ComputeByteStats(const void* data, size_t size, ByteStats* stats) {
+	const_bytes d = (const_bytes)data;
+	*stats = ByteStats();
+	ByteStats chunk;
+	for (size_t off = 0; off < size; off += CHUNK_SIZE) {
+		ComputeChunk(d + off, (size - off < CHUNK_SIZE) ? size - off : CHUNK_SIZE, &chunk);
+		stats->append(chunk);
+	}
+	stats->finish();
+}
+#pragma endregion
+
+#pragma region File Analysis
+///////////////////////////////////////////////////////////////////////////////
+///// File Analysis
+///////////////////////////////////////////////////////////////////////////////
+struct Chunk {
+	size_t region;
+	const_bytes data;
+	size_t size;
+	ByteStats stats;
+};
+struct Work {
+	Chunk* chunks;
+	long count;
+	volatile long next;
+};
+static void DoWork(void* param) {
+	Work* w = (Work*)param;
+	long i;
+	while ((i = Internal::AtomicIncrement(&w->next)) < w->count) {
+		Chunk& c = w->chunks[i];
+		ComputeChunk(c.data, c.size, &c.stats);
+	}
+}
+static void AddRegion(std::vector<RegionStats>& regions, int section, const char* name, uint32_t offset, uint32_t size) {
+	RegionStats r;
+	r.Section = section;
+	memset(r.Name, 0, sizeof(r.Name));
+	strncpy(r.Name, name, 8);
+	r.Offset = offset;
+	r.Size = size;
+	regions.push_back(r);
+}
+bool PE::Analysis::AnalyzeFile(const File& f, std::vector<RegionStats>& regions, unsigned int threads) {
+	regions.clear();
+	if (!f.isLoaded()) { return false; }
+
+	// Find the regions, the raw data of each section and the overlay
+	const_bytes data = f.get(0);
+	const size_t size = f.getSize();
+	size_t end = 0;
+	for (int i = 0, n = f.getSectionHeaderCount(); i < n; ++i) {
+		const SectionHeader* s = f.getSectionHeader(i);
+		size_t off = s->PointerToRawData, sz = s->SizeOfRawData;
+		if (off > size) { off = size; }
+		if (sz > size - off) { sz = size - off; }
+		char name[9] = { 0 };
+		memcpy(name, s->Name, 8);
+		AddRegion(regions, i, name, (uint32_t)off, (uint32_t)sz);
+		if (off + sz > end) { end = off + sz; }
+	}
+	if (end && end < size) { AddRegion(regions, -1, "", (uint32_t)end, (uint32_t)(size - end)); }
+
+	// Split the regions into chunks
+	std::vector<Chunk> chunks;
+	for (size_t r = 0; r < regions.size(); ++r) {
+		for (size_t off = 0; off < regions[r].Size; off += CHUNK_SIZE) {
+			Chunk c;
+			c.region = r;
+			c.data = data + regions[r].Offset + off;
+			c.size = (regions[r].Size - off < CHUNK_SIZE) ? regions[r].Size - off : CHUNK_SIZE;
+			chunks.push_back(c);
+		}
+	}
+
+	// Process the chunks
+	if (!chunks.empty()) {
+		Work w = { &chunks[0], (long)chunks.size(), -1 };
+		Internal::RunWorkers(&DoWork, &w, threads, (unsigned int)chunks.size());
+	}
+
+	// Combine the chunks of each region, they are in order
+	for (size_t i = 0; i < chunks.size(); ++i) { regions[chunks[i].region].Stats.append(chunks[i].stats); }
+	for (size_t r = 0; r < regions.size(); ++r) { regions[r].Stats.finish(); }
+	return true;
+}
+#pragma endregion
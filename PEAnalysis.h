@@ -0,0 +1,62 @@
+// pe-file: library for reading and manipulating pe-files
+// Copyright (C) 2012  Jeffrey Bush  jeff@coderforlife.com
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Implements byte statistics (histograms, entropy, and runs of zeros) of the sections of PE files, used for detecting
+// packed or encrypted data
+
+#ifndef PE_ANALYSIS_H
+#define PE_ANALYSIS_H
+
+#include "PEDataTypes.h"
+
+#include <vector>
+
+namespace PE {
+	class File;
+
+	namespace Analysis {
+		struct ByteStats {
+			ByteStats();
+
+			uint64_t Histogram[256];
+			uint64_t Size;
+			double Entropy;			// Shannon entropy in bits per byte, from 0 to 8
+			uint64_t ZeroRuns;		// number of runs of 0x00 bytes
+			uint64_t LongestZeroRun;
+
+			// Used to combine consecutive pieces of data
+			uint64_t LeadingZeros, TrailingZeros;
+			void append(const ByteStats& next); // the entropy is not updated, call finish when done
+			void finish();
+		};
+
+		// Computes the statistics of a block of data
+		void ComputeByteStats(const void* data, size_t size, ByteStats* stats);
+
+		struct RegionStats {
+			int Section;			// the index of the section or -1 for the overlay (data after the last section)
+			char Name[9];			// null-terminated section name
+			uint32_t Offset, Size;	// in the file
+			ByteStats Stats;
+		};
+
+		// Computes the statistics of the raw data of every section and the overlay of a file
+		// The work is split into chunks and spread across threads, with 0 threads meaning one per processor
+		bool AnalyzeFile(const File& f, std::vector<RegionStats>& regions, unsigned int threads = 0);
+	}
+}
+
+#endif
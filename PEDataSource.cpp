@@ -21,6 +21,8 @@
 #include "PEDataSource.h"
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include <memory.h>
 
 #ifdef USE_WINDOWS_API
@@ -32,9 +34,24 @@
 #else
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
 #endif
 
 using namespace PE;
+using namespace PE::Internal;
+
+bool DataSourceImp::copyTo(size_t offset, size_t size, DataSink& sink) { return sink.write((const_bytes)this->data() + offset, size); }
+void* dyn_base::reload() {
+	if (this->src) { this->ptr = this->src->data(); }
+	this->valid = (size_t)-1;
+	return this->ptr;
+}
 
 RawDataSource::RawDataSource(void* data, size_t size, bool readonly) : readonly(readonly), orig_data(data), sz(size) {
 	if (readonly) {
@@ -77,133 +94,370 @@ bool RawDataSource::resize(size_t new_size) {
 	this->d = (bytes)realloc(this->orig_data, new_size);
 	if (!this->d) { this->close(); return false; }
 	this->orig_data = this->d;
-	if (new_size < this->sz)
+	if (new_size > this->sz)
 		memset((bytes)this->d+this->sz, 0, new_size-this->sz); // set new memory to 0
 	this->sz = new_size;
 	return true;
 }
 
+#pragma region Piece Table
+///////////////////////////////////////////////////////////////////////////////
+///// Piece Table
+///////////////////////////////////////////////////////////////////////////////
+PieceTableDataSource::PieceTableDataSource(DataSourceImp* ds) : ds(ds), base(NULL), owned(false), sz(0) {
+	if (ds && ds->data()) {
+		this->base = (bytes)ds->data();
+		this->sz = ds->size();
+		Piece p = { 0, this->sz };
+		this->pieces.push_back(p);
+	} else { this->close(); }
+}
+PieceTableDataSource::~PieceTableDataSource() { this->close(); }
+bool PieceTableDataSource::isreadonly() const { return !this->ds || this->ds->isreadonly(); }
+bool PieceTableDataSource::isclean() const { return this->pieces.size() == 1 && this->pieces[0].off == 0 && this->pieces[0].len == this->sz; }
+bool PieceTableDataSource::build() {
+	if (this->isclean()) { return true; }
+	bytes d = (bytes)malloc(this->sz ? this->sz : 1);
+	if (!d) { return false; }
+	size_t pos = 0;
+	for (size_t i = 0; i < this->pieces.size(); ++i) {
+		const Piece& p = this->pieces[i];
+		if (p.off == Piece::ZEROS)	memset(d+pos, 0, p.len);
+		else						memcpy(d+pos, this->base+p.off, p.len);
+		pos += p.len;
+	}
+	if (this->owned) { free(this->base); }
+	this->base = d;
+	this->owned = true;
+	this->pieces.clear();
+	Piece p = { 0, this->sz };
+	this->pieces.push_back(p);
+	return true;
+}
+void* PieceTableDataSource::data() { return (this->base && this->build()) ? this->base : NULL; }
+size_t PieceTableDataSource::size() const { return this->sz; }
+bool PieceTableDataSource::isdeferred() const { return true; }
+void* PieceTableDataSource::prefix(size_t* count) {
+	// Every byte of base is in at most one piece, so while the first piece starts at the start of base it can be used in place
+	*count = (!this->pieces.empty() && this->pieces[0].off == 0) ? this->pieces[0].len : 0;
+	return this->base;
+}
+void PieceTableDataSource::close() {
+	if (this->ds) {
+		if (this->base) { this->flush(); }
+		this->ds->close();
+		delete this->ds;
+		this->ds = NULL;
+	}
+	if (this->owned) { free(this->base); this->owned = false; }
+	this->base = NULL;
+	this->pieces.clear();
+	this->sz = 0;
+}
+bool PieceTableDataSource::flush() {
+	if (!this->ds || this->ds->isreadonly()) { return false; }
+	if (this->owned || !this->isclean()) {
+		// Write the whole image back once then work directly on the wrapped source again
+		if (!this->build() || !this->ds->resize(this->sz)) { return false; }
+		memcpy(this->ds->data(), this->base, this->sz);
+		free(this->base);
+		this->base = (bytes)this->ds->data();
+		this->owned = false;
+	}
+	return this->ds->flush();
+}
+size_t PieceTableDataSource::split(size_t offset) {
+	// Makes sure a piece starts at offset and returns its index (the number of pieces if offset is the end)
+	size_t pos = 0, i = 0;
+	for (; i < this->pieces.size() && pos + this->pieces[i].len <= offset; ++i)
+		pos += this->pieces[i].len;
+	if (i < this->pieces.size() && pos < offset) {
+		Piece p = this->pieces[i];
+		size_t x = offset - pos;
+		this->pieces[i].len = x;
+		p.len -= x;
+		if (p.off != Piece::ZEROS) { p.off += x; }
+		this->pieces.insert(this->pieces.begin()+(++i), p);
+	}
+	return i;
+}
+bool PieceTableDataSource::insert(size_t offset, size_t count) {
+	if (this->isreadonly() || offset > this->sz) { return false; }
+	if (count == 0) { return true; }
+	size_t i = this->split(offset);
+	if (i > 0 && this->pieces[i-1].off == Piece::ZEROS) {
+		this->pieces[i-1].len += count;
+	} else {
+		Piece p = { Piece::ZEROS, count };
+		this->pieces.insert(this->pieces.begin()+i, p);
+	}
+	this->sz += count;
+	return true;
+}
+bool PieceTableDataSource::erase(size_t offset, size_t count) {
+	if (this->isreadonly() || offset > this->sz || count > this->sz - offset) { return false; }
+	if (count == 0) { return true; }
+	this->split(offset+count);
+	size_t start = this->split(offset), end = start;
+	for (size_t len = 0; len < count; ++end) len += this->pieces[end].len;
+	this->pieces.erase(this->pieces.begin()+start, this->pieces.begin()+end);
+	this->sz -= count;
+	return true;
+}
+bool PieceTableDataSource::resize(size_t new_size) {
+	if (new_size == this->sz) { return !this->isreadonly(); }
+	return (new_size > this->sz) ? this->insert(this->sz, new_size - this->sz) : this->erase(new_size, this->sz - new_size);
+}
+#pragma endregion
+
 #pragma region Memory Map Management Functions
 ///////////////////////////////////////////////////////////////////////////////
 ///// Memory Map Management Functions
 ///////////////////////////////////////////////////////////////////////////////
+// Every mapping is registered under the FileId of the file it maps. Read-only mappings are shared by
+// all readers of the same file (with the same size) and are reference counted. The registry is split
+// into shards that each have a reader-writer lock so finding an existing mapping only takes a shared
+// lock.
 #include <map>
 #include <vector>
 using namespace std;
-typedef map<const_str, vector<void*> > MMFs;
-static MMFs mmfs;
-static void _RemoveMMF(MMFs &mmfs_, const_str file, void* x) {
-	MMFs::iterator v = mmfs_.find(file);
-	if (v != mmfs_.end()) {
-		size_t size = v->second.size();
-		for (size_t i = 0; i < size; ++i) {
-			if (v->second[i] == x) {
-				if (size == 1) {
-					mmfs_.erase(v);
-				} else {
-					if (i != size-1) // move the last element up
-						v->second[i] = v->second[size-1];
-					v->second.pop_back(); // remove the last element
+
+#ifdef USE_WINDOWS_API
+typedef HANDLE NativeFile;
+typedef SRWLOCK RWLock;
+#define RWLOCK_INIT		SRWLOCK_INIT
+#define ReadLock(l)		AcquireSRWLockShared(l)
+#define ReadUnlock(l)	ReleaseSRWLockShared(l)
+#define WriteLock(l)	AcquireSRWLockExclusive(l)
+#define WriteUnlock(l)	ReleaseSRWLockExclusive(l)
+#else
+typedef int NativeFile;
+typedef pthread_rwlock_t RWLock;
+#define RWLOCK_INIT		PTHREAD_RWLOCK_INITIALIZER
+#define ReadLock(l)		pthread_rwlock_rdlock(l)
+#define ReadUnlock(l)	pthread_rwlock_unlock(l)
+#define WriteLock(l)	pthread_rwlock_wrlock(l)
+#define WriteUnlock(l)	pthread_rwlock_unlock(l)
+#endif
+
+struct MMF {
+	void* view;
+	size_t size;
+#ifdef USE_WINDOWS_API
+	void* hMap;
+#endif
+	volatile long refs;
+	bool shared; // read-only, can be given to other readers of the same file
+};
+typedef map<FileId, vector<MMF*> > MMFs;
+
+#define MMF_SHARDS 16
+#define X4(x) x, x, x, x
+static RWLock mmfLocks[MMF_SHARDS] = { X4(X4(RWLOCK_INIT)) };
+#undef X4
+static MMFs mmfs[MMF_SHARDS];
+inline static size_t MMFShard(const FileId& id) { return (size_t)((id.inode ^ (id.inode >> 32) ^ id.device) % MMF_SHARDS); }
+
+static bool GetFileId(NativeFile f, FileId* id, size_t* size) {
+#ifdef USE_WINDOWS_API
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle(f, &info)) { return false; }
+	id->device = info.dwVolumeSerialNumber;
+	id->inode = (((uint64_t)info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+	if (size) *size = (size_t)((((uint64_t)info.nFileSizeHigh) << 32) | info.nFileSizeLow);
+#else
+	struct stat sb;
+	if (fstat(f, &sb) == -1) { return false; }
+	id->device = (uint64_t)sb.st_dev;
+	id->inode = (uint64_t)sb.st_ino;
+	if (size) *size = (size_t)sb.st_size;
+#endif
+	return true;
+}
+static bool GetFileId(const_str file, FileId* id) {
+	bool retval;
+#ifdef USE_WINDOWS_API
+	HANDLE f = CreateFile(file, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (f == INVALID_HANDLE_VALUE) { return false; }
+	retval = GetFileId(f, id, NULL);
+	CloseHandle(f);
+#else
+	int f = _wopen(file, O_RDONLY);
+	if (f == -1) { return false; }
+	retval = GetFileId(f, id, NULL);
+	::close(f);
+#endif
+	return retval;
+}
+
+static MMF* CreateMMF(NativeFile f, size_t size, bool readonly) {
+	MMF* m = new MMF();
+#ifdef USE_WINDOWS_API
+	if ((m->hMap = CreateFileMapping(f, NULL, (readonly ? PAGE_READONLY : PAGE_READWRITE), 0, 0, NULL)) == NULL) { delete m; return NULL; }
+	if ((m->view = MapViewOfFile(m->hMap, (readonly ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS), 0, 0, 0)) == NULL) { CloseHandle(m->hMap); delete m; return NULL; }
+#else
+	if ((m->view = mmap(NULL, size, (readonly ? PROT_READ : PROT_READ | PROT_WRITE), (readonly ? MAP_PRIVATE : MAP_SHARED), f, 0)) == MAP_FAILED) { delete m; return NULL; }
+#endif
+	m->size = size;
+	m->refs = 1;
+	m->shared = readonly;
+	return m;
+}
+static void DestroyMMF(MMF* m) {
+#ifdef USE_WINDOWS_API
+	UnmapViewOfFile(m->view);
+	CloseHandle(m->hMap);
+#else
+	munmap(m->view, m->size);
+#endif
+	delete m;
+}
+static MMF* FindSharedMMF(const vector<MMF*>& views, size_t size) {
+	for (size_t i = 0; i < views.size(); ++i)
+		if (views[i]->shared && views[i]->size == size)
+			return views[i];
+	return NULL;
+}
+
+static void* AcquireMMF(const FileId& id, NativeFile f, size_t size, bool readonly) {
+	size_t s = MMFShard(id);
+	MMF* m = NULL;
+	if (readonly) {
+		// Most of the time the file is already mapped by another reader
+		ReadLock(&mmfLocks[s]);
+		MMFs::const_iterator v = mmfs[s].find(id);
+		if (v != mmfs[s].end() && (m = FindSharedMMF(v->second, size)) != NULL)
+			AtomicIncrement(&m->refs);
+		ReadUnlock(&mmfLocks[s]);
+		if (m) { return m->view; }
+	}
+	WriteLock(&mmfLocks[s]);
+	vector<MMF*>& views = mmfs[s][id];
+	if (readonly && (m = FindSharedMMF(views, size)) != NULL) // check again, another reader may have just mapped it
+		AtomicIncrement(&m->refs);
+	else if ((m = CreateMMF(f, size, readonly)) != NULL)
+		views.push_back(m);
+	else if (views.empty())
+		mmfs[s].erase(id);
+	WriteUnlock(&mmfLocks[s]);
+	return m ? m->view : NULL;
+}
+static void ReleaseMMF(const FileId& id, void* view) {
+	size_t s = MMFShard(id);
+	WriteLock(&mmfLocks[s]);
+	MMFs::iterator v = mmfs[s].find(id);
+	if (v != mmfs[s].end()) {
+		vector<MMF*>& views = v->second;
+		for (size_t i = 0; i < views.size(); ++i) {
+			if (views[i]->view == view) {
+				if (AtomicDecrement(&views[i]->refs) == 0) {
+					DestroyMMF(views[i]);
+					views[i] = views.back(); // move the last element up
+					views.pop_back();
+					if (views.empty())
+						mmfs[s].erase(v);
 				}
 				break;
 			}
 		}
 	}
+	WriteUnlock(&mmfLocks[s]);
 }
-static void* AddMMF  (const_str file, void* mm) { if (mm != NULL && mm != (void*)-1) { mmfs[file].push_back(mm); } return mm; }
-static void RemoveMMF(const_str file, void* mm) { _RemoveMMF(mmfs, file, mm); }
 
-#ifdef USE_WINDOWS_API
-static MMFs mmfViews;
-typedef BOOL (WINAPI *UNMAP_OR_CLOSE)(void*);
-static void* AddMMFView(const_str file, void* view)   { if (view != NULL) mmfViews[file].push_back(view); return view; }
-static void RemoveMMFView(const_str file, void* view) { _RemoveMMF(mmfViews, file, view); }
-static void _UnmapAll(MMFs &mmfs_, const_str file, UNMAP_OR_CLOSE func) {
-	MMFs::iterator v = mmfs_.find(file);
-	if (v != mmfs_.end()) {
-		size_t size = v->second.size();
-		for (size_t i = 0; i < size; ++i)
-			func(v->second[i]);
-		mmfs_.erase(v);
+static bool RetainMMF(const FileId& id, void* view) {
+	size_t s = MMFShard(id);
+	bool found = false;
+	ReadLock(&mmfLocks[s]);
+	MMFs::const_iterator v = mmfs[s].find(id);
+	if (v != mmfs[s].end()) {
+		for (size_t i = 0; i < v->second.size() && !found; ++i)
+			if (v->second[i]->view == view) { AtomicIncrement(&v->second[i]->refs); found = true; }
 	}
+	ReadUnlock(&mmfLocks[s]);
+	return found;
 }
-void MemoryMappedDataSource::UnmapAllViewsOfFile(const_str file) {
-	_UnmapAll(mmfs, file, &CloseHandle);
-	_UnmapAll(mmfViews, file, (UNMAP_OR_CLOSE)&UnmapViewOfFile);
-}
-#else
-void MemoryMappedDataSource::UnmapAllViewsOfFile(const_str file) {
-	MMFs::iterator v = mmfs.find(file);
-	if (v != mmfs.end()) {
-		size_t size = v->second.size();
-		for (size_t i = 0; i < size; ++i)
-			munmap(v->second[i]);
-		mmfs.erase(v);
-	}
+
+bool MemoryMappedDataSource::UnmapAllViewsOfFile(const_str file) {
+	FileId id;
+	if (!GetFileId(file, &id)) { return true; }
+	size_t s = MMFShard(id);
+	ReadLock(&mmfLocks[s]);
+	bool mapped = mmfs[s].find(id) != mmfs[s].end(); // a file is only in the registry while one of its views is used
+	ReadUnlock(&mmfLocks[s]);
+	return !mapped;
 }
-#endif
 #pragma endregion
 
 bool MemoryMappedDataSource::map() {
 #ifdef USE_WINDOWS_API
-	return
-		(this->hMap = AddMMF(this->original, CreateFileMapping(this->hFile, NULL, (readonly ? PAGE_READONLY : PAGE_READWRITE), 0, 0, NULL))) != NULL &&
-		(this->d = AddMMFView(this->original, MapViewOfFile(this->hMap, (readonly ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS), 0, 0, 0))) != NULL;
+	return (this->d = AcquireMMF(this->id, this->hFile, this->sz, this->readonly)) != NULL;
 #else
-	return (this->d = AddMMF(this->original, mmap(NULL, this->sz, (readonly ? PROT_READ : PROT_READ | PROT_WRITE), (readonly ? MAP_PRIVATE : MAP_SHARED), this->fd, 0))) != MAP_FAILED;
+	return (this->d = AcquireMMF(this->id, this->fd, this->sz, this->readonly)) != NULL;
 #endif
 }
 void MemoryMappedDataSource::unmap() {
-#ifdef USE_WINDOWS_API
-	if (this->hMap) {
-		if (this->d)
-		{
-			this->flush();
-			UnmapViewOfFile(this->d);
-			RemoveMMFView(this->original, this->d);
-			this->d = NULL;
-		}
-		RemoveMMF(this->original, this->hMap);
-		CloseHandle(this->hMap);
-		this->hMap = NULL;
-	}
-#else
-	if (this->d == MAP_FAILED) { this->d = NULL; }
-	else if (this->d)
-	{
+	if (this->d) {
 		this->flush();
-		munmap(this->d, this->sz);
-		RemoveMMF(this->original, this->d);
+		ReleaseMMF(this->id, this->d);
 		this->d = NULL;
 	}
-#endif
 }
 #ifdef USE_WINDOWS_API
-MemoryMappedDataSource::MemoryMappedDataSource(const_str file, bool readonly) : readonly(readonly), hFile(INVALID_HANDLE_VALUE), hMap(NULL), d(NULL), sz(0) {
+MemoryMappedDataSource::MemoryMappedDataSource(const_str file, bool readonly) : readonly(readonly), hFile(INVALID_HANDLE_VALUE), id(), d(NULL), sz(0) {
 #else
-MemoryMappedDataSource::MemoryMappedDataSource(const_str file, bool readonly) : readonly(readonly), fd(-1), d(NULL), sz(0) {
+MemoryMappedDataSource::MemoryMappedDataSource(const_str file, bool readonly) : readonly(readonly), fd(-1), id(), d(NULL), sz(0) {
 #endif
-	this->original[0] = 0;
+	// The path is only needed to open the file, after that everything goes through the handle and FileId
 #ifdef USE_WINDOWS_API
-	if (!GetFullPathName(file, ARRAYSIZE(this->original), this->original, NULL) ||
-		(this->hFile = CreateFile(this->original, (readonly ? GENERIC_READ : (GENERIC_READ | GENERIC_WRITE)), FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL)) == INVALID_HANDLE_VALUE ||
-		(this->sz = GetFileSize(this->hFile, 0)) == INVALID_FILE_SIZE)
+	if ((this->hFile = CreateFile(file, (readonly ? GENERIC_READ : (GENERIC_READ | GENERIC_WRITE)), FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL)) == INVALID_HANDLE_VALUE ||
+		!GetFileId(this->hFile, &this->id, &this->sz) || !this->map())
 	{
 		this->close();
 	}
 #else
-	struct stat sb;
-	if ((_wrealpath(file, this->original) == NULL) ||
-		(this->fd = _wopen(this->original, (readonly ? O_RDONLY : O_RDWR))) == -1 ||
-		fstat(this->fd, &sb) == -1)
+	if ((this->fd = _wopen(file, (readonly ? O_RDONLY : O_RDWR))) == -1 ||
+		!GetFileId(this->fd, &this->id, &this->sz) || !this->map())
 	{
 		this->close();
 	}
-	this->sz = sb.st_size;
 #endif
-	if (!map())
+}
+#ifdef USE_WINDOWS_API
+MemoryMappedDataSource::MemoryMappedDataSource() : readonly(true), hFile(INVALID_HANDLE_VALUE), id(), d(NULL), sz(0) { }
+bool MemoryMappedDataSource::open(void* hFile, bool readonly) {
+	this->readonly = readonly;
+	if (!DuplicateHandle(GetCurrentProcess(), hFile, GetCurrentProcess(), &this->hFile, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+		this->hFile = INVALID_HANDLE_VALUE;
+		return false;
+	} else if (!GetFileId(this->hFile, &this->id, &this->sz) || !this->map()) {
+		this->close();
+		return false;
+	}
+	return true;
+}
+MemoryMappedDataSource* MemoryMappedDataSource::FromHandle(void* hFile, bool readonly) {
+	MemoryMappedDataSource* m = new MemoryMappedDataSource();
+	if (!m->open(hFile, readonly)) { delete m; return NULL; }
+	return m;
+}
+#else
+MemoryMappedDataSource::MemoryMappedDataSource() : readonly(true), fd(-1), id(), d(NULL), sz(0) { }
+bool MemoryMappedDataSource::open(int fd, bool readonly) {
+	this->readonly = readonly;
+	if ((this->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) == -1 ||
+		!GetFileId(this->fd, &this->id, &this->sz) || !this->map())
+	{
 		this->close();
+		return false;
+	}
+	return true;
+}
+MemoryMappedDataSource* MemoryMappedDataSource::FromDescriptor(int fd, bool readonly) {
+	MemoryMappedDataSource* m = new MemoryMappedDataSource();
+	if (!m->open(fd, readonly)) { delete m; return NULL; }
+	return m;
 }
+#endif
 MemoryMappedDataSource::~MemoryMappedDataSource() { this->close(); }
 	
 bool MemoryMappedDataSource::isreadonly() const { return this->readonly; };
@@ -222,7 +476,7 @@ void MemoryMappedDataSource::close() {
 #ifdef USE_WINDOWS_API
 	if (this->hFile != INVALID_HANDLE_VALUE) { CloseHandle(this->hFile); this->hFile = INVALID_HANDLE_VALUE; }
 #else
-	if (this->fd != -1) { close(this->fd); this->fd = -1; }
+	if (this->fd != -1) { ::close(this->fd); this->fd = -1; }
 #endif
 	this->sz = 0;
 }
@@ -231,12 +485,270 @@ bool MemoryMappedDataSource::resize(size_t new_size) {
 	if (new_size == this->sz)	{ return true; }
 	this->unmap();
 #ifdef USE_WINDOWS_API
+	size_t old_size = this->sz;
+	this->sz = new_size; // the new mapping must cover the new size
 	if (SetFilePointer(this->hFile, (uint32_t)new_size, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER || !SetEndOfFile(this->hFile) || !this->map()) { this->close(); return false; }
-	if (new_size > this->sz)
-		memset((bytes)this->d+this->sz, 0, new_size-this->sz); // set new memory to 0 (I am unsure if Windows does this automatically like Linux does)
+	if (new_size > old_size)
+		memset((bytes)this->d+old_size, 0, new_size-old_size); // set new memory to 0 (I am unsure if Windows does this automatically like Linux does)
 #else
+	this->sz = new_size; // the new mapping must cover the new size
 	if (ftruncate(this->fd, new_size) == -1 || !this->map()) { this->close(); return false; }
 #endif
-	this->sz = new_size;
 	return true;
 }
+
+#ifdef __linux__
+int MemoryMappedDataSource::CreateMemFile(const char* name, const void* data, size_t size) {
+	int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd == -1) { return -1; }
+	if (ftruncate(fd, size) == -1) { ::close(fd); return -1; }
+	for (size_t pos = 0; pos < size; ) {
+		ssize_t n = pwrite(fd, (const_bytes)data+pos, size-pos, pos);
+		if (n <= 0) { ::close(fd); return -1; }
+		pos += n;
+	}
+	return fd;
+}
+bool MemoryMappedDataSource::SealMemFile(int fd) { return fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != -1; }
+bool MemoryMappedDataSource::copyTo(size_t offset, size_t size, DataSink& sink) {
+	// A writable mapping is shared with the file and a read-only one is never written, so the file has the same data
+	// as the mapping and the kernel can copy it from the page cache (or share the blocks) without it passing through here
+	int out = sink.descriptor();
+	if (out != -1 && this->fd != -1) {
+		loff_t off = offset;
+		ssize_t n = 0;
+		while (size && ((n = copy_file_range(this->fd, &off, out, NULL, size, 0)) > 0 || (n < 0 && errno == EINTR)))
+			if (n > 0) { size -= n; }
+		if (size && n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) { // not supported for these files, nothing was copied by the failed call
+			off_t o = off;
+			while (size && ((n = sendfile(out, this->fd, &o, size)) > 0 || (n < 0 && errno == EINTR)))
+				if (n > 0) { size -= n; }
+			off = o;
+		}
+		if (!size) { return true; }
+		offset = (size_t)off; // the kernel could not copy the rest (e.g. the file is shorter than the mapping), write it from the mapping
+	}
+	return DataSourceImp::copyTo(offset, size, sink);
+}
+#endif
+
+#pragma region Tar Archives
+///////////////////////////////////////////////////////////////////////////////
+///// Tar Archives
+///////////////////////////////////////////////////////////////////////////////
+MappedRangeDataSource::MappedRangeDataSource(const FileId& id, void* view, size_t offset, size_t size) : id(id), view(view), d((bytes)view+offset), sz(size) { }
+MappedRangeDataSource::~MappedRangeDataSource() { this->close(); }
+bool MappedRangeDataSource::isreadonly() const { return true; }
+void* MappedRangeDataSource::data() { return this->d; }
+size_t MappedRangeDataSource::size() const { return this->sz; }
+void MappedRangeDataSource::close() {
+	if (this->view) { ReleaseMMF(this->id, this->view); this->view = NULL; }
+	this->d = NULL;
+	this->sz = 0;
+}
+bool MappedRangeDataSource::resize(size_t) { return false; }
+bool MappedRangeDataSource::flush() { return true; }
+
+#define TAR_BLOCK 512
+struct TarHeader { // POSIX ustar header, also covers the GNU and pax extensions used here
+	char name[100], mode[8], uid[8], gid[8], size[12], mtime[12], chksum[8], typeflag, linkname[100];
+	char magic[6], version[2], uname[32], gname[32], devmajor[8], devminor[8], prefix[155], pad[12];
+};
+static uint64_t TarNumber(const char* x, size_t len) {
+	uint64_t n = 0;
+	if (len && (x[0] & 0x80)) { // GNU base-256 encoding for large values
+		n = x[0] & 0x3F;
+		for (size_t i = 1; i < len; ++i) n = (n << 8) | (uint8_t)x[i];
+	} else {
+		size_t i = 0;
+		while (i < len && (x[i] == ' ' || x[i] == 0)) ++i;
+		for (; i < len && x[i] >= '0' && x[i] <= '7'; ++i) n = (n << 3) | (x[i] - '0');
+	}
+	return n;
+}
+static bool TarChecksumValid(const TarHeader* h) {
+	const_bytes b = (const_bytes)h;
+	uint32_t sum = 0;
+	for (size_t i = 0; i < TAR_BLOCK; ++i)
+		sum += (i >= offsetof(TarHeader, chksum) && i < offsetof(TarHeader, typeflag)) ? ' ' : b[i];
+	return sum == TarNumber(h->chksum, sizeof(h->chksum));
+}
+static std::string TarString(const char* x, size_t len) { size_t n = 0; while (n < len && x[n]) ++n; return std::string(x, n); }
+static void TarPaxRecords(const char* x, size_t len, std::string* path, uint64_t* size) {
+	// Each record is "<len> <key>=<value>\n" where len includes the whole record
+	size_t pos = 0;
+	while (pos < len) {
+		size_t rlen = 0, i = pos;
+		while (i < len && x[i] >= '0' && x[i] <= '9') rlen = rlen * 10 + (x[i++] - '0');
+		if (rlen == 0 || pos + rlen > len || i >= len || x[i] != ' ') { break; }
+		const char *key = x+i+1, *end = x+pos+rlen-1, *eq = key;
+		while (eq < end && *eq != '=') ++eq;
+		if (eq < end) {
+			if (eq-key == 4 && strncmp(key, "path", 4) == 0) { *path = std::string(eq+1, end); }
+			else if (eq-key == 4 && strncmp(key, "size", 4) == 0) { *size = strtoull(std::string(eq+1, end).c_str(), NULL, 10); }
+		}
+		pos += rlen;
+	}
+}
+void TarArchive::index() {
+	const_bytes data = (const_bytes)this->ds.data();
+	size_t size = this->ds.size(), pos = 0;
+	std::string longName, paxPath;
+	uint64_t paxSize = (uint64_t)-1;
+	while (pos + TAR_BLOCK <= size) {
+		const TarHeader* h = (const TarHeader*)(data+pos);
+		if (h->name[0] == 0 || !TarChecksumValid(h)) { break; } // end-of-archive marker (or garbage)
+		uint64_t sz = TarNumber(h->size, sizeof(h->size));
+		pos += TAR_BLOCK;
+		if (sz > size - pos) { break; }
+		switch (h->typeflag) {
+		case 'L': longName = TarString((const char*)data+pos, (size_t)sz); break; // GNU long name for the next entry
+		case 'x': TarPaxRecords((const char*)data+pos, (size_t)sz, &paxPath, &paxSize); break; // pax extended header for the next entry
+		case '0': case '7': case 0: {
+			Member m;
+			if (!paxPath.empty())		{ m.name = paxPath; }
+			else if (!longName.empty())	{ m.name = longName; }
+			else if (h->prefix[0] && strncmp(h->magic, "ustar", 5) == 0 && h->magic[5] == 0) { m.name = TarString(h->prefix, sizeof(h->prefix)) + "/" + TarString(h->name, sizeof(h->name)); }
+			else						{ m.name = TarString(h->name, sizeof(h->name)); }
+			if (paxSize != (uint64_t)-1 && paxSize <= size - pos) { sz = paxSize; }
+			m.offset = pos;
+			m.size = (size_t)sz;
+			this->names[m.name] = this->members.size(); // later members replace earlier ones with the same name
+			this->members.push_back(m);
+		} // fall-through
+		default:
+			longName.clear();
+			paxPath.clear();
+			paxSize = (uint64_t)-1;
+		}
+		pos += roundUpTo<TAR_BLOCK>((size_t)sz);
+	}
+}
+TarArchive::TarArchive() { }
+TarArchive::TarArchive(const_str file) : ds(file, true) { if (this->isopen()) { this->index(); } }
+#ifdef USE_WINDOWS_API
+TarArchive* TarArchive::FromHandle(void* hFile) {
+	TarArchive* t = new TarArchive();
+	if (!t->ds.open(hFile, true)) { delete t; return NULL; }
+	t->index();
+	return t;
+}
+#else
+TarArchive* TarArchive::FromDescriptor(int fd) {
+	TarArchive* t = new TarArchive();
+	if (!t->ds.open(fd, true)) { delete t; return NULL; }
+	t->index();
+	return t;
+}
+#endif
+bool TarArchive::isopen() const { return this->ds.d != NULL; }
+size_t TarArchive::count() const { return this->members.size(); }
+const TarArchive::Member& TarArchive::operator[](size_t i) const { return this->members[i]; }
+const TarArchive::Member* TarArchive::find(const char* name) const {
+	std::map<std::string, size_t>::const_iterator i = this->names.find(name);
+	return i == this->names.end() ? NULL : &this->members[i->second];
+}
+DataSourceImp* TarArchive::open(size_t i) {
+	if (i >= this->members.size() || !RetainMMF(this->ds.id, this->ds.d)) { return NULL; }
+	return new MappedRangeDataSource(this->ds.id, this->ds.d, this->members[i].offset, this->members[i].size);
+}
+DataSourceImp* TarArchive::open(const char* name) {
+	std::map<std::string, size_t>::const_iterator i = this->names.find(name);
+	return i == this->names.end() ? NULL : this->open(i->second);
+}
+#pragma endregion
+
+#pragma region Worker Threads
+///////////////////////////////////////////////////////////////////////////////
+///// Worker Threads
+///////////////////////////////////////////////////////////////////////////////
+struct WorkerStart {
+	Worker work;
+	void* param;
+};
+#ifdef USE_WINDOWS_API
+static DWORD WINAPI WorkerThread(LPVOID s) { ((WorkerStart*)s)->work(((WorkerStart*)s)->param); return 0; }
+#else
+static void* WorkerThread(void* s) { ((WorkerStart*)s)->work(((WorkerStart*)s)->param); return NULL; }
+#endif
+static unsigned int GetProcessorCount() {
+#ifdef USE_WINDOWS_API
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (unsigned int)n : 1;
+#endif
+}
+void PE::Internal::RunWorkers(Worker work, void* param, unsigned int threads, unsigned int max) {
+	if (threads == 0) { threads = GetProcessorCount(); }
+	if (threads > max) { threads = max; }
+	WorkerStart s = { work, param };
+#ifdef USE_WINDOWS_API
+	vector<HANDLE> ts;
+	for (unsigned int i = 1; i < threads; ++i) {
+		HANDLE t = CreateThread(NULL, 0, WorkerThread, &s, 0, NULL);
+		if (t) { ts.push_back(t); } // if a thread cannot be created the others do its share
+	}
+	work(param);
+	for (size_t i = 0; i < ts.size(); ++i) { WaitForSingleObject(ts[i], INFINITE); CloseHandle(ts[i]); }
+#else
+	vector<pthread_t> ts;
+	for (unsigned int i = 1; i < threads; ++i) {
+		pthread_t t;
+		if (pthread_create(&t, NULL, WorkerThread, &s) == 0) { ts.push_back(t); } // if a thread cannot be created the others do its share
+	}
+	work(param);
+	for (size_t i = 0; i < ts.size(); ++i) { pthread_join(ts[i], NULL); }
+#endif
+}
+#pragma endregion
+
+#pragma region Data Sinks
+///////////////////////////////////////////////////////////////////////////////
+///// Data Sinks
+///////////////////////////////////////////////////////////////////////////////
+#ifdef USE_WINDOWS_API
+FileDataSink::FileDataSink(const_str file) : hFile(CreateFile(file, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL)) { }
+bool FileDataSink::isopen() const { return this->hFile != INVALID_HANDLE_VALUE; }
+void FileDataSink::close() { if (this->hFile != INVALID_HANDLE_VALUE) { CloseHandle(this->hFile); this->hFile = INVALID_HANDLE_VALUE; } }
+#else
+FileDataSink::FileDataSink(const_str file) : fd(_wopen(file, O_WRONLY | O_CREAT | O_TRUNC, 0666)) { }
+bool FileDataSink::isopen() const { return this->fd != -1; }
+void FileDataSink::close() { if (this->fd != -1) { ::close(this->fd); this->fd = -1; } }
+#endif
+#ifdef USE_WINDOWS_API
+FileDataSink::FileDataSink(void* hFile) : hFile(INVALID_HANDLE_VALUE) {
+	if (!DuplicateHandle(GetCurrentProcess(), hFile, GetCurrentProcess(), &this->hFile, 0, FALSE, DUPLICATE_SAME_ACCESS)) { this->hFile = INVALID_HANDLE_VALUE; }
+}
+#else
+FileDataSink::FileDataSink(int fd) : fd(fcntl(fd, F_DUPFD_CLOEXEC, 0)) { }
+#endif
+FileDataSink::~FileDataSink() { this->close(); }
+bool FileDataSink::write(const void* data, size_t size) {
+	if (!this->isopen()) { return false; }
+	const_bytes d = (const_bytes)data;
+	while (size) {
+#ifdef USE_WINDOWS_API
+		DWORD w = 0;
+		if (!WriteFile(this->hFile, d, (DWORD)((size > 0x40000000) ? 0x40000000 : size), &w, NULL)) { return false; }
+#else
+		ssize_t w = ::write(this->fd, d, size);
+		if (w < 0) { if (errno == EINTR) { continue; } return false; }
+#endif
+		d += w;
+		size -= w;
+	}
+	return true;
+}
+#ifndef USE_WINDOWS_API
+int FileDataSink::descriptor() const { return this->fd; }
+#endif
+bool DataSourceSink::write(const void* data, size_t size) {
+	if (this->pos + size > this->ds.size() && !this->ds.resize(this->pos + size)) { return false; }
+	memcpy(this->ds + this->pos, data, size);
+	this->pos += size;
+	return true;
+}
+#pragma endregion
@@ -21,15 +21,45 @@
 
 #include "PEDataTypes.h"
 
+#include <assert.h>
+#include <map>
+#include <string>
+#include <vector>
+
 namespace PE {
+	// Identifies a file independent of the path used to open it (volume and file index on Windows, device and inode elsewhere)
+	struct FileId {
+		uint64_t device, inode;
+		inline bool operator ==(const FileId& b) const { return this->device == b.device && this->inode == b.inode; }
+		inline bool operator < (const FileId& b) const { return this->device == b.device ? this->inode < b.inode : this->device < b.device; }
+	};
+
+	class DataSink;
+
 	class DataSourceImp {
 	public:
+		virtual ~DataSourceImp() { }
 		virtual bool isreadonly() const = 0;
 		virtual void close() = 0;
 		virtual bool flush() = 0;
 		virtual void* data() = 0;
 		virtual size_t size() const = 0;
 		virtual bool resize(size_t new_size) = 0;
+
+		// Inserts count zeroed bytes at offset or erases count bytes at offset, moving all of the data after it.
+		// Sources that can do this without moving the data override these, the default returns false so that
+		// the caller falls back to resize and memmove.
+		virtual bool insert(size_t offset, size_t count) { (void)offset; (void)count; return false; }
+		virtual bool erase(size_t offset, size_t count) { (void)offset; (void)count; return false; }
+
+		// True if data() does the work of pending edits, so it should only be called once the data is needed again
+		virtual bool isdeferred() const { return false; }
+		// The data without doing any pending edits and the number of bytes at the start of it that are already up to date
+		virtual void* prefix(size_t* count) { *count = this->size(); return this->data(); }
+
+		// Writes size bytes at offset to the sink. The default writes them from the data, sources backed by a file
+		// override this so the kernel can copy them when the sink is also a file.
+		virtual bool copyTo(size_t offset, size_t size, DataSink& sink);
 	};
 	
 	class RawDataSource : public DataSourceImp {
@@ -47,21 +77,36 @@ namespace PE {
 		virtual bool flush();
 	};
 
+	// Mappings are kept in a process-wide registry keyed by FileId, read-only sources of the same file share a single mapping
 	class MemoryMappedDataSource : public DataSourceImp {
+		friend class TarArchive;
+
 		bool readonly;
-		wchar_t original[LARGE_PATH];
 #ifdef USE_WINDOWS_API
-		void *hFile, *hMap;
+		void *hFile;
 #else
 		int fd;
 #endif
+		FileId id;
 		void* d;
 		size_t sz;
 
 		bool map();
 		void unmap();
+		MemoryMappedDataSource(); // not open
+#ifdef USE_WINDOWS_API
+		bool open(void* hFile, bool readonly); // duplicates hFile
+#else
+		bool open(int fd, bool readonly); // duplicates fd
+#endif
 	public:
 		MemoryMappedDataSource(const_str file, bool readonly = false);
+		// Opened files are given to named factories so that a 0 or NULL is never taken as either a path or a handle
+#ifdef USE_WINDOWS_API
+		static MemoryMappedDataSource* FromHandle(void* hFile, bool readonly = false); // the handle is duplicated, the caller still owns hFile, returns NULL on error
+#else
+		static MemoryMappedDataSource* FromDescriptor(int fd, bool readonly = false); // the descriptor is duplicated, the caller still owns fd, returns NULL on error
+#endif
 		~MemoryMappedDataSource();
 		virtual bool isreadonly() const;
 		virtual void* data();
@@ -69,34 +114,181 @@ namespace PE {
 		virtual void close();
 		virtual bool resize(size_t new_size);
 		virtual bool flush();
+#ifdef __linux__
+		virtual bool copyTo(size_t offset, size_t size, DataSink& sink); // uses copy_file_range or sendfile when the sink is a file
+#endif
 		
-		static void UnmapAllViewsOfFile(const_str file);
+		// Views are shared and reference counted so they are never unmapped while a data source still uses them, returns true
+		// if the file has no views left and false if some are still in use (they are unmapped once their last user closes)
+		static bool UnmapAllViewsOfFile(const_str file);
+
+#ifdef __linux__
+		// Creates an anonymous memory file (memfd) holding a copy of data, returning the descriptor or -1.
+		// The image can be edited through FromDescriptor(fd) and then sealed.
+		static int CreateMemFile(const char* name, const void* data, size_t size);
+		// Seals a memory file against any further changes, after which other processes given the descriptor
+		// can map it read-only with FromDescriptor(fd, true) without copying. All writable sources of the file must be closed first.
+		static bool SealMemFile(int fd);
+#endif
+	};
+
+	// Wraps another source and keeps edits as a list of pieces of it, so inserting and erasing (including
+	// resizing) only splices the list. Until the first edit the data is still in place, so it can be read and
+	// written directly (e.g. the headers). The image is only built when something past that is accessed or
+	// when it is flushed, which writes it back to the wrapped source. Offsets are always into the current
+	// image, so dyn_ptrs follow the edits just like they follow a memmove.
+	class PieceTableDataSource : public DataSourceImp {
+		struct Piece {
+			static const size_t ZEROS = (size_t)-1;
+			size_t off, len; // off is into base or ZEROS
+		};
+		DataSourceImp* ds;
+		bytes base; // either the wrapped source's data or the last built image
+		bool owned; // base is the last built image
+		std::vector<Piece> pieces;
+		size_t sz;
+
+		bool isclean() const;
+		bool build();
+		size_t split(size_t offset);
+	public:
+		PieceTableDataSource(DataSourceImp* ds); // takes ownership of ds
+		~PieceTableDataSource();
+		virtual bool isreadonly() const;
+		virtual void* data();
+		virtual size_t size() const;
+		virtual void close();
+		virtual bool resize(size_t new_size);
+		virtual bool flush();
+		virtual bool insert(size_t offset, size_t count);
+		virtual bool erase(size_t offset, size_t count);
+		virtual bool isdeferred() const;
+		virtual void* prefix(size_t* count);
+	};
+
+	// A read-only range of a mapped file, which keeps the mapping alive until it is closed
+	class MappedRangeDataSource : public DataSourceImp {
+		FileId id;
+		void *view, *d;
+		size_t sz;
+
+		MappedRangeDataSource(const FileId& id, void* view, size_t offset, size_t size);
+		friend class TarArchive;
+	public:
+		~MappedRangeDataSource();
+		virtual bool isreadonly() const;
+		virtual void* data();
+		virtual size_t size() const;
+		virtual void close();
+		virtual bool resize(size_t new_size);
+		virtual bool flush();
+	};
+
+	// An uncompressed tar archive that is mapped once and indexed, the files in it can be opened as read-only
+	// data sources (e.g. for a File) that point directly into the archive's mapping instead of being extracted
+	class TarArchive {
+	public:
+		struct Member {
+			std::string name;
+			size_t offset, size; // of the data within the archive
+		};
+	private:
+		MemoryMappedDataSource ds;
+		std::vector<Member> members;
+		std::map<std::string, size_t> names;
+
+		TarArchive(); // not open
+		void index();
+	public:
+		TarArchive(const_str file);
+#ifdef USE_WINDOWS_API
+		static TarArchive* FromHandle(void* hFile); // the handle is duplicated, returns NULL on error
+#else
+		static TarArchive* FromDescriptor(int fd); // the descriptor is duplicated, returns NULL on error
+#endif
+		bool isopen() const;
+
+		size_t count() const;
+		const Member& operator[](size_t i) const;
+		const Member* find(const char* name) const;
+
+		DataSourceImp* open(size_t i); // returns NULL on error, the source is deleted by the DataSource that uses it and may outlive the archive
+		DataSourceImp* open(const char* name);
+	};
+
+	// A destination for data that is produced in pieces, so that it can be written straight from where it is instead of
+	// being gathered into a buffer first
+	class DataSink {
+	public:
+		virtual ~DataSink() { }
+		virtual bool write(const void* data, size_t size) = 0;
+#ifndef USE_WINDOWS_API
+		virtual int descriptor() const { return -1; } // the file being written at its current position, so sources can copy to it in the kernel
+#endif
+	};
+
+	// Writes to a file, which is created or truncated
+	class FileDataSink : public DataSink {
+#ifdef USE_WINDOWS_API
+		void *hFile;
+#else
+		int fd;
+#endif
+		FileDataSink(const FileDataSink&);
+		FileDataSink& operator =(const FileDataSink&);
+	public:
+		FileDataSink(const_str file);
+#ifdef USE_WINDOWS_API
+		FileDataSink(void* hFile); // the handle is duplicated, the caller still owns hFile, writes start at its current position
+#else
+		FileDataSink(int fd); // the descriptor is duplicated, the caller still owns fd, writes start at its current position
+#endif
+		~FileDataSink();
+		bool isopen() const;
+		void close();
+		virtual bool write(const void* data, size_t size);
+#ifndef USE_WINDOWS_API
+		virtual int descriptor() const;
+#endif
 	};
 
 	class DataSource {
+		friend class PinnedView;
+
 		DataSourceImp* ds;
 		bool readonly;
-		void* data;
+		mutable dyn_base data; // for a deferred source only the prefix is up to date after edits, the rest is brought up to date when it is used
 		size_t sz;
+		unsigned int generation; // changes whenever data or sz changes
 
 		inline void update() {
-			if (this->ds) { this->data = this->ds->data(); this->sz = this->ds->size(); }
-			else { this->data = NULL; this->sz = 0; }
+			size_t valid = 0;
+			void* d = this->ds ? this->ds->prefix(&valid) : NULL;
+			size_t s = this->ds ? this->ds->size() : 0;
+			if (d != this->data.ptr || s != this->sz) { this->data.ptr = d; this->sz = s; ++this->generation; }
+			this->data.valid = (valid < s) ? valid : (size_t)-1;
 		}
 
 	public:
-		inline DataSource(DataSourceImp* ds) : ds(ds), readonly(ds && ds->isreadonly()), data(ds ? ds->data() : NULL), sz(ds ? ds->size() : 0) { }
+		inline DataSource(DataSourceImp* ds) : ds(ds), readonly(ds && ds->isreadonly()), sz(0), generation(0) { this->data.ptr = NULL; this->data.src = ds; this->update(); }
 		//inline static DataSource create(pntr data, size_t size, bool readonly = false) { return DataSource(new RawDataSource(data, size, readonly)); }
 		//inline static DataSource create(const_str file, bool readonly = false) { return DataSource(new MemoryMappedDataSource(file, readonly)); }
 
-		inline bool isopen() const { return this->data != NULL; }
+		inline bool isopen() const { return this->data.ptr != NULL; }
 		inline bool isreadonly() const { return this->readonly; }
+		inline bool isdeferred() const { return this->ds && this->ds->isdeferred(); } // edits are only done once the data is used or flushed
 
 		inline size_t size() const { return this->sz; }
 
-		inline bool flush() { return this->ds->flush(); }
-		inline void close() { if (this->ds) { this->ds->close(); delete this->ds; this->ds = NULL; this->update(); } }
+		// Brings all of the data up to date after edits to a deferred source, everything that uses the data does this when it needs to
+		inline void refresh() const { this->data.get(); }
+
+		inline bool flush() { bool retval = this->ds->flush(); this->update(); return retval; }
+		inline void close() { if (this->ds) { this->ds->close(); delete this->ds; this->ds = NULL; this->data.src = NULL; this->update(); } }
 		inline bool resize(size_t new_size) { bool retval = this->ds->resize(new_size); if (retval) { this->update(); } return retval; }
+		inline bool insert(size_t off, size_t count) { bool retval = this->ds->insert(off, count); if (retval) { this->update(); } return retval; }
+		inline bool erase(size_t off, size_t count) { bool retval = this->ds->erase(off, count); if (retval) { this->update(); } return retval; }
+		inline bool copyTo(size_t off, size_t size, DataSink& sink) const { this->refresh(); return off <= this->sz && size <= this->sz - off && this->ds->copyTo(off, size, sink); }
 
 		//inline operator bool() const { return this->data != NULL; } // returns if the data is open
 
@@ -108,10 +300,43 @@ namespace PE {
 		inline       dyn_ptr<byte> operator +(const size_t& off)       { return dyn_ptr<byte>(&this->data, off); }
 		inline const dyn_ptr<byte> operator +(const size_t& off) const { return dyn_ptr<byte>(&this->data, off); }
 
-		inline ptrdiff_t operator -(const_bytes b) const { return (const_bytes)this->data - b; }
+		inline ptrdiff_t operator -(const_bytes b) const { return (const_bytes)this->data.get() - b; }
+
+		inline       byte& operator[](const size_t& off)       { return       ((bytes)this->data.get())[off]; }
+		inline const byte& operator[](const size_t& off) const { return ((const_bytes)this->data.get())[off]; }
+
+		// A plain pointer to size bytes at off, which are only brought up to date if they are not already
+		inline       bytes at(size_t off, size_t size)       { return       (bytes)this->data.get(off+size)+off; }
+		inline const_bytes at(size_t off, size_t size) const { return (const_bytes)this->data.get(off+size)+off; }
+	};
+
+	// Writes into a data source starting at an offset, growing it when a write goes past the end
+	// Resizing the source ahead of time to the final size avoids resizing it many times
+	class DataSourceSink : public DataSink {
+		DataSource& ds;
+		size_t pos;
+	public:
+		inline DataSourceSink(DataSource& ds, size_t offset = 0) : ds(ds), pos(offset) { }
+		inline size_t position() const { return this->pos; }
+		virtual bool write(const void* data, size_t size);
+	};
+
+	// A scope in which the data is not resized, so plain pointers into it stay valid. Hot loops can use these instead
+	// of dyn_ptrs, which reload the base pointer on every access. Debug builds check that the data did not move.
+	// When only the first used bytes are accessed (e.g. the headers) a deferred source does not have to do its edits.
+	class PinnedView {
+		const DataSource& ds;
+		bytes d;
+		unsigned int generation;
+		inline void check() const { assert(this->generation == this->ds.generation && this->d == this->ds.data.ptr && "data was resized while pinned"); }
+	public:
+		inline PinnedView(const DataSource& ds, size_t used = (size_t)-1) : ds(ds), d((bytes)ds.data.get(used)), generation(ds.generation) { }
+		inline ~PinnedView() { this->check(); }
 
-		inline       byte& operator[](const size_t& off)       { return       ((bytes)this->data)[off]; }
-		inline const byte& operator[](const size_t& off) const { return ((const_bytes)this->data)[off]; }
+		inline bytes data() const { this->check(); return this->d; }
+		inline size_t size() const { this->check(); return this->ds.sz; }
+		template<typename T> inline       T* operator()(      dyn_ptr<T>& p) const { this->check(); return (T*)p.addr(); }
+		template<typename T> inline const T* operator()(const dyn_ptr<T>& p) const { this->check(); return p.addr(); }
 	};
 
 	inline ptrdiff_t operator -(const_bytes a, const DataSource& b) { return a - (b + 0); }
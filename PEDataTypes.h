@@ -45,6 +45,10 @@ typedef __int64 int64_t;
 #endif
 
 #include <stdlib.h>
+#include <string.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #define CASSERT(pred)	switch(0){case 0:case pred:;}
 
@@ -62,42 +66,81 @@ namespace PE {
 	inline static bool IsIntResID(const_resid r) { return (((size_t)r) >> 16) == 0; }
 	inline static resid MakeResID(uint16_t i) { return (resid)(size_t)i; }
 	inline static uint16_t ResID2Int(const_resid r) { return (uint16_t)(size_t)r; }
-	
+
+	// A view of a UTF-16 string within resource data, not necessarily null-terminated
+	// Unlike wchar_t this is always 2 bytes per character, so it matches the data on all platforms
+	struct utf16_view {
+		const uint16_t* data;
+		size_t length; // in characters
+		inline utf16_view() : data(NULL), length(0) { }
+		inline utf16_view(const uint16_t* data, size_t length) : data(data), length(length) { }
+		inline bool empty() const { return this->length == 0; }
+		inline uint16_t operator[](size_t i) const { return this->data[i]; }
+		inline bool equals(const char* ascii, size_t len, bool ignoreCase = false) const {
+			if (len != this->length) return false;
+			for (size_t i = 0; i < len; ++i) {
+				uint16_t a = this->data[i], b = (byte)ascii[i];
+				if (ignoreCase) { if (a >= 'A' && a <= 'Z') a += 'a' - 'A'; if (b >= 'A' && b <= 'Z') b += 'a' - 'A'; }
+				if (a != b) return false;
+			}
+			return true;
+		}
+		inline bool equals(const char* ascii, bool ignoreCase = false) const { return this->equals(ascii, strlen(ascii), ignoreCase); }
+		inline bool equals(const utf16_view& s) const { return this->length == s.length && (this->data == s.data || memcmp(this->data, s.data, this->length * sizeof(uint16_t)) == 0); }
+	};
+
 	static const void*const null = NULL;
 
+	class DataSourceImp;
+
+	// The memory that dyn_ptrs point into. A data source that defers its edits (see DataSource) may only have the start
+	// of it in place, the source brings the rest up to date before a dyn_ptr uses anything past that.
+	struct dyn_base {
+		void* ptr;
+		size_t valid; // the number of bytes at ptr that are up to date, (size_t)-1 if all of them are
+		DataSourceImp* src;
+		void* reload(); // in PEDataSource.cpp
+		inline void* get(size_t end = (size_t)-1) { return (end > this->valid) ? this->reload() : this->ptr; }
+	};
+	static dyn_base nullbase = { NULL, (size_t)-1, NULL };
+
 	// A class that acts as a pointer but automatically is updated when the underlying memory shifts
 	template<typename T> class dyn_ptr;
 	template<> class dyn_ptr<void>;
 	template<typename T> class dyn_ptr_base {
 		template<typename T2> friend class dyn_ptr;
+		friend class PinnedView;
 
 	protected:
-		void*const* base;
+		dyn_base* base;
 		size_t off;
-		inline       T* get()       { return (      T*)((*(const_bytes*)this->base)+this->off); }
-		inline const T* get() const { return (const T*)((*(const_bytes*)this->base)+this->off); }
+		inline       T* get()       { return (      T*)((const_bytes)this->base->get()+this->off); }
+		inline const T* get() const { return (const T*)((const_bytes)this->base->get()+this->off); }
+		inline       T* get(size_t count)       { return (      T*)((const_bytes)this->base->get(this->off+count*sizeof(T))+this->off); } // only count elements are used
+		inline const T* get(size_t count) const { return (const T*)((const_bytes)this->base->get(this->off+count*sizeof(T))+this->off); }
+		inline const T* addr() const { return (const T*)((const_bytes)this->base->ptr+this->off); } // not brought up to date, only for comparing with other dyn_ptrs
 	
 		template<typename T2> friend class dyn_ptr_base;
 
-		inline dyn_ptr_base() : base((void*const*)&null), off(0) { }
-		inline dyn_ptr_base(void*const* base, size_t off = 0) : base(base), off(off) { }
-		inline dyn_ptr_base(void*const* base, T* val)         : base(base), off((bytes)val - *(const_bytes*)base) { }
+		inline dyn_ptr_base() : base(&nullbase), off(0) { }
+		inline dyn_ptr_base(dyn_base* base, size_t off = 0) : base(base), off(off) { }
+		inline dyn_ptr_base(dyn_base* base, T* val)         : base(base), off((const_bytes)val - (const_bytes)base->ptr) { }
 
 	public:
-		inline operator       bool ()       { return this->get() != NULL; }
-		inline operator       bool () const { return this->get() != NULL; }
-		inline bool operator      !() const { return this->get() == NULL; }
+		inline operator       bool ()       { return this->addr() != NULL; }
+		inline operator       bool () const { return this->addr() != NULL; }
+		inline bool operator      !() const { return this->addr() == NULL; }
 		inline operator       T*   ()       { return this->get(); }
 		inline operator const T*   () const { return this->get(); }
 
 		inline bool equals(const dyn_ptr_base<T>& b) const { return this->base == b.base && this->off == b.off; }
 
-		inline bool operator ==(const dyn_ptr_base<T>& b) const { return this->get() == b.get(); }
-		inline bool operator !=(const dyn_ptr_base<T>& b) const { return this->get() != b.get(); }
-		inline bool operator <=(const dyn_ptr_base<T>& b) const { return this->get() <= b.get(); }
-		inline bool operator >=(const dyn_ptr_base<T>& b) const { return this->get() >= b.get(); }
-		inline bool operator < (const dyn_ptr_base<T>& b) const { return this->get() <  b.get(); }
-		inline bool operator > (const dyn_ptr_base<T>& b) const { return this->get() >  b.get(); }
+		inline bool operator ==(const dyn_ptr_base<T>& b) const { return this->addr() == b.addr(); }
+		inline bool operator !=(const dyn_ptr_base<T>& b) const { return this->addr() != b.addr(); }
+		inline bool operator <=(const dyn_ptr_base<T>& b) const { return this->addr() <= b.addr(); }
+		inline bool operator >=(const dyn_ptr_base<T>& b) const { return this->addr() >= b.addr(); }
+		inline bool operator < (const dyn_ptr_base<T>& b) const { return this->addr() <  b.addr(); }
+		inline bool operator > (const dyn_ptr_base<T>& b) const { return this->addr() >  b.addr(); }
 		inline bool operator ==(const T* b) const { return this->get() == b; }
 		inline bool operator !=(const T* b) const { return this->get() != b; }
 		inline bool operator <=(const T* b) const { return this->get() <= b; }
@@ -118,8 +161,8 @@ namespace PE {
 	template<typename T> class dyn_ptr : public dyn_ptr_base<T> {
 	public:
 		inline dyn_ptr() : dyn_ptr_base<T>() { }
-		inline dyn_ptr(void*const* base, size_t off_ = 0) : dyn_ptr_base<T>(base, off_) { }
-		inline dyn_ptr(void*const* base, T* val)          : dyn_ptr_base<T>(base, val) { }
+		inline dyn_ptr(dyn_base* base, size_t off_ = 0) : dyn_ptr_base<T>(base, off_) { }
+		inline dyn_ptr(dyn_base* base, T* val)          : dyn_ptr_base<T>(base, val) { }
 		                      inline dyn_ptr(const dyn_ptr<T>& b)                 : dyn_ptr_base<T>(b.base, b.off) { }
 		template<typename T2> inline dyn_ptr(const dyn_ptr_base<T2>& b)           : dyn_ptr_base<T>(b.base, b.off) { }
 		template<typename T2> inline dyn_ptr(const dyn_ptr_base<T2> base, T* val) : dyn_ptr_base<T>(base.base, val) { }
@@ -131,12 +174,12 @@ namespace PE {
 		template<typename T2> inline operator       dyn_ptr<T2>()       { return dyn_ptr<T2>(this->base, this->off); }
 		template<typename T2> inline operator const dyn_ptr<T2>() const { return dyn_ptr<T2>(this->base, this->off); }
 
-		inline bool operator ==(const dyn_ptr_base<void>& b) const { return this->get() == b.get(); }
-		inline bool operator !=(const dyn_ptr_base<void>& b) const { return this->get() != b.get(); }
-		inline bool operator <=(const dyn_ptr_base<void>& b) const { return this->get() <= b.get(); }
-		inline bool operator >=(const dyn_ptr_base<void>& b) const { return this->get() >= b.get(); }
-		inline bool operator < (const dyn_ptr_base<void>& b) const { return this->get() <  b.get(); }
-		inline bool operator > (const dyn_ptr_base<void>& b) const { return this->get() >  b.get(); }
+		inline bool operator ==(const dyn_ptr_base<void>& b) const { return (const void*)this->addr() == b.addr(); }
+		inline bool operator !=(const dyn_ptr_base<void>& b) const { return (const void*)this->addr() != b.addr(); }
+		inline bool operator <=(const dyn_ptr_base<void>& b) const { return (const void*)this->addr() <= b.addr(); }
+		inline bool operator >=(const dyn_ptr_base<void>& b) const { return (const void*)this->addr() >= b.addr(); }
+		inline bool operator < (const dyn_ptr_base<void>& b) const { return (const void*)this->addr() <  b.addr(); }
+		inline bool operator > (const dyn_ptr_base<void>& b) const { return (const void*)this->addr() >  b.addr(); }
 		inline bool operator ==(const void* b) const { return this->get() == b; }
 		inline bool operator !=(const void* b) const { return this->get() != b; }
 		inline bool operator <=(const void* b) const { return this->get() <= b; }
@@ -150,12 +193,12 @@ namespace PE {
 		friend inline bool operator < (const void* a, const dyn_ptr_base<T>& b) { return a <  b.get(); }
 		friend inline bool operator > (const void* a, const dyn_ptr_base<T>& b) { return a >  b.get(); }
 		
-		inline       T& operator *()        { return *this->get(); }
-		inline const T& operator *() const  { return *this->get(); }
-		inline       T* operator ->()       { return this->get();  }
-		inline const T* operator ->() const { return this->get();  }
+		inline       T& operator *()        { return *this->get(1); }
+		inline const T& operator *() const  { return *this->get(1); }
+		inline       T* operator ->()       { return this->get(1);  }
+		inline const T* operator ->() const { return this->get(1);  }
 				
-		inline ptrdiff_t operator -(const dyn_ptr<T>& b) const { return this->get() - b.get(); }
+		inline ptrdiff_t operator -(const dyn_ptr<T>& b) const { return this->addr() - b.addr(); }
 		inline ptrdiff_t operator -(const T* b)          const { return this->get() - b;       }
 		inline ptrdiff_t operator -(      T* b)          const { return this->get() - b;       }
 		friend inline ptrdiff_t operator -(const T* a, const dyn_ptr<T>& b) { return a - b.get(); }
@@ -168,8 +211,8 @@ namespace PE {
 		
 		// [] accessors for many integer sizes, both signed and unsigned
 		#define ARRAY_ACCESSORS(I) \
-			inline       T& operator [](const I& i)       { return this->get()[i]; } \
-			inline const T& operator [](const I& i) const { return this->get()[i]; }
+			inline       T& operator [](const I& i)       { return this->get((size_t)i+1)[i]; } \
+			inline const T& operator [](const I& i) const { return this->get((size_t)i+1)[i]; }
 		ARRAY_ACCESSORS(size_t)
 		ARRAY_ACCESSORS(ptrdiff_t)
 		#if SIZE_MAX > 0xffffffffffffffff
@@ -226,8 +269,8 @@ namespace PE {
 	template<> class dyn_ptr<void> : public dyn_ptr_base<void> {
 	public:
 		inline dyn_ptr() : dyn_ptr_base<void>() { }
-		inline dyn_ptr(void*const* base, size_t off = 0) : dyn_ptr_base<void>(base, off) { }
-		inline dyn_ptr(void*const* base, void* val)      : dyn_ptr_base<void>(base, val) { }
+		inline dyn_ptr(dyn_base* base, size_t off = 0) : dyn_ptr_base<void>(base, off) { }
+		inline dyn_ptr(dyn_base* base, void* val)      : dyn_ptr_base<void>(base, val) { }
 		                      inline dyn_ptr(const dyn_ptr<void>& b)                 : dyn_ptr_base<void>(b.base, b.off) { }
 		template<typename T2> inline dyn_ptr(const dyn_ptr_base<T2>& b)              : dyn_ptr_base<void>(b.base, b.off) { }
 		template<typename T2> inline dyn_ptr(const dyn_ptr_base<T2> base, void* val) : dyn_ptr_base<void>(base.base, val) { }
@@ -254,6 +297,20 @@ namespace PE {
 		template<> inline size_t roundUpTo<2>(size_t x) { return (x + 1) & ~0x1; }
 		template<> inline size_t roundUpTo<4>(size_t x) { return (x + 3) & ~0x3; }
 		inline static size_t roundUpTo(size_t x, size_t mult) { size_t mod = x % mult; return (mod == 0) ? x : (x + mult - mod); }
+
+		// Atomic reference counting, returns the new value
+		#ifdef _MSC_VER
+		inline static long AtomicIncrement(volatile long* x) { return _InterlockedIncrement(x); }
+		inline static long AtomicDecrement(volatile long* x) { return _InterlockedDecrement(x); }
+		#else
+		inline static long AtomicIncrement(volatile long* x) { return __sync_add_and_fetch(x, 1); }
+		inline static long AtomicDecrement(volatile long* x) { return __sync_sub_and_fetch(x, 1); }
+		#endif
+
+		// Calls work(param) from the given number of threads (0 for one per processor) but no more than max, the calling thread
+		// is one of them, and returns once all of them are done
+		typedef void (*Worker)(void* param);
+		void RunWorkers(Worker work, void* param, unsigned int threads, unsigned int max);
 	}
 
 	static const unsigned int LARGE_PATH = 32767;
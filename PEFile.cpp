@@ -124,19 +124,234 @@ void* File::GetResourceDirect(void* _data, const_resid type, const_resid name) {
 	// Get the resource within the RSRC section
 	return GetResourceDirectInRsrc(data, rsrcSect, type, name);
 }
+//-----------------------------------------------------------------------------
+const const_resid File::ANY_NAME = FIRST_ENTRY;
+struct RsrcBounds { const_bytes rsrc; size_t size; uint32_t va, pntr; };
+static const SectionHeader* GetRsrcSectionDirect(const_bytes data, size_t size) {
+	if (size < sizeof(DOSHeader)) { return NULL; }
+	const DOSHeader *dosh = (DOSHeader*)data;
+	if (dosh->e_magic != DOSHeader::SIGNATURE || dosh->e_lfanew < 0)	{ return NULL; }
+	size_t peOffset = (size_t)dosh->e_lfanew;
+	if (peOffset > size || size - peOffset < sizeof(NTHeaders))		{ return NULL; }
+	const NTHeaders *nth = (NTHeaders*)(data+peOffset);
+	if (nth->Signature != NTHeaders::SIGNATURE)						{ return NULL; }
+	const FileHeader* header = &nth->FileHeader;
+	size_t sectOffset = peOffset + sizeof(NTHeaders) + header->SizeOfOptionalHeader;
+	if (sectOffset > size || (size - sectOffset) / sizeof(SectionHeader) < header->NumberOfSections) { return NULL; }
+	const SectionHeader *sections = (SectionHeader*)(data+sectOffset);
+	for (uint16_t i = 0; i < header->NumberOfSections; ++i)
+		if (strncmp((const char*)sections[i].Name, ".rsrc", ARRAYSIZE(sections[i].Name)) == 0) { return sections+i; }
+	return NULL;
+}
+static bool GetRsrcBounds(const_bytes data, size_t size, RsrcBounds* r) {
+	const SectionHeader *rsrcSect = GetRsrcSectionDirect(data, size);
+	if (!rsrcSect || rsrcSect->PointerToRawData == 0 || rsrcSect->PointerToRawData >= size) { return false; }
+	r->rsrc = data + rsrcSect->PointerToRawData;
+	r->size = size - rsrcSect->PointerToRawData;
+	if (r->size > rsrcSect->SizeOfRawData) { r->size = rsrcSect->SizeOfRawData; }
+	r->va = rsrcSect->VirtualAddress;
+	r->pntr = rsrcSect->PointerToRawData;
+	return true;
+}
+static const ResourceDirectoryEntry* GetDirEntries(const RsrcBounds& r, uint32_t off, uint32_t* count) {
+	if (off > r.size || r.size - off < sizeof(ResourceDirectory)) { return NULL; }
+	const ResourceDirectory* dir = (ResourceDirectory*)(r.rsrc + off);
+	uint32_t n = (uint32_t)dir->NumberOfNamedEntries + dir->NumberOfIdEntries;
+	if ((r.size - off - sizeof(ResourceDirectory)) / sizeof(ResourceDirectoryEntry) < n) { return NULL; }
+	*count = n;
+	return (ResourceDirectoryEntry*)(dir+1);
+}
+static bool EntryMatches(const RsrcBounds& r, const ResourceDirectoryEntry& e, const_resid id) {
+	if (id == FIRST_ENTRY)		{ return true; }
+	if (IsIntResID(id))			{ return !e.NameIsString && e.Id == ResID2Int(id); }
+	if (!e.NameIsString || r.size < sizeof(uint16_t) || e.NameOffset > r.size - sizeof(uint16_t)) { return false; }
+	// The name is a length-prefixed UTF-16 string, compared by character since wchar_t may not be 2 bytes
+	const uint16_t* s = (const uint16_t*)(r.rsrc + e.NameOffset);
+	size_t len = s[0];
+	if ((r.size - e.NameOffset - sizeof(uint16_t)) / sizeof(uint16_t) < len) { return false; }
+	for (size_t i = 0; i < len; ++i)
+		if (id[i] == 0 || (uint32_t)id[i] != s[i+1]) { return false; }
+	return id[len] == 0;
+}
+static bool ResolveDataEntry(const RsrcBounds& r, const ResourceDirectoryEntry& e, File::DirectQuery& q) {
+	if (e.DataIsDirectory || e.OffsetToData > r.size || r.size - e.OffsetToData < sizeof(ResourceDataEntry)) { return false; }
+	const ResourceDataEntry *de = (ResourceDataEntry*)(r.rsrc + e.OffsetToData);
+	if (de->OffsetToData < r.va) { return false; }
+	uint32_t off = de->OffsetToData - r.va;
+	if (off > r.size || r.size - off < de->Size) { return false; }
+	q.found = true;
+	q.lang = e.Id;
+	q.offset = r.pntr + off;
+	q.size = de->Size;
+	q.codepage = de->CodePage;
+	return true;
+}
+size_t File::GetResourcesDirect(const void* _data, size_t size, DirectQuery* queries, size_t count) {
+	const_bytes data = (const_bytes)_data;
+	for (size_t i = 0; i < count; ++i) { queries[i].found = false; queries[i].offset = 0; queries[i].size = 0; queries[i].codepage = 0; }
+
+	// Get the RSRC section
+	RsrcBounds r;
+	if (!GetRsrcBounds(data, size, &r)) { return 0; }
+
+	// Walk each directory at most once, checking all of the queries at each level
+	size_t found = 0;
+	uint32_t nTypes, nNames, nLangs;
+	const ResourceDirectoryEntry *types = GetDirEntries(r, 0, &nTypes), *names, *langs;
+	if (!types) { return 0; }
+	for (uint32_t t = 0; t < nTypes && found < count; ++t) {
+		if (!types[t].DataIsDirectory) { continue; }
+		bool any = false;
+		for (size_t i = 0; i < count && !any; ++i) { any = !queries[i].found && EntryMatches(r, types[t], queries[i].type); }
+		if (!any || (names = GetDirEntries(r, types[t].OffsetToDirectory, &nNames)) == NULL) { continue; }
+		for (uint32_t n = 0; n < nNames && found < count; ++n) {
+			if (!names[n].DataIsDirectory) { continue; }
+			langs = NULL;
+			for (size_t i = 0; i < count; ++i) {
+				DirectQuery& q = queries[i];
+				if (q.found || !EntryMatches(r, types[t], q.type) || !EntryMatches(r, names[n], q.name)) { continue; }
+				if (!langs && (langs = GetDirEntries(r, names[n].OffsetToDirectory, &nLangs)) == NULL) { break; }
+				for (uint32_t l = 0; l < nLangs; ++l)
+					if (!langs[l].NameIsString && (q.lang == ANY_LANG || langs[l].Id == q.lang) && ResolveDataEntry(r, langs[l], q)) { ++found; break; }
+			}
+		}
+	}
+	return found;
+}
+static File::DirectName GetDirectName(const RsrcBounds& r, const ResourceDirectoryEntry& e) {
+	File::DirectName n;
+	n.id = 0;
+	if (!e.NameIsString)	{ n.id = e.Id; }
+	else if (r.size >= sizeof(uint16_t) && e.NameOffset <= r.size - sizeof(uint16_t)) {
+		const uint16_t* s = (const uint16_t*)(r.rsrc + e.NameOffset);
+		if ((r.size - e.NameOffset - sizeof(uint16_t)) / sizeof(uint16_t) >= s[0]) { n.str = utf16_view(s+1, s[0]); }
+	}
+	return n;
+}
+size_t File::EnumerateResourcesDirect(const void* data, size_t size, DirectEnumerator f, void* param) {
+	RsrcBounds r;
+	if (!GetRsrcBounds((const_bytes)data, size, &r)) { return 0; }
+	size_t found = 0;
+	uint32_t nTypes, nNames, nLangs;
+	const ResourceDirectoryEntry *types = GetDirEntries(r, 0, &nTypes), *names, *langs;
+	if (!types) { return 0; }
+	for (uint32_t t = 0; t < nTypes; ++t) {
+		if (!types[t].DataIsDirectory || (names = GetDirEntries(r, types[t].OffsetToDirectory, &nNames)) == NULL) { continue; }
+		DirectName type = GetDirectName(r, types[t]);
+		if (types[t].NameIsString && type.str.empty()) { continue; }
+		for (uint32_t n = 0; n < nNames; ++n) {
+			if (!names[n].DataIsDirectory || (langs = GetDirEntries(r, names[n].OffsetToDirectory, &nLangs)) == NULL) { continue; }
+			DirectName name = GetDirectName(r, names[n]);
+			if (names[n].NameIsString && name.str.empty()) { continue; }
+			for (uint32_t l = 0; l < nLangs; ++l) {
+				DirectQuery q;
+				q.type = type.str.empty() ? MakeResID(type.id) : NULL;
+				q.name = name.str.empty() ? MakeResID(name.id) : NULL;
+				if (langs[l].NameIsString || !ResolveDataEntry(r, langs[l], q)) { continue; }
+				++found;
+				if (!f(type, name, q, param)) { return found; }
+			}
+		}
+	}
+	return found;
+}
+#pragma endregion
+
+#pragma region Exporting Resources
+///////////////////////////////////////////////////////////////////////////////
+///// Exporting Resources
+///////////////////////////////////////////////////////////////////////////////
+struct ExportItem {
+	File::DirectName type, name;
+	uint16_t lang;
+	uint32_t offset, size;
+};
+struct Export {
+	const DataSource* data;
+	File::ExportSinkOpener open;
+	void* param;
+	std::vector<ExportItem> items;
+	std::vector<size_t> types; // index of the first item of each type, and one past the last item
+	long count;
+	volatile long next, written;
+};
+static bool AddExportItem(const File::DirectName& type, const File::DirectName& name, const File::DirectQuery& res, void* param) {
+	Export* e = (Export*)param;
+	ExportItem i = { type, name, res.lang, res.offset, res.size };
+	if (e->items.empty() || type.id != e->items.back().type.id || type.str.data != e->items.back().type.str.data) { e->types.push_back(e->items.size()); }
+	e->items.push_back(i);
+	return true;
+}
+static void DoExport(void* param) {
+	Export* e = (Export*)param;
+	long t;
+	while ((t = AtomicIncrement(&e->next)) < e->count) {
+		for (size_t i = e->types[t]; i < e->types[t+1]; ++i) {
+			const ExportItem& x = e->items[i];
+			DataSink* sink = e->open(x.type, x.name, x.lang, x.size, e->param);
+			if (!sink) { continue; }
+			if (e->data->copyTo(x.offset, x.size, *sink)) { AtomicIncrement(&e->written); }
+			delete sink;
+		}
+	}
+}
+size_t File::exportResources(ExportSinkOpener open, void* param, unsigned int threads) const {
+	if (!this->isLoaded()) { return 0; }
+	Export e;
+	e.data = &this->data;
+	e.open = open;
+	e.param = param;
+	e.next = -1;
+	e.written = 0;
+	PinnedView v(this->data); // the names point into the data so it stays pinned until the workers are done
+	EnumerateResourcesDirect(v.data(), v.size(), &AddExportItem, &e);
+	e.count = (long)e.types.size();
+	e.types.push_back(e.items.size());
+	if (e.count == 0) { return 0; }
+	RunWorkers(&DoExport, &e, threads, (unsigned int)e.count);
+	return (size_t)e.written;
+}
+static void AppendNumber(std::wstring& path, uint16_t x) {
+	wchar_t n[8], *p = n + ARRAYSIZE(n);
+	*--p = 0;
+	do { *--p = (wchar_t)(L'0' + x % 10); x /= 10; } while (x);
+	path += p;
+}
+static void AppendExportName(std::wstring& path, const File::DirectName& n) {
+	if (n.str.empty()) { path += L'#'; AppendNumber(path, n.id); return; }
+	for (size_t i = 0; i < n.str.length; ++i) {
+		uint16_t c = n.str.data[i];
+		bool bad = c < 0x20 || wcschr(L"\\/:*?\"<>|#", (wchar_t)c) != NULL || (c >= 0xD800 && c < 0xE000); // not allowed in a file name, # is only for IDs
+		path += bad ? L'_' : (wchar_t)c;
+	}
+}
+static DataSink* OpenExportFile(const File::DirectName& type, const File::DirectName& name, uint16_t lang, size_t, void* param) {
+	std::wstring path((const_str)param);
+	path += L'/';
+	AppendExportName(path, type);
+	path += L'_';
+	AppendExportName(path, name);
+	path += L'_';
+	AppendNumber(path, lang);
+	path += L".bin";
+	FileDataSink* f = new FileDataSink(path.c_str());
+	if (!f->isopen()) { delete f; return NULL; }
+	return f;
+}
+size_t File::exportResources(const_str dir, unsigned int threads) const { return this->exportResources(&OpenExportFile, (void*)dir, threads); }
 #pragma endregion
 
 #pragma region Loading Functions
 ///////////////////////////////////////////////////////////////////////////////
 ///// Loading Functions
 ///////////////////////////////////////////////////////////////////////////////
-File::File(void* data, size_t size, bool readonly) : data(new RawDataSource(data, size, readonly)), res(NULL), modified(false) {
+File::File(void* data, size_t size, bool readonly) : data(new RawDataSource(data, size, readonly)), pe32plus(false), res(NULL), resLayout(NULL), modified(false) {
 	if (!this->data.isopen() || !this->load()) { this->unload(); }
 }
-File::File(const_str file, bool readonly) : data(new MemoryMappedDataSource(file, readonly)), res(NULL), modified(false) {
+File::File(const_str file, bool readonly) : data(new MemoryMappedDataSource(file, readonly)), pe32plus(false), res(NULL), resLayout(NULL), modified(false) {
 	if (!this->data.isopen() || !this->load()) { this->unload(); }
 }
-File::File(DataSource data) : data(data), res(NULL), modified(false) {
+File::File(DataSource data) : data(data), pe32plus(false), res(NULL), resLayout(NULL), modified(false) {
 	if (!this->data.isopen() || !this->load()) { this->unload(); }
 }
 bool File::load() {
@@ -149,13 +364,14 @@ bool File::load() {
 	if (this->nth32->Signature != NTHeaders::SIGNATURE)	{ set_err(ERROR_INVALID_DATA); return false; }
 	this->header = dyn_ptr<FileHeader>(this->dosh, &this->nth32->FileHeader); // identical for 32 and 64 bits
 	this->opt = dyn_ptr<OptionalHeader>(this->dosh, &this->nth32->OptionalHeader); // beginning is identical for 32 and 64 bits
-	bool is64bit = this->is64bit(), is32bit = this->is32bit();
+	bool is64bit = (this->header->Characteristics & FileHeader::MACHINE_32BIT) == 0, is32bit = !is64bit;
 
 	if ((is64bit && this->opt->Magic != OptionalHeader64::SIGNATURE) ||
 		(is32bit && this->opt->Magic != OptionalHeader32::SIGNATURE) ||
 		(is64bit == is32bit))							{ set_err(ERROR_INVALID_DATA); return false; }
 
-	this->dataDir = dyn_ptr<DataDirectory>(this->dosh, is64bit ? this->nth64->OptionalHeader.DataDirectory : this->nth32->OptionalHeader.DataDirectory);
+	this->pe32plus = is64bit;
+	this->dataDir = (dyn_ptr<DataDirectory>)(this->data + this->peOffset + (is64bit ? (size_t)PE32Plus::DATA_DIRECTORY_OFFSET : (size_t)PE32::DATA_DIRECTORY_OFFSET));
 	this->sections = (dyn_ptr<SectionHeader>)(this->data+this->peOffset+sizeof(uint32_t)+sizeof(FileHeader)+this->header->SizeOfOptionalHeader);
 
 	// Load resources
@@ -165,14 +381,26 @@ bool File::load() {
 	if ((this->res = Rsrc::createFromRSRCSection(this->data+0, this->data.size(), rsrc)) == NULL)
 		return false;
 
+	this->readVersionInfo();
+	return true;
+}
+void File::readVersionInfo() {
 	// Get the current version and modification information from the resources
-	FileVersionBasicInfo *v = FileVersionBasicInfo::Get(GetResourceDirectInRsrc(this->data+0, rsrc, ResType::VERSION, FIRST_ENTRY));
+	size_t verSize = 0;
+	void* ver = GetResourceDirectInRsrc(this->data+0, this->getSectionHeader(".rsrc"), ResType::VERSION, FIRST_ENTRY, NULL, NULL, &verSize);
+	FileVersionBasicInfo *v = FileVersionBasicInfo::Get(ver, verSize);
+	this->version = PE::Version::Version(); // the resources may have been replaced by ones without a version
+	this->modified = false;
 	if (v) {
 		this->version = v->FileVersion;
 		this->modified = (v->FileFlagsMask & v->FileFlags & (FileVersionBasicInfo::PATCHED | FileVersionBasicInfo::SPECIALBUILD)) > 0;
 	}
-
-	return true;
+}
+Rsrc* File::rsrc() const {
+	if (!this->res && this->data.isopen() &&
+		(this->res = Rsrc::createFromRSRCSection(this->data+0, this->data.size(), const_cast<File*>(this)->getSectionHeader(".rsrc"))) != NULL)
+		this->res->layout = this->resLayout; // not a change, the next compile uses it
+	return this->res;
 }
 File::~File() { unload(); }
 void File::unload() {
@@ -182,6 +410,7 @@ void File::unload() {
 	this->sections = nulldp;
 	set_err(err);
 }
+size_t File::getHeadersEnd() const { return this->peOffset+sizeof(uint32_t)+sizeof(FileHeader)+this->header->SizeOfOptionalHeader+this->header->NumberOfSections*sizeof(SectionHeader); }
 bool File::isLoaded() const { return this->data.isopen(); }
 bool File::isReadOnly() const { return this->data.isreadonly(); }
 #pragma endregion
@@ -190,9 +419,9 @@ bool File::isReadOnly() const { return this->data.isreadonly(); }
 ///////////////////////////////////////////////////////////////////////////////
 ///// Header Functions
 ///////////////////////////////////////////////////////////////////////////////
-bool File::is32bit() const { return (this->header->Characteristics & FileHeader::MACHINE_32BIT) != 0; }
-bool File::is64bit() const { return (this->header->Characteristics & FileHeader::MACHINE_32BIT) == 0; }
-uint64_t File::getImageBase() const { return this->is64bit() ? this->opt->ImageBase64 : this->opt->ImageBase32; }
+bool File::is32bit() const { return !this->pe32plus; }
+bool File::is64bit() const { return this->pe32plus; }
+uint64_t File::getImageBase() const { return this->pe32plus ? PE32Plus::ImageBase(this->opt) : PE32::ImageBase(this->opt); }
 
 dyn_ptr<FileHeader> File::getFileHeader() { return this->header; }
 dyn_ptr<NTHeaders32> File::getNtHeaders32() { return this->nth32; }
@@ -202,15 +431,17 @@ const dyn_ptr<FileHeader> File::getFileHeader() const { return this->header; }
 const dyn_ptr<NTHeaders32> File::getNtHeaders32() const { return this->nth32; }
 const dyn_ptr<NTHeaders64> File::getNtHeaders64() const { return this->nth64; }
 
-uint32_t File::getDataDirectoryCount() const { return this->is64bit() ? this->nth64->OptionalHeader.NumberOfRvaAndSizes : this->nth32->OptionalHeader.NumberOfRvaAndSizes; }
+uint32_t File::getDataDirectoryCount() const { return this->pe32plus ? this->nth64->OptionalHeader.NumberOfRvaAndSizes : this->nth32->OptionalHeader.NumberOfRvaAndSizes; }
 dyn_ptr<DataDirectory> File::getDataDirectory(int i) { return this->dataDir+i; }
 const dyn_ptr<DataDirectory> File::getDataDirectory(int i) const { return this->dataDir+i; }
 
 int File::getSectionHeaderCount() const { return this->header->NumberOfSections; }
 dyn_ptr<SectionHeader> File::getSectionHeader(int i) { return this->sections+i; }
 dyn_ptr<SectionHeader> File::getSectionHeader(const char *str, int *index) {
-	for (uint16_t i = 0; i < this->header->NumberOfSections; i++) {
-		if (strncmp((const char*)this->sections[i].Name, str, ARRAYSIZE(this->sections[i].Name)) == 0) {
+	PinnedView pin(this->data, this->getHeadersEnd());
+	const SectionHeader* s = pin(this->sections);
+	for (uint16_t i = 0, n = pin(this->header)->NumberOfSections; i < n; i++) {
+		if (strncmp((const char*)s[i].Name, str, ARRAYSIZE(s[i].Name)) == 0) {
 			if (index) *index = i;
 			return this->sections+i;
 		}
@@ -218,8 +449,10 @@ dyn_ptr<SectionHeader> File::getSectionHeader(const char *str, int *index) {
 	return nulldp;
 }
 dyn_ptr<SectionHeader> File::getSectionHeaderByRVA(uint32_t rva, int *index) {
-	for (uint16_t i = 0; i < this->header->NumberOfSections; i++)
-		if (this->sections[i].VirtualAddress <= rva && rva < this->sections[i].VirtualAddress + this->sections[i].VirtualSize) {
+	PinnedView pin(this->data, this->getHeadersEnd());
+	const SectionHeader* s = pin(this->sections);
+	for (uint16_t i = 0, n = pin(this->header)->NumberOfSections; i < n; i++)
+		if (s[i].VirtualAddress <= rva && rva < s[i].VirtualAddress + s[i].VirtualSize) {
 			if (index) *index = i;
 			return this->sections+i;
 		}
@@ -228,8 +461,10 @@ dyn_ptr<SectionHeader> File::getSectionHeaderByRVA(uint32_t rva, int *index) {
 dyn_ptr<SectionHeader> File::getSectionHeaderByVA(uint64_t va, int *index) { return this->getSectionHeaderByRVA((uint32_t)(va - this->getImageBase()), index); }
 const dyn_ptr<SectionHeader> File::getSectionHeader(int i) const { return this->sections+i; }
 const dyn_ptr<SectionHeader> File::getSectionHeader(const char *str, int *index) const {
-	for (uint16_t i = 0; i < this->header->NumberOfSections; i++) {
-		if (strncmp((const char*)this->sections[i].Name, str, ARRAYSIZE(this->sections[i].Name)) == 0) {
+	PinnedView pin(this->data, this->getHeadersEnd());
+	const SectionHeader* s = pin(this->sections);
+	for (uint16_t i = 0, n = pin(this->header)->NumberOfSections; i < n; i++) {
+		if (strncmp((const char*)s[i].Name, str, ARRAYSIZE(s[i].Name)) == 0) {
 			if (index) *index = i;
 			return this->sections+i;
 		}
@@ -237,8 +472,10 @@ const dyn_ptr<SectionHeader> File::getSectionHeader(const char *str, int *index)
 	return nulldp;
 }
 const dyn_ptr<SectionHeader> File::getSectionHeaderByRVA(uint32_t rva, int *index) const {
-	for (uint16_t i = 0; i < this->header->NumberOfSections; i++)
-		if (this->sections[i].VirtualAddress <= rva && rva < this->sections[i].VirtualAddress + this->sections[i].VirtualSize) {
+	PinnedView pin(this->data, this->getHeadersEnd());
+	const SectionHeader* s = pin(this->sections);
+	for (uint16_t i = 0, n = pin(this->header)->NumberOfSections; i < n; i++)
+		if (s[i].VirtualAddress <= rva && rva < s[i].VirtualAddress + s[i].VirtualSize) {
 			if (index) *index = i;
 			return this->sections+i;
 		}
@@ -269,13 +506,10 @@ dyn_ptr<SectionHeader> File::getExpandedSectionHdr(int i, uint32_t room) {
 	// Move by a multiple of "file alignment"
 	uint32_t new_size = (uint32_t)roundUpTo(min_size, falign), move = new_size - size;
 	
-	// Increase file size (invalidates all local pointers to the file data)
-	if (!this->setSize(this->data.size()+move))				{ return nulldp; }
-	sect = this->sections+i; // update the section header pointer 
-
-	// Shift data and fill space with zeros
+	// Insert zeros at the end of the section (invalidates all local pointers to the file data)
 	uint32_t end = sect->PointerToRawData + size;
-	if (!this->shift(end, move) || !this->zero(move, end))	{ return nulldp; }
+	if (!this->insert(end, move))							{ return nulldp; }
+	sect = this->sections+i; // update the section header pointer
 
 	// Update section headers
 	sect->SizeOfRawData += move; // update the size of the expanding section header
@@ -292,7 +526,7 @@ dyn_ptr<SectionHeader> File::getExpandedSectionHdr(int i, uint32_t room) {
 	if (chars & SectionHeader::CNT_INITIALIZED_DATA)	this->opt->SizeOfInitializedData += move;
 	if (chars & SectionHeader::CNT_UNINITIALIZED_DATA)	this->opt->SizeOfUninitializedData += move;
 
-	this->flush();
+	if (!this->data.isdeferred()) { this->flush(); } // a deferred source is written once when it is saved
 
 	return sect;
 }
@@ -312,14 +546,14 @@ dyn_ptr<SectionHeader> File::createSection(int i, const char *name, uint32_t roo
 	// Get general information about the header
 	uint16_t nSects = this->header->NumberOfSections;
 	dyn_ptr<SectionHeader> last_sect = this->sections + nSects - 1;
-	uint32_t header_used_size = (uint32_t)((dyn_ptr<byte>)(last_sect+1) - this->data), header_raw_size = (uint32_t)roundUpTo(header_used_size, falign), header_space = header_raw_size - header_used_size;
+	uint32_t header_used_size = (uint32_t)this->getHeadersEnd(), header_raw_size = (uint32_t)roundUpTo(header_used_size, falign), header_space = header_raw_size - header_used_size;
 	if (header_space < sizeof(SectionHeader))										{ return nulldp; }	// no room in header to store a new SectionHeader
 
 	// Get information about where this new section will be placed
 	bool at_end = i >= nSects, no_sects = nSects == 0;
 	sect = at_end ? (no_sects ? dyn_ptr<SectionHeader>() : last_sect) : this->sections + i;
 	if (at_end) i = nSects;
-	uint32_t pos = at_end ? header_used_size : (uint32_t)((dyn_ptr<byte>)sect - this->data);
+	uint32_t pos = at_end ? header_used_size : (uint32_t)(header_used_size - (nSects - i) * sizeof(SectionHeader));
 
 	// Get the size, position, and address of the new section
 	uint32_t raw_size = (uint32_t)roundUpTo(room, falign), move_va = (uint32_t)roundUpTo(raw_size, salign);
@@ -336,13 +570,10 @@ dyn_ptr<SectionHeader> File::createSection(int i, const char *name, uint32_t roo
 		memset(s.Name+name_len, 0, ARRAYSIZE(s.Name)-name_len);
 	}
 
-	// Increase file size (invalidates all local pointers to the file data)
-	if (!this->setSize(this->data.size() + raw_size))								{ return nulldp; }
+	// Insert zeros for the new section (invalidates all local pointers to the file data)
+	if (!this->insert(pntr, raw_size))												{ return nulldp; }
 	// cannot use sect or last_sect unless they are updated!
 
-	// Shift data and fill space with zeros
-	if (!this->shift(pntr, raw_size) || !this->zero(raw_size, pntr))				{ return nulldp; }
-
 	// Update the section headers
 	if (!at_end && !this->move(pos, header_used_size-pos, sizeof(SectionHeader)))	{ return nulldp; }
 	if (!this->set(&s, sizeof(SectionHeader), pos))									{ return nulldp; }
@@ -368,7 +599,7 @@ dyn_ptr<SectionHeader> File::createSection(int i, const char *name, uint32_t roo
 	if (chars & SectionHeader::CNT_INITIALIZED_DATA)	this->opt->SizeOfInitializedData += raw_size;
 	if (chars & SectionHeader::CNT_UNINITIALIZED_DATA)	this->opt->SizeOfUninitializedData += raw_size;
 
-	this->flush();
+	if (!this->data.isdeferred()) { this->flush(); }
 
 	return this->sections+i;
 }
@@ -402,15 +633,41 @@ bool File::setSize(size_t dwSize, bool grow_only) {
 ///// Resource Shortcut Functions
 ///////////////////////////////////////////////////////////////////////////////
 #ifdef EXPOSE_DIRECT_RESOURCES
-Rsrc *File::getResources() { return this->res; }
-const Rsrc *File::getResources() const { return this->res; }
+Rsrc *File::getResources() { return this->rsrc(); }
+const Rsrc *File::getResources() const { return this->rsrc(); }
 #endif
-bool File::resourceExists(const_resid type, const_resid name, uint16_t lang) const { return this->res->exists(type, name, lang); }
-bool File::resourceExists(const_resid type, const_resid name, uint16_t* lang) const { return this->res->exists(type, name, lang); }
-void* File::getResource(const_resid type, const_resid name, uint16_t lang, size_t* size) const { return this->res->get(type, name, lang, size); }
-void* File::getResource(const_resid type, const_resid name, uint16_t* lang, size_t* size) const { return this->res->get(type, name, lang, size); }
-bool File::removeResource(const_resid type, const_resid name, uint16_t lang) { return !this->data.isreadonly() && this->res->remove(type, name, lang); }
-bool File::addResource(const_resid type, const_resid name, uint16_t lang, const void* dat, size_t size, Overwrite overwrite) { return !this->data.isreadonly() && this->res->add(type, name, lang, dat, size, overwrite); }
+bool File::resourceExists(const_resid type, const_resid name, uint16_t lang) const { return this->rsrc()->exists(type, name, lang); }
+bool File::resourceExists(const_resid type, const_resid name, uint16_t* lang) const { return this->rsrc()->exists(type, name, lang); }
+void* File::getResource(const_resid type, const_resid name, uint16_t lang, size_t* size) const { return this->rsrc()->get(type, name, lang, size); }
+void* File::getResource(const_resid type, const_resid name, uint16_t* lang, size_t* size) const { return this->rsrc()->get(type, name, lang, size); }
+bool File::removeResource(const_resid type, const_resid name, uint16_t lang) { return !this->data.isreadonly() && this->rsrc()->remove(type, name, lang); }
+bool File::addResource(const_resid type, const_resid name, uint16_t lang, const void* dat, size_t size, Overwrite overwrite) { return !this->data.isreadonly() && this->rsrc()->add(type, name, lang, dat, size, overwrite); }
+bool File::mergeRES(const RESData* res, size_t count, Overwrite overwrite, bool borrow) {
+	if (this->data.isreadonly()) { return false; }
+	for (size_t i = 0; i < count; ++i) // check them all first so a bad file in the middle does not leave a partial merge
+		if (!RESReader::IsValid(res[i].data, res[i].size)) { return false; }
+	for (size_t i = 0; i < count; ++i)
+		if (this->rsrc()->addRES((const_bytes)res[i].data, res[i].size, overwrite, borrow) == (size_t)-1) { return false; }
+	return this->save();
+}
+bool File::mergeRES(const const_str* files, size_t count, Overwrite overwrite) {
+	if (this->data.isreadonly()) { return false; }
+	// Each mapping is owned by a payload of the whole file, which the resources point into so nothing is copied before saving
+	std::vector<ResourcePayload*> res;
+	res.reserve(count);
+	bool ok = true;
+	for (size_t i = 0; i < count && ok; ++i) {
+		MemoryMappedDataSource* m = new MemoryMappedDataSource(files[i], true);
+		res.push_back(ResourcePayload::Adopt(m->data(), m->size(), &ResourcePayload::Delete<MemoryMappedDataSource>, m));
+		ok = m->data() && RESReader::IsValid(m->data(), m->size());
+	}
+	size_t i = 0;
+	for (; i < res.size() && ok; ++i)
+		ok = this->rsrc()->addRES(res[i], overwrite) != (size_t)-1; // takes the reference
+	for (; i < res.size(); ++i)
+		res[i]->release();
+	return ok && this->save();
+}
 #pragma endregion
 
 #pragma region Direct Data Functions
@@ -419,10 +676,19 @@ bool File::addResource(const_resid type, const_resid name, uint16_t lang, const
 ///////////////////////////////////////////////////////////////////////////////
 dyn_ptr<byte> File::get(uint32_t dwOffset, uint32_t *dwSize) { if (dwSize) *dwSize = (uint32_t)this->data.size() - dwOffset; return this->data + dwOffset; }
 const dyn_ptr<byte> File::get(uint32_t dwOffset, uint32_t *dwSize) const { if (dwSize) *dwSize = (uint32_t)this->data.size() - dwOffset; return this->data + dwOffset; }
-bool File::set(const void* lpBuffer, uint32_t dwSize, uint32_t dwOffset) { return !this->data.isreadonly() && (dwOffset + dwSize <= this->data.size()) && memcpy(this->data + dwOffset, lpBuffer, dwSize); }
-bool File::zero(uint32_t dwSize, uint32_t dwOffset) { return !this->data.isreadonly() && (dwOffset + dwSize <= this->data.size()) && memset(this->data + dwOffset, 0, dwSize); }
-bool File::move(uint32_t dwOffset, uint32_t dwSize, int32_t dwDistanceToMove) { return !this->data.isreadonly() && (dwOffset + dwSize + dwDistanceToMove <= this->data.size()) && memmove(this->data+dwOffset+dwDistanceToMove, this->data+dwOffset, dwSize); }
+bool File::set(const void* lpBuffer, uint32_t dwSize, uint32_t dwOffset) { return !this->data.isreadonly() && (dwOffset + dwSize <= this->data.size()) && memcpy(this->data.at(dwOffset, dwSize), lpBuffer, dwSize); }
+bool File::zero(uint32_t dwSize, uint32_t dwOffset) { return !this->data.isreadonly() && (dwOffset + dwSize <= this->data.size()) && memset(this->data.at(dwOffset, dwSize), 0, dwSize); }
+bool File::move(uint32_t dwOffset, uint32_t dwSize, int32_t dwDistanceToMove) {
+	if (this->data.isreadonly() || dwOffset + dwSize + dwDistanceToMove > this->data.size()) { return false; }
+	bytes d = this->data.at(0, dwOffset + dwSize + (dwDistanceToMove > 0 ? dwDistanceToMove : 0));
+	return memmove(d+dwOffset+dwDistanceToMove, d+dwOffset, dwSize) != NULL;
+}
 bool File::shift(uint32_t dwOffset, int32_t dwDistanceToMove) { return move(dwOffset, (uint32_t)this->data.size() - dwOffset - dwDistanceToMove, dwDistanceToMove); }
+bool File::insert(uint32_t dwOffset, uint32_t dwSize) {
+	if (this->data.isreadonly() || dwOffset > this->data.size())	{ return false; }
+	if (this->data.insert(dwOffset, dwSize))						{ return true; } // e.g. a PieceTableDataSource only splices
+	return this->setSize(this->data.size() + dwSize) && this->shift(dwOffset, dwSize) && this->zero(dwSize, dwOffset);
+}
 bool File::flush() { return this->data.flush(); }
 #pragma endregion
 
@@ -432,9 +698,43 @@ bool File::flush() { return this->data.flush(); }
 ///////////////////////////////////////////////////////////////////////////////
 #define CHK_SUM_FOLD(c) (((c)&0xffff) + ((c)>>16))
 #define CHK_SUM_OFFSET	(peOffset+sizeof(uint32_t)+sizeof(FileHeader)+offsetof(OptionalHeader, CheckSum))
-bool File::UpdatePEChkSum(bytes data, size_t dwSize, size_t peOffset, uint32_t dwOldCheck) {
-	uint16_t *ptr = (uint16_t*)data;
-	size_t len = dwSize/sizeof(uint16_t);
+// Gets the ranges skipped by the image hash: the checksum, the security data directory entry, and the certificate table
+// They are returned sorted by start, some may be missing if the headers are truncated
+static int GetImageHashSkips(const_bytes data, size_t dwSize, size_t peOffset, size_t skip[3][2]) {
+	int n = 0;
+	size_t ck = CHK_SUM_OFFSET;
+	if (ck + sizeof(uint32_t) > dwSize) { return 0; }
+	skip[n][0] = ck; skip[n][1] = ck + sizeof(uint32_t); ++n;
+	const OptionalHeader* opt = (OptionalHeader*)(data+peOffset+sizeof(uint32_t)+sizeof(FileHeader));
+	size_t dd = peOffset + ((opt->Magic == OptionalHeader64::SIGNATURE) ? (size_t)PE32Plus::DATA_DIRECTORY_OFFSET : (size_t)PE32::DATA_DIRECTORY_OFFSET);
+	size_t sec = dd + DataDirectory::SECURITY * sizeof(DataDirectory);
+	if (sec + sizeof(DataDirectory) > dwSize || *(uint32_t*)(data+dd-sizeof(uint32_t)) <= DataDirectory::SECURITY) { return n; } // NumberOfRvaAndSizes precedes the directories
+	skip[n][0] = sec; skip[n][1] = sec + sizeof(DataDirectory); ++n;
+	const DataDirectory* d = (DataDirectory*)(data+sec);
+	if (d->VirtualAddress && d->Size && d->VirtualAddress < dwSize) { // VirtualAddress is a file offset for the security directory
+		skip[n][0] = d->VirtualAddress;
+		skip[n][1] = (d->Size < dwSize - d->VirtualAddress) ? d->VirtualAddress + d->Size : dwSize;
+		for (int i = n++; i > 0 && skip[i][0] < skip[i-1][0]; --i) {
+			size_t a = skip[i][0], b = skip[i][1];
+			skip[i][0] = skip[i-1][0]; skip[i][1] = skip[i-1][1];
+			skip[i-1][0] = a; skip[i-1][1] = b;
+		}
+	}
+	return n;
+}
+static void HashRange(Hasher* hash, const_bytes data, size_t pos, size_t end, const size_t skip[3][2], int n) {
+	for (int i = 0; i < n && pos < end; ++i) {
+		if (skip[i][1] <= pos || skip[i][0] >= end) { continue; }
+		if (skip[i][0] > pos) { hash->update(data+pos, skip[i][0]-pos); }
+		pos = skip[i][1];
+	}
+	if (pos < end) { hash->update(data+pos, end-pos); }
+}
+uint32_t File::ComputePEChkSum(const_bytes data, size_t dwSize, size_t peOffset, uint32_t dwOldCheck, Hasher* hash) {
+	size_t skip[3][2];
+	int nSkip = hash ? GetImageHashSkips(data, dwSize, peOffset, skip) : 0;
+	const uint16_t *ptr = (const uint16_t*)data;
+	size_t len = dwSize/sizeof(uint16_t), pos = 0;
 	uint32_t c = 0;
 	while (len) {
 		size_t l = (len < 0x4000) ? len : 0x4000;
@@ -442,19 +742,33 @@ bool File::UpdatePEChkSum(bytes data, size_t dwSize, size_t peOffset, uint32_t d
 		for (size_t j=0; j<l; ++j)
 			c += *ptr++;
 		c = CHK_SUM_FOLD(c);
+		if (hash) { // hash the chunk while it is still in cache
+			HashRange(hash, data, pos, pos + l*sizeof(uint16_t), skip, nSkip);
+			pos += l*sizeof(uint16_t);
+		}
 	}
 	uint32_t dwCheck = (uint32_t)(uint16_t)CHK_SUM_FOLD(c);
 	if (dwSize & 1) {
 		dwCheck += data[dwSize-1];
 		dwCheck = CHK_SUM_FOLD(dwCheck);
+		if (hash) { HashRange(hash, data, dwSize-1, dwSize, skip, nSkip); }
 	}
 	dwCheck = ((dwCheck-1<dwOldCheck)?(dwCheck-1):dwCheck) - dwOldCheck;
 	dwCheck = CHK_SUM_FOLD(dwCheck);
 	dwCheck = CHK_SUM_FOLD(dwCheck);
-	*(uint32_t*)(data+CHK_SUM_OFFSET) = (uint32_t)(dwCheck + dwSize);
+	return (uint32_t)(dwCheck + dwSize);
+}
+bool File::UpdatePEChkSum(bytes data, size_t dwSize, size_t peOffset, uint32_t dwOldCheck, Hasher* hash) {
+	*(uint32_t*)(data+CHK_SUM_OFFSET) = ComputePEChkSum(data, dwSize, peOffset, dwOldCheck, hash);
+	return true;
+}
+bool File::updatePEChkSum(Hasher* hash) { return !this->data.isreadonly() && UpdatePEChkSum(this->data+0, this->data.size(), this->peOffset, this->opt->CheckSum, hash) && this->flush(); }
+bool File::getImageHash(Hasher* hash, uint32_t* checkSum) const {
+	if (!this->data.isopen()) { return false; }
+	uint32_t c = ComputePEChkSum(this->data+0, this->data.size(), this->peOffset, this->opt->CheckSum, hash);
+	if (checkSum) { *checkSum = c; }
 	return true;
 }
-bool File::updatePEChkSum() { return !this->data.isreadonly() && UpdatePEChkSum(this->data+0, this->data.size(), this->peOffset, this->is64bit() ? this->nth64->OptionalHeader.CheckSum : this->nth32->OptionalHeader.CheckSum) && this->flush(); }
 //------------------------------------------------------------------------------
 static const byte TinyDosStub[] = {0x0E, 0x1F, 0xBA, 0x0E, 0x00, 0xB4, 0x09, 0xCD, 0x21, 0xB8, 0x01, 0x4C, 0xCD, 0x21, 0x57, 0x69, 0x6E, 0x20, 0x4F, 0x6E, 0x6C, 0x79, 0x0D, 0x0A, 0x24, 0x00, 0x00, 0x00};
 bool File::hasExtraData() const { return this->dosh->e_crlc == 0x0000 && this->dosh->e_cparhdr == 0x0002 && this->dosh->e_lfarlc == 0x0020; }
@@ -506,15 +820,30 @@ bool File::setModifiedFlag() {
 		uint16_t lang = 0;
 		size_t size = 0;
 		void* ver = GetResourceDirectInRsrc(this->data+0, this->getSectionHeader(".rsrc"), ResType::VERSION, FIRST_ENTRY, &name, &lang, &size);
-		FileVersionBasicInfo *v = FileVersionBasicInfo::Get(ver);
+		FileVersionBasicInfo *v = FileVersionBasicInfo::Get(ver, size);
 		if (v) {
 			v->FileFlags = (FileVersionBasicInfo::Flags)(v->FileFlags | (v->FileFlagsMask & (FileVersionBasicInfo::PATCHED | FileVersionBasicInfo::SPECIALBUILD)));
-			this->modified = this->res->add(ResType::VERSION, name, lang, ver, size, ONLY);
+			this->modified = this->rsrc()->add(ResType::VERSION, name, lang, ver, size, ONLY);
 			this->flush();
 		}
 	}
 	return this->modified;
 }
+bool File::setVersionString(const char* path, const_str value) {
+	if (this->data.isreadonly()) { return false; }
+	const_resid name = NULL;
+	uint16_t lang = 0;
+	size_t size = 0;
+	void* ver = GetResourceDirectInRsrc(this->data+0, this->getSectionHeader(".rsrc"), ResType::VERSION, FIRST_ENTRY, &name, &lang, &size);
+	if (!ver) { return false; }
+
+	// Same-size changes are written directly to the file, otherwise the resources have to be saved
+	VersionEditor e(ver, size);
+	if (!e.setString(path, value)) { return false; }
+	const void* v = e.get(&size);
+	if (!this->rsrc()->add(ResType::VERSION, name, lang, v, size, ONLY)) { return false; }
+	return e.isInPlace() ? this->updatePEChkSum() : this->save(); // both update the checksum and flush
+}
 //-----------------------------------------------------------------------------
 typedef union _Reloc {
 	uint16_t Reloc;
@@ -523,9 +852,51 @@ typedef union _Reloc {
 		uint16_t Type : 4;
 	};
 } Reloc;
-#define RELOCS(e)		(dyn_ptr<Reloc>)((dyn_ptr<byte>)e+sizeof(BaseRelocation))
-#define NEXT_RELOCS(e)	(dyn_ptr<BaseRelocation>)((dyn_ptr<byte>)e+e->SizeOfBlock)
+#define RELOCS(e)		((Reloc*)((bytes)e+sizeof(BaseRelocation)))
+#define NEXT_RELOCS(e)	((BaseRelocation*)((bytes)e+e->SizeOfBlock))
 #define COUNT_RELOCS(e)	(e->SizeOfBlock - sizeof(BaseRelocation)) / sizeof(uint16_t)
+// Walks the relocation blocks, instantiated once per bitness so the relocation type to restore is a constant
+struct RelocRemover {
+	size_t pntr;
+	uint32_t size, start, end;
+	bool reverse;
+	template<typename T> void operator()(ImageView<T>& v) const {
+		bytes dat = v.data() + this->pntr;
+		const uint32_t start = this->start, end = this->end;
+		const bool reverse = this->reverse;
+
+		//ABSOLUTE	= IMAGE_REL_I386_ABSOLUTE or IMAGE_REL_AMD64_ABSOLUTE
+		//HIGHLOW	=> ??? or IMAGE_REL_AMD64_ADDR32NB (32-bit address w/o image base (RVA))
+		//DIR64		=> IMAGE_REL_AMD64_SSPAN32 (32 bit signed span-dependent value applied at link time)
+		const uint16_t new_type = reverse ? (uint16_t)T::RELOC_TYPE : (uint16_t)BaseRelocation::ABSOLUTE;
+
+		// Remove everything that is between start and end
+		// We do a thorough search for possible relocations and do not assume that they are in order
+		const_bytes entry_end = dat + this->size;
+		for (BaseRelocation* entry = (BaseRelocation*)dat; (const_bytes)(entry+1) <= entry_end && entry->SizeOfBlock > 0; entry = NEXT_RELOCS(entry)) {
+
+			// Check that the ranges overlap
+			if (entry->VirtualAddress+0xFFF < start || entry->VirtualAddress > end) continue;
+
+			// Go through each reloc in this entry
+			uint32_t count = COUNT_RELOCS(entry);
+			Reloc* relocs = RELOCS(entry);
+			if ((const_bytes)(relocs+count) > entry_end) { count = (uint32_t)((Reloc*)entry_end - relocs); }
+			for (uint32_t i = 0; i < count; ++i) {
+				// Already 'removed'
+				if ((!reverse && relocs[i].Type == BaseRelocation::ABSOLUTE) ||
+					(reverse && (relocs[i].Type != BaseRelocation::ABSOLUTE || relocs[i].Offset == 0))) continue;
+
+				// Check the virtual address and possibly clear it
+				uint32_t va = entry->VirtualAddress + relocs[i].Offset;
+				if (va >= start && va <= end) {
+					//relocs[i].Reloc = 0;
+					relocs[i].Type = new_type;
+				}
+			}
+		}
+	}
+};
 bool File::removeRelocs(uint32_t start, uint32_t end, bool reverse) {
 	if (end < start)							{ return false; }
 
@@ -535,38 +906,10 @@ bool File::removeRelocs(uint32_t start, uint32_t end, bool reverse) {
 	dyn_ptr<SectionHeader> sect = this->getSectionHeader(".reloc");
 	if (!sect)									{ return true; } // no relocations exist, so nothing to remove!
 
-	uint32_t size = sect->SizeOfRawData, pntr = sect->PointerToRawData;
-	dyn_ptr<byte> dat = this->get(pntr);
-
-	//ABSOLUTE	= IMAGE_REL_I386_ABSOLUTE or IMAGE_REL_AMD64_ABSOLUTE
-	//HIGHLOW	=> ??? or IMAGE_REL_AMD64_ADDR32NB (32-bit address w/o image base (RVA))
-	//DIR64		=> IMAGE_REL_AMD64_SSPAN32 (32 bit signed span-dependent value applied at link time)
-	uint16_t new_type = reverse ? (this->is64bit() ? BaseRelocation::DIR64 : BaseRelocation::HIGHLOW) : BaseRelocation::ABSOLUTE;
-
-	// Remove everything that is between start and end
-	// We do a thorough search for possible relocations and do not assume that they are in order
-	dyn_ptr<void> entry_end = dat + size;
-	for (dyn_ptr<BaseRelocation> entry = (dyn_ptr<BaseRelocation>)dat; entry < entry_end && entry->SizeOfBlock > 0; entry = NEXT_RELOCS(entry)) {
-
-		// Check that the ranges overlap
-		if (entry->VirtualAddress+0xFFF < start || entry->VirtualAddress > end) continue;
-
-		// Go through each reloc in this entry
-		uint32_t count = COUNT_RELOCS(entry);
-		dyn_ptr<Reloc> relocs = RELOCS(entry);
-		for (uint32_t i = 0; i < count; ++i) {
-			// Already 'removed'
-			if ((!reverse && relocs[i].Type == BaseRelocation::ABSOLUTE) ||
-				(reverse && (relocs[i].Type != BaseRelocation::ABSOLUTE || relocs[i].Offset == 0))) continue;
-
-			// Check the virtual address and possibly clear it
-			uint32_t va = entry->VirtualAddress + relocs[i].Offset;
-			if (va >= start && va <= end) {
-				//relocs[i].Reloc = 0;
-				relocs[i].Type = new_type;
-			}
-		}
-	}
+	RelocRemover r = { sect->PointerToRawData, sect->SizeOfRawData, start, end, reverse };
+	if (r.pntr > this->data.size())				{ return false; }
+	if (r.size > this->data.size() - r.pntr)	{ r.size = (uint32_t)(this->data.size() - r.pntr); }
+	this->dispatch(r); // nothing in it resizes the file
 	return true;
 }
 #pragma endregion
@@ -577,9 +920,11 @@ bool File::removeRelocs(uint32_t start, uint32_t end, bool reverse) {
 ///////////////////////////////////////////////////////////////////////////////
 size_t File::getSizeOf(uint32_t cnt, int rsrcIndx, size_t rsrcRawSize) const {
 	size_t size = 0;
-	for (uint16_t i = 0; i < this->header->NumberOfSections; i++)
-		if (this->sections[i].Characteristics & cnt)
-			size += (i == (uint16_t)rsrcIndx) ? rsrcRawSize : this->sections[i].SizeOfRawData;
+	PinnedView pin(this->data, this->getHeadersEnd());
+	const SectionHeader* s = pin(this->sections);
+	for (uint16_t i = 0, n = pin(this->header)->NumberOfSections; i < n; i++)
+		if (s[i].Characteristics & cnt)
+			size += (i == (uint16_t)rsrcIndx) ? rsrcRawSize : s[i].SizeOfRawData;
 	return size;
 }
 inline static void adjustAddr(uint32_t &addr, size_t rAddr, size_t rNewSize, size_t rOldSize) {
@@ -587,20 +932,63 @@ inline static void adjustAddr(uint32_t &addr, size_t rAddr, size_t rNewSize, siz
 		addr = (uint32_t)((addr + rNewSize) - rOldSize); // subtraction needs to be last b/c these are unsigned
 }
 bool File::save() {
-	if (this->data.isreadonly()) { return false; }
+	if (this->data.isreadonly() || !this->rsrc()) { return false; }
+	dyn_ptr<SectionHeader> rSect = this->getRsrcSection(NULL);
+	uint32_t rVA = rSect->VirtualAddress, pntr = rSect->PointerToRawData, rVirSize = rSect->VirtualSize, rRawSize = rSect->SizeOfRawData;
+	size_t rSize = (rVirSize < rRawSize) ? rVirSize : rRawSize;
+
+	// If only the data of existing resources changed it is written over the old data or appended to the section
+	if (pntr <= this->data.size() && rSize <= this->data.size() - pntr) {
+		size_t extra;
+		{
+			PinnedView pin(this->data, pntr+rSize);
+			extra = this->res->getPatchSize(pin.data()+pntr, rSize, rVA);
+			if (extra == 0) { this->res->patch(pin.data()+pntr, rSize, rVA); } // the section does not change size
+		}
+		if (extra == 0) { return updatePEChkSum(); }
+		if (extra != (size_t)-1) {
+			dyn_ptr<byte> dp = this->resizeRsrc(roundUpTo<4>(rSize) + extra);
+			if (!dp) { return false; }
+			{
+				PinnedView pin(this->data);
+				this->res->patch(pin(dp), rSize, rVA);
+			}
+			return updatePEChkSum();
+		}
+	}
 
-	// Compile the .rsrc, get its size, and get all the information about it
-	bool is64bit = this->is64bit();
-	uint32_t fAlign = is64bit ? this->getNtHeaders64()->OptionalHeader.FileAlignment    : this->getNtHeaders32()->OptionalHeader.FileAlignment;
-	uint32_t sAlign = is64bit ? this->getNtHeaders64()->OptionalHeader.SectionAlignment : this->getNtHeaders32()->OptionalHeader.SectionAlignment;
-	int rIndx = 0;
-	dyn_ptr<SectionHeader> rSect = this->getSectionHeader(".rsrc", &rIndx);
+	// Compile all of the resources
+	size_t entries;
+	void* rsrc = this->res->compile(&rSize, rVA, &entries);
+	dyn_ptr<byte> dp = this->resizeRsrc(rSize);
+	if (dp) { memcpy(dp, rsrc, rSize); this->res->saved(entries); }
+	free(rsrc);
+	return dp && updatePEChkSum();
+}
+bool File::replaceResources(const CompiledRsrc& c) {
+	if (this->data.isreadonly()) { return false; }
+	uint32_t rVA = this->getRsrcSection(NULL)->VirtualAddress;
+	dyn_ptr<byte> dp = this->resizeRsrc(c.getSize());
+	if (!dp) { return false; }
+	c.write(dp, rVA);
+	if (this->res) { this->resLayout = this->res->getLayout(); delete this->res; }
+	this->res = NULL; // parsed from the new section if it is needed again
+	this->readVersionInfo();
+	return updatePEChkSum();
+}
+dyn_ptr<SectionHeader> File::getRsrcSection(int* index) {
+	dyn_ptr<SectionHeader> rSect = this->getSectionHeader(".rsrc", index);
 	if (!rSect) {
 		this->createSection(".rsrc", 0, INIT_DATA_SECTION_R);
-		rSect = this->getSectionHeader(".rsrc", &rIndx);
+		rSect = this->getSectionHeader(".rsrc", index);
 	}
-	size_t rSize = 0;
-	void* rsrc = this->res->compile(&rSize, rSect->VirtualAddress);
+	return rSect;
+}
+dyn_ptr<byte> File::resizeRsrc(size_t rSize) {
+	// Get all the information about the .rsrc section
+	uint32_t fAlign = this->opt->FileAlignment, sAlign = this->opt->SectionAlignment; // identical for 32 and 64 bits
+	int rIndx = 0;
+	dyn_ptr<SectionHeader> rSect = this->getRsrcSection(&rIndx);
 	size_t rRawSize = roundUpTo(rSize, fAlign);
 	size_t rVirSize = roundUpTo(rSize, sAlign);
 	//size_t rSizeOld = rSect->Misc.VirtualSize;
@@ -610,66 +998,73 @@ bool File::save() {
 	uint32_t imageSize = 0; //, imageSizeOld = 0;
 	uint32_t fileSize = 0, fileSizeOld = (uint32_t)this->data.size();
 
-	// Update PointerToSymbolTable
-	adjustAddr(this->header->PointerToSymbolTable, rSect->VirtualAddress, rVirSize, rVirSizeOld);
-
-	// Update Optional Header
-	this->opt->SizeOfInitializedData = (uint32_t)this->getSizeOf(SectionHeader::CNT_INITIALIZED_DATA, rIndx, rRawSize);
-	adjustAddr(this->opt->AddressOfEntryPoint, rSect->VirtualAddress, rVirSize, rVirSizeOld);
-	adjustAddr(this->opt->BaseOfCode, rSect->VirtualAddress, rVirSize, rVirSizeOld);
-	//imageSizeOld = this->opt->SizeOfImage;
-
-	// Update the Data Directories
-	this->dataDir[DataDirectory::RESOURCE].Size = (uint32_t)rSize;
-	uint32_t ddCount = this->getDataDirectoryCount();
-	for (uint32_t i = 0; i < ddCount; i++) {
-		if (i == DataDirectory::SECURITY) { // the virtual address of DataDirectory::SECURITY is actually a file address, not a virtual address
-			adjustAddr(this->dataDir[i].VirtualAddress, rSect->PointerToRawData, rRawSize, rRawSizeOld);
-			if (this->dataDir[i].VirtualAddress + this->dataDir[i].Size > fileSize)
-				fileSize = this->dataDir[i].VirtualAddress + this->dataDir[i].Size;
-		} else {
-			adjustAddr(this->dataDir[i].VirtualAddress, rSect->VirtualAddress, rVirSize, rVirSizeOld);
-			if (this->dataDir[i].VirtualAddress + this->dataDir[i].Size > imageSize)
-				imageSize = this->dataDir[i].VirtualAddress + this->dataDir[i].Size;
+	uint32_t rVA = rSect->VirtualAddress, rPntr = rSect->PointerToRawData;
+	{
+		// Nothing in this block resizes the file so the headers are accessed directly
+		PinnedView pin(this->data, this->getHeadersEnd());
+		FileHeader* hdr = pin(this->header);
+		OptionalHeader* opt = pin(this->opt);
+		DataDirectory* dataDir = pin(this->dataDir);
+		SectionHeader* s = pin(this->sections);
+
+		// Update PointerToSymbolTable
+		adjustAddr(hdr->PointerToSymbolTable, rVA, rVirSize, rVirSizeOld);
+
+		// Update Optional Header
+		opt->SizeOfInitializedData = (uint32_t)this->getSizeOf(SectionHeader::CNT_INITIALIZED_DATA, rIndx, rRawSize);
+		adjustAddr(opt->AddressOfEntryPoint, rVA, rVirSize, rVirSizeOld);
+		adjustAddr(opt->BaseOfCode, rVA, rVirSize, rVirSizeOld);
+		//imageSizeOld = opt->SizeOfImage;
+
+		// Update the Data Directories
+		dataDir[DataDirectory::RESOURCE].Size = (uint32_t)rSize;
+		uint32_t ddCount = this->getDataDirectoryCount();
+		for (uint32_t i = 0; i < ddCount; i++) {
+			if (i == DataDirectory::SECURITY) { // the virtual address of DataDirectory::SECURITY is actually a file address, not a virtual address
+				adjustAddr(dataDir[i].VirtualAddress, rPntr, rRawSize, rRawSizeOld);
+				if (dataDir[i].VirtualAddress + dataDir[i].Size > fileSize)
+					fileSize = dataDir[i].VirtualAddress + dataDir[i].Size;
+			} else {
+				adjustAddr(dataDir[i].VirtualAddress, rVA, rVirSize, rVirSizeOld);
+				if (dataDir[i].VirtualAddress + dataDir[i].Size > imageSize)
+					imageSize = dataDir[i].VirtualAddress + dataDir[i].Size;
+			}
 		}
-	}
 	
-	// Update all section headers
-	for (uint16_t i = (uint16_t)rIndx; i < this->header->NumberOfSections; i++) {
-		if (strncmp((const char*)this->sections[i].Name, ".rsrc", ARRAYSIZE(this->sections[i].Name)) == 0) {
-			this->sections[i].VirtualSize = (uint32_t)rSize;
-			this->sections[i].SizeOfRawData = (uint32_t)rRawSize;
-		} else {
-			adjustAddr(this->sections[i].VirtualAddress, rSect->VirtualAddress, rVirSize, rVirSizeOld);
-			adjustAddr(this->sections[i].PointerToRawData, rSect->PointerToRawData, rRawSize, rRawSizeOld);
+		// Update all section headers
+		for (uint16_t i = (uint16_t)rIndx, n = hdr->NumberOfSections; i < n; i++) {
+			if (strncmp((const char*)s[i].Name, ".rsrc", ARRAYSIZE(s[i].Name)) == 0) {
+				s[i].VirtualSize = (uint32_t)rSize;
+				s[i].SizeOfRawData = (uint32_t)rRawSize;
+			} else {
+				adjustAddr(s[i].VirtualAddress, rVA, rVirSize, rVirSizeOld);
+				adjustAddr(s[i].PointerToRawData, rPntr, rRawSize, rRawSizeOld);
+			}
+			adjustAddr(s[i].PointerToLinenumbers, rPntr, rRawSize, rRawSizeOld);
+			adjustAddr(s[i].PointerToRelocations, rPntr, rRawSize, rRawSizeOld);
+			if (s[i].VirtualAddress + s[i].VirtualSize > imageSize)
+				imageSize = s[i].VirtualAddress + s[i].VirtualSize;
+			if (s[i].PointerToRawData + s[i].SizeOfRawData > fileSize)
+				fileSize = s[i].PointerToRawData + s[i].SizeOfRawData;
 		}
-		adjustAddr(this->sections[i].PointerToLinenumbers, rSect->PointerToRawData, rRawSize, rRawSizeOld);
-		adjustAddr(this->sections[i].PointerToRelocations, rSect->PointerToRawData, rRawSize, rRawSizeOld);
-		if (this->sections[i].VirtualAddress + this->sections[i].VirtualSize > imageSize)
-			imageSize = this->sections[i].VirtualAddress + this->sections[i].VirtualSize;
-		if (this->sections[i].PointerToRawData + this->sections[i].SizeOfRawData > fileSize)
-			fileSize = this->sections[i].PointerToRawData + this->sections[i].SizeOfRawData;
-	}
 	
-	// Update the ImageSize
-	this->opt->SizeOfImage = (uint32_t)roundUpTo(imageSize, sAlign);
+		// Update the ImageSize
+		opt->SizeOfImage = (uint32_t)roundUpTo(imageSize, sAlign);
+	}
 
 	// Increase file size (invalidates all local pointers to the file data)
-	if (fileSize > fileSizeOld && !this->setSize(fileSize))			{ free(rsrc); return false; }
+	if (fileSize > fileSizeOld && !this->setSize(fileSize))			{ return nulldp; }
 
-	// Move all sections after resources and save resources
+	// Move all sections after resources and clear the padding after the new resources
 	dyn_ptr<byte> dp = this->data+pntr;
 	if (rRawSize != rRawSizeOld && fileSize-rRawSize-pntr > 0)
 		memmove(dp+rRawSize, dp+rRawSizeOld, fileSize-rRawSize-pntr);
 	if (rRawSize > rSize)
 		memset(dp+rSize, 0, rRawSize-rSize);
-	memcpy(dp, rsrc, rSize);
-	free(rsrc);
 
 	// Decrease file size (invalidates all local pointers to the file data)
-	if (fileSize < fileSizeOld && !this->setSize(fileSize, false))	{ return false; }
+	if (fileSize < fileSizeOld && !this->setSize(fileSize, false))	{ return nulldp; }
 
-	// Finish Up
-	return updatePEChkSum();
+	return dp;
 }
 #pragma endregion
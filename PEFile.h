@@ -24,6 +24,8 @@
 #include "PEDataTypes.h"
 #include "PEFileResources.h"
 #include "PEDataSource.h"
+#include "PEHash.h"
+#include "PEImageView.h"
 #include "PEVersion.h"
 
 namespace PE {
@@ -40,15 +42,22 @@ protected:
 	dyn_ptr<Image::OptionalHeader> opt;		// part of nth32/nth64 header
 	dyn_ptr<Image::DataDirectory> dataDir;	// part of nth32/nth64 header
 	dyn_ptr<Image::SectionHeader> sections;
-	Rsrc *res;
+	bool pe32plus; // the bitness is decided once while loading
+	mutable Rsrc *res; // NULL after replaceResources until the resources are needed again
+	const RsrcLayout* resLayout; // the layout of res, given to it again when it is parsed after replaceResources
 
 	PE::Version::Version version;
 	bool modified;
 
 	size_t getSizeOf(uint32_t cnt, int rsrcIndx, size_t rsrcRawSize) const;
+	size_t getHeadersEnd() const; // the end of the section headers, header loops only pin this much so a deferred source does not have to do its edits
 
 	bool load();
 	void unload();
+	void readVersionInfo();
+	Rsrc* rsrc() const; // the resources, parsed from the file if needed
+	dyn_ptr<Image::SectionHeader> getRsrcSection(int* index); // creates it if needed
+	dyn_ptr<byte> resizeRsrc(size_t size); // makes room for new resources and updates the headers, returns where they go, invalidates all pointers returned by functions
 public:
 	File(void* data, size_t size, bool readonly = false); // data is freed when the PEFile is deleted
 	File(const_str filename, bool readonly = false);
@@ -58,11 +67,27 @@ public:
 	bool isReadOnly() const;
 
 	bool save(); // flushes
+	// Replaces all of the resources with precompiled ones (see Rsrc::precompile), which only needs a copy and fixing the RVAs instead
+	// of compiling. Any unsaved resource changes are discarded but the layout of the resources is kept. Flushes.
+	bool replaceResources(const CompiledRsrc& c);
 
 	bool is32bit() const;
 	bool is64bit() const;
 	uint64_t getImageBase() const;
 
+	// Calls f(ImageView<PE32>&) or f(ImageView<PE32Plus>&) depending on the bitness so that walkers are specialized for it,
+	// a const file gives the walker a const view. The walker must not resize the file.
+	template<typename F> inline void dispatch(F& f) {
+		PinnedView pin(this->data);
+		if (this->pe32plus)	{ ImageView<PE32Plus> v(pin.data(), this->peOffset); f(v); }
+		else				{ ImageView<PE32>     v(pin.data(), this->peOffset); f(v); }
+	}
+	template<typename F> inline void dispatch(F& f) const {
+		PinnedView pin(this->data);
+		if (this->pe32plus)	{ const ImageView<PE32Plus> v(pin.data(), this->peOffset); f(v); }
+		else				{ const ImageView<PE32>     v(pin.data(), this->peOffset); f(v); }
+	}
+
 	dyn_ptr<Image::FileHeader> getFileHeader();				// pointer can modify the file
 	dyn_ptr<Image::NTHeaders32> getNtHeaders32();			// pointer can modify the file
 	dyn_ptr<Image::NTHeaders64> getNtHeaders64();			// pointer can modify the file
@@ -84,14 +109,14 @@ public:
 	const dyn_ptr<Image::SectionHeader> getSectionHeaderByVA(uint64_t va, int *i) const;
 	int getSectionHeaderCount() const;
 
-	dyn_ptr<Image::SectionHeader> getExpandedSectionHdr(int i, uint32_t room);		// pointer can modify the file, invalidates all pointers returned by functions, flushes
+	dyn_ptr<Image::SectionHeader> getExpandedSectionHdr(int i, uint32_t room);		// pointer can modify the file, invalidates all pointers returned by functions, flushes (except a deferred source, which is written when saved)
 	dyn_ptr<Image::SectionHeader> getExpandedSectionHdr(char *str, uint32_t room);	// as above
 
 	static const Image::SectionHeader::CharacteristicFlags CHARS_CODE_SECTION   = (Image::SectionHeader::CharacteristicFlags)(Image::SectionHeader::CNT_CODE | Image::SectionHeader::MEM_EXECUTE | Image::SectionHeader::MEM_READ);
 	static const Image::SectionHeader::CharacteristicFlags INIT_DATA_SECTION_R  = (Image::SectionHeader::CharacteristicFlags)(Image::SectionHeader::CNT_INITIALIZED_DATA | Image::SectionHeader::MEM_READ);
 	static const Image::SectionHeader::CharacteristicFlags INIT_DATA_SECTION_RW = (Image::SectionHeader::CharacteristicFlags)(Image::SectionHeader::CNT_INITIALIZED_DATA | Image::SectionHeader::MEM_READ | Image::SectionHeader::MEM_WRITE);
 
-	dyn_ptr<Image::SectionHeader> createSection(int i, const char *name, uint32_t room, Image::SectionHeader::CharacteristicFlags chars);			// pointer can modify the file, invalidates all pointers returned by functions, flushes
+	dyn_ptr<Image::SectionHeader> createSection(int i, const char *name, uint32_t room, Image::SectionHeader::CharacteristicFlags chars);			// pointer can modify the file, invalidates all pointers returned by functions, flushes (except a deferred source, which is written when saved)
 	dyn_ptr<Image::SectionHeader> createSection(const char *str, const char *name, uint32_t room, Image::SectionHeader::CharacteristicFlags chars);	// as above, adds before the section named str
 	dyn_ptr<Image::SectionHeader> createSection(const char *name, uint32_t room, Image::SectionHeader::CharacteristicFlags chars);					// as above, adds before ".reloc" if exists or at the very end
 
@@ -104,15 +129,18 @@ public:
 	bool zero(uint32_t dwSize, uint32_t dwOffset);							// shorthand for memset(f->get(dwOffset), 0, dwSize) with bounds checking
 	bool move(uint32_t dwOffset, uint32_t dwSize, int32_t dwDistanceToMove);// shorthand for x = f->get(dwOffset); memmove(x+dwDistanceToMove, x, dwSize) with bounds checking
 	bool shift(uint32_t dwOffset, int32_t dwDistanceToMove);				// shorthand for f->move(dwOffset, f->getSize() - dwOffset - dwDistanceToMove, dwDistanceToMove)
+	bool insert(uint32_t dwOffset, uint32_t dwSize);						// inserts dwSize zeroed bytes at dwOffset growing the file, invalidates all pointers returned by functions
 	bool flush();
 
-	bool updatePEChkSum();				// flushes
+	bool updatePEChkSum(Hasher* hash = NULL);	// flushes, if hash is given the image hash is added to it in the same pass (see ComputePEChkSum)
+	bool getImageHash(Hasher* hash, uint32_t* checkSum = NULL) const; // adds the image hash to hash and gets the correct checksum without changing the file
 	bool hasExtraData() const;
 	dyn_ptr<void> getExtraData(uint32_t *size);	// pointer can modify the file, when first enabling it will flush
 	bool clearCertificateTable();		// may invalidate all pointers returned by functions, flushes
 	PE::Version::Version getFileVersion() const;
 	bool isAlreadyModified() const;
 	bool setModifiedFlag();				// flushes
+	bool setVersionString(const char* path, const_str value); // path like "\\StringFileInfo\\040904b0\\ProductVersion", flushes, saves if the version resource grows
 	bool removeRelocs(uint32_t start, uint32_t end, bool reverse = false);
 
 #ifdef EXPOSE_DIRECT_RESOURCES
@@ -125,9 +153,53 @@ public:
 	void* getResource   (const_resid type, const_resid name, uint16_t* lang, size_t* size) const; // must be freed
 	bool removeResource(const_resid type, const_resid name, uint16_t lang);
 	bool addResource   (const_resid type, const_resid name, uint16_t lang, const void* data, size_t size, Overwrite overwrite = ALWAYS);
+
+	// The data of a RES file for mergeRES
+	struct RESData {
+		const void* data;
+		size_t size;
+	};
+	// Merges many RES files into the resources in order and saves once, the entries are added straight from each RES file
+	// If any RES file is malformed nothing is changed. If borrow the resources point into the RES data until they are changed, so it must outlive them (or the file).
+	bool mergeRES(const RESData* res, size_t count, Overwrite overwrite = ALWAYS, bool borrow = false);
+	bool mergeRES(const const_str* files, size_t count, Overwrite overwrite = ALWAYS); // the resources point into the mapped files, each is unmapped once none of its resources are used
 	
-	static void* GetResourceDirect(void* data, const_resid type, const_resid name); // must be freed, massively performance enhanced for a single retrieval, no editing, and no buffer checks // lang? size?
-	static bool UpdatePEChkSum(bytes data, size_t dwSize, size_t peOffset, uint32_t dwOldCheck);
+	static void* GetResourceDirect(void* data, const_resid type, const_resid name); // must be freed, massively performance enhanced for a single retrieval, no editing, and no buffer checks // lang? size? see GetResourcesDirect
+
+	// A query for GetResourcesDirect, the name can be ANY_NAME and the lang can be ANY_LANG to take the first match
+	struct DirectQuery {
+		const_resid type, name;
+		uint16_t lang;		// set to the language found
+		bool found;
+		uint32_t offset;	// file offset of the resource data
+		uint32_t size;
+		uint32_t codepage;
+	};
+	static const const_resid ANY_NAME;
+	static const uint16_t ANY_LANG = 0xFFFF;
+	static size_t GetResourcesDirect(const void* data, size_t size, DirectQuery* queries, size_t count); // looks up many resources in a single walk of the .rsrc directory with buffer checks, returns the number found
+
+	// A name from EnumerateResourcesDirect, either an integer id or (when str is not empty) a string within the data
+	struct DirectName {
+		uint16_t id;
+		utf16_view str;
+	};
+	typedef bool (*DirectEnumerator)(const DirectName& type, const DirectName& name, const DirectQuery& res, void* param); // return false to stop
+	static size_t EnumerateResourcesDirect(const void* data, size_t size, DirectEnumerator f, void* param); // calls f for every resource with buffer checks, the type and name of res are NULL for strings, returns the number of resources visited
+
+	// Opens the sink a resource is exported to, return NULL to skip the resource, the sink is deleted once the resource is written
+	// It is called from many threads at once but the resources of a type are always exported one after another by a single thread
+	typedef DataSink* (*ExportSinkOpener)(const DirectName& type, const DirectName& name, uint16_t lang, size_t size, void* param);
+	// Writes the data of every resource as it was last saved straight from the data source, when both are files the kernel copies
+	// the data. Edits made through getResources() that have not been saved are not included. The types are spread across threads,
+	// with 0 threads meaning one per processor. Returns the number of resources written.
+	size_t exportResources(ExportSinkOpener open, void* param, unsigned int threads = 0) const;
+	size_t exportResources(const_str dir, unsigned int threads = 0) const; // each resource is written to dir/type_name_lang.bin, integer IDs are written as #id
+	static bool UpdatePEChkSum(bytes data, size_t dwSize, size_t peOffset, uint32_t dwOldCheck, Hasher* hash = NULL);
+	// Computes the checksum and, if hash is given, adds the Authenticode-style image hash to it in the same pass over the data
+	// The image hash covers the whole file except the checksum, the security data directory entry, and the certificate table
+	// The hasher is not reset or finished
+	static uint32_t ComputePEChkSum(const_bytes data, size_t dwSize, size_t peOffset, uint32_t dwOldCheck, Hasher* hash = NULL);
 };
 
 }
@@ -26,6 +26,9 @@
 #include <string.h>
 #include <wchar.h>
 
+#include <algorithm>
+#include <utility>
+
 using namespace PE;
 using namespace PE::Image;
 using namespace PE::Internal;
@@ -113,49 +116,8 @@ static void WriteResDirEntry(bytes data, const_resid name, size_t headerSize, si
 
 #pragma region RES Utility Functions
 
-typedef struct _RESHEADER {
-	uint32_t DataSize;
-	uint32_t HeaderSize;
-	resid Type;
-	resid Name;
-	uint32_t DataVersion;
-	uint16_t MemoryFlags;
-	uint16_t LanguageId;
-	uint32_t Version;
-	uint32_t Characteristics;
-} RESHeader;
-
-static const size_t RESHeaderSize = sizeof(uint32_t)*7 + sizeof(uint16_t)*2;
-
-static size_t ReadRESHeaderID(const_bytes data, resid *id) {
-	wchar_t* chars = (wchar_t*)data;
-	size_t len;
-	if (chars[0] == 0xFFFF) {
-		len = 2 * sizeof(wchar_t);
-		*id = MakeResID(chars[1]);
-	} else {
-		len = (wcslen((resid)chars) + 1) * sizeof(wchar_t);
-		*id = (resid)chars;
-	}
-	return len;
-}
-static RESHeader* ReadRESHeader(const_bytes data, size_t size, size_t& pos) {
-	if (pos + sizeof(uint32_t)*2 >= size) { return NULL; }
-
-	RESHeader *h = (RESHeader*)malloc(sizeof(RESHeader));
-	memcpy(h, data+pos, sizeof(uint32_t)*2);
-
-	if (pos + h->HeaderSize >= size) { free(h); return NULL; }
-
-	pos += sizeof(uint32_t)*2;
-	pos += ReadRESHeaderID(data + pos, &h->Type);
-	pos += ReadRESHeaderID(data + pos, &h->Name);
-
-	memcpy(&h->DataVersion, data + pos, sizeof(RESHeader) - offsetof(RESHeader, DataVersion));
-	pos += sizeof(RESHeader) - offsetof(RESHeader, DataVersion);
-
-	return h;
-}
+// The fixed part at the end of every RES header: DataVersion, MemoryFlags, LanguageId, Version, and Characteristics
+static const size_t RESHeaderTrailerSize = sizeof(uint32_t)*3 + sizeof(uint16_t)*2;
 
 static const uint16_t DefResMemoryFlags = 0x0030; // or possibly 0x0000 ?
 static const uint16_t ResMemoryFlags[] = {
@@ -186,31 +148,66 @@ static const uint16_t ResMemoryFlags[] = {
 	0x0030, // Manifest
 };
 
-static size_t GetRESHeaderIDExtraLen(const_resid id) { return IsIntResID(id) ? 0 : (wcslen(id) - 1) * sizeof(wchar_t); }
-static size_t WriteRESHeaderID(bytes data, const_resid id, uint32_t *hdrSize) {
+// Names in RES files are always UTF-16, even where wchar_t is larger
+static size_t GetRESIDSize(const_resid id) { return IsIntResID(id) ? sizeof(uint32_t) : (wcslen(id) + 1) * sizeof(uint16_t); }
+static size_t GetRESHeaderSize(const_resid type, const_resid name) { return roundUpTo<4>(sizeof(uint32_t)*2 + GetRESIDSize(type) + GetRESIDSize(name)) + RESHeaderTrailerSize; }
+static bool WriteRESHeaderID(DataSink& sink, const_resid id) {
 	if (IsIntResID(id)) {
-		*((uint32_t*)data) = (((uint32_t)ResID2Int(id)) << 16) | 0xFFFF;
-		return 0;
-	} else {
-		size_t len = (wcslen(id) + 1) * sizeof(wchar_t);
-		memcpy(data, id, len);
-		len -= sizeof(uint32_t);
-		*hdrSize += (uint32_t)len;
-		return len;
-	}
-}
-static size_t WriteRESHeader(bytes data, const_resid type, const_resid name, uint16_t lang, size_t dataSize) {
-	*(uint32_t*)data = (uint32_t)dataSize;
-	uint32_t *hdrSize = ((uint32_t*)data)+1;
-	*hdrSize = (uint32_t)RESHeaderSize;
-	data += sizeof(uint32_t)*2;
-	data += WriteRESHeaderID(data, type, hdrSize) + sizeof(uint32_t);
-	data += WriteRESHeaderID(data, name, hdrSize) + sizeof(uint32_t);
-	memset(data, 0, sizeof(uint32_t)*3 + sizeof(uint16_t)*2); // DataVersion, *, Version, Characteristics
-	((uint16_t*)data)[2] = (IsIntResID(type) && (ResID2Int(type) < ARRAYSIZE(ResMemoryFlags))) ? ResMemoryFlags[ResID2Int(type)] : DefResMemoryFlags; // MemoryFlags
-	((uint16_t*)data)[3] = lang;
-	return *hdrSize;
+		uint16_t x[2] = { 0xFFFF, ResID2Int(id) };
+		return sink.write(x, sizeof(x));
+	}
+	for (size_t i = 0, len = wcslen(id); i <= len; ++i) {
+		uint16_t c = (uint16_t)id[i];
+		if (!sink.write(&c, sizeof(uint16_t))) { return false; }
+	}
+	return true;
 }
+// Writes a header field by field, sink should be a StagingSink so this is one write to the real sink
+static bool WriteRESHeader(DataSink& sink, const_resid type, const_resid name, uint16_t lang, size_t dataSize) {
+	static const byte zeros[4] = { 0, 0, 0, 0 };
+	size_t ids = GetRESIDSize(type) + GetRESIDSize(name);
+	uint32_t sizes[2] = { (uint32_t)dataSize, (uint32_t)GetRESHeaderSize(type, name) };
+	byte trailer[RESHeaderTrailerSize] = { 0 }; // DataVersion, Version, and Characteristics are 0
+	uint16_t flags = (IsIntResID(type) && (ResID2Int(type) < ARRAYSIZE(ResMemoryFlags))) ? ResMemoryFlags[ResID2Int(type)] : DefResMemoryFlags;
+	memcpy(trailer+sizeof(uint32_t), &flags, sizeof(uint16_t));
+	memcpy(trailer+sizeof(uint32_t)+sizeof(uint16_t), &lang, sizeof(uint16_t));
+	return sink.write(sizes, sizeof(sizes)) && WriteRESHeaderID(sink, type) && WriteRESHeaderID(sink, name) &&
+		sink.write(zeros, roundUpTo<4>(ids) - ids) && sink.write(trailer, sizeof(trailer));
+}
+// Gathers small writes in a stack buffer and passes them on in one write, larger writes go straight through
+class StagingSink : public DataSink {
+	DataSink& sink;
+	byte buf[256];
+	size_t used;
+public:
+	inline StagingSink(DataSink& sink) : sink(sink), used(0) { }
+	virtual bool write(const void* data, size_t size) {
+		if (size > sizeof(this->buf) - this->used) {
+			if (!this->flush()) { return false; }
+			if (size > sizeof(this->buf)) { return this->sink.write(data, size); }
+		}
+		memcpy(this->buf+this->used, data, size);
+		this->used += size;
+		return true;
+	}
+	inline bool flush() { size_t n = this->used; this->used = 0; return n == 0 || this->sink.write(this->buf, n); }
+};
+// Gets a name from a RES file as a resource ID, string names are converted into buf
+static const_resid GetRESName(const RESReader::Name& n, std::vector<wchar_t>& buf) {
+	if (n.str.empty()) { return MakeResID(n.id); }
+	buf.resize(n.str.length + 1);
+	for (size_t i = 0; i < n.str.length; ++i) { buf[i] = n.str[i]; }
+	buf[n.str.length] = 0;
+	return &buf[0];
+}
+// Writes into a buffer that is already large enough
+class BufferSink : public DataSink {
+	bytes d;
+	size_t pos;
+public:
+	inline BufferSink(bytes d) : d(d), pos(0) { }
+	virtual bool write(const void* data, size_t size) { memcpy(this->d + this->pos, data, size); this->pos += size; return true; }
+};
 #pragma endregion
 
 #pragma region Rsrc
@@ -218,7 +215,7 @@ static size_t WriteRESHeader(bytes data, const_resid type, const_resid name, uin
 ///// Rsrc
 ///////////////////////////////////////////////////////////////////////////////
 Rsrc* Rsrc::createFromRSRCSection(const_bytes data, size_t size, SectionHeader *section) { try { return (!data || !size || !section) ? NULL : new Rsrc(data, size, section); } catch (ResLoadFailure&) { return NULL; } }
-Rsrc::Rsrc(const_bytes data, size_t size, SectionHeader *section) {
+Rsrc::Rsrc(const_bytes data, size_t size, SectionHeader *section) : modified(false), layout(NULL) {
 	uint32_t nEntries;
 	ResourceDirectoryEntry *entries = GetEntries(data, size, section->PointerToRawData, &nEntries);
 	for (uint16_t i = 0; i < nEntries; i++) {
@@ -228,20 +225,15 @@ Rsrc::Rsrc(const_bytes data, size_t size, SectionHeader *section) {
 	}
 	this->cleanup();
 }
-Rsrc* Rsrc::createFromRESFile(const_bytes data, size_t size) { try { return (!data || !size) ? NULL : new Rsrc(data, size); } catch (ResLoadFailure&) { return NULL; } }
-Rsrc::Rsrc(const_bytes data, size_t size) {
-	RESHeader *h;
-	size_t pos = 0;
-	while ((h = ReadRESHeader(data, size, pos)) != NULL) {
-		if (h->Type || h->Name || h->LanguageId || h->DataSize) {
-			this->add(h->Type, h->Name, h->LanguageId, data + pos, h->DataSize);
-			pos += roundUpTo<4>(h->HeaderSize + h->DataSize) - h->HeaderSize;
-		}
-	}
-	this->cleanup();
-}
+Rsrc* Rsrc::createFromRESFile(const_bytes data, size_t size, bool borrow) { try { return (!data || !size) ? NULL : new Rsrc(data, size, borrow); } catch (ResLoadFailure&) { return NULL; } }
+Rsrc::Rsrc(const_bytes data, size_t size, bool borrow) : modified(true), layout(NULL) { if (this->addRES(data, size, ALWAYS, borrow) == (size_t)-1) { throw resLoadFailure; } }
 Rsrc* Rsrc::createEmpty() { return new Rsrc(); }
-Rsrc::Rsrc() {  }
+Rsrc::Rsrc() : modified(false), layout(NULL) {  }
+Rsrc::Rsrc(const Rsrc& r) : modified(true), layout(r.layout) {
+	for (TypeMap::const_iterator i = r.types.begin(); i != r.types.end(); ++i)
+		this->types.insert(this->types.end(), TypeMap::value_type(dup(i->first), new ResourceType(*i->second)));
+}
+Rsrc* Rsrc::clone() const { return new Rsrc(*this); }
 Rsrc::~Rsrc() {
 	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i) {
 		free_id(i->first);
@@ -256,6 +248,7 @@ bool Rsrc::cleanup() {
 			free_id(i->first);
 			delete i->second;
 			this->types.erase(i++);
+			this->modified = true;
 		} else { ++i; }
 	}
 	return this->isEmpty();
@@ -285,17 +278,50 @@ bool Rsrc::remove(const_resid type, const_resid name, uint16_t lang) {
 		free_id(iter->first);
 		delete iter->second;
 		this->types.erase(iter);
+		this->modified = true;
 	}
 	return b;
 }
-bool Rsrc::add(const_resid type, const_resid name, uint16_t lang, const void* data, size_t size, Overwrite overwrite) {
+ResourceType* Rsrc::getOrCreate(const_resid type, Overwrite overwrite) {
 	TypeMap::iterator iter = this->types.find((resid)type);
-	if (iter == types.end() && (overwrite == ALWAYS || overwrite == NEVER)) {
-		//types.set(dup(type), new ResourceType(type, name, lang, data, size));
-		types[dup(type)] = new ResourceType(type, name, lang, data, size);
-		return true;
+	if (iter == this->types.end()) {
+		if (overwrite == ONLY) { return NULL; }
+		iter = this->types.insert(TypeMap::value_type(dup(type), new ResourceType(type))).first;
+		this->modified = true;
+	}
+	return iter->second;
+}
+bool Rsrc::add(const_resid type, const_resid name, uint16_t lang, const void* data, size_t size, Overwrite overwrite) {
+	ResourceType* t = this->getOrCreate(type, overwrite);
+	return t && t->add(name, lang, data, size, overwrite);
+}
+bool Rsrc::add(const_resid type, const_resid name, uint16_t lang, const void* data, size_t size, ResourcePayload::Deleter deleter, void* owner, Overwrite overwrite) {
+	return this->add(type, name, lang, ResourcePayload::Adopt(data, size, deleter, owner), overwrite);
+}
+bool Rsrc::add(const_resid type, const_resid name, uint16_t lang, ResourcePayload* p, Overwrite overwrite) {
+	ResourceType* t = this->getOrCreate(type, overwrite);
+	if (!t) { p->release(); return false; }
+	return t->add(name, lang, p, overwrite);
+}
+size_t Rsrc::addRES(const_bytes data, size_t size, Overwrite overwrite, bool borrow) { return this->addRES(data, size, overwrite, borrow, NULL); }
+size_t Rsrc::addRES(ResourcePayload* res, Overwrite overwrite) {
+	size_t n = this->addRES((const_bytes)res->data, res->size, overwrite, false, res);
+	res->release(); // the resources have their own references
+	return n;
+}
+size_t Rsrc::addRES(const_bytes data, size_t size, Overwrite overwrite, bool borrow, ResourcePayload* whole) {
+	if (!RESReader::IsValid(data, size)) { return (size_t)-1; } // nothing is added from a malformed file
+	size_t n = 0;
+	RESReader r(data, size);
+	RESReader::Entry e;
+	std::vector<wchar_t> typeBuf, nameBuf;
+	while (r.next(&e)) {
+		const_resid type = GetRESName(e.type, typeBuf), name = GetRESName(e.name, nameBuf);
+		if (whole)			{ n += this->add(type, name, e.lang, ResourcePayload::Part(whole, e.data, e.size), overwrite); }
+		else if (borrow)	{ n += this->add(type, name, e.lang, ResourcePayload::Create(e.data, e.size, true), overwrite); }
+		else				{ n += this->add(type, name, e.lang, e.data, e.size, overwrite); }
 	}
-	return iter->second->add(name, lang, data, size, overwrite);
+	return n;
 }
 bool Rsrc::isEmpty() const { return this->types.size() == 0; }
 ResourceType* Rsrc::operator[](const_resid type) {
@@ -313,6 +339,16 @@ std::vector<const_resid> Rsrc::getTypes() const {
 		v.push_back(i->first);
 	return v;
 }
+size_t Rsrc::visit(ResourceVisitor f, void* param, const_resid type, uint16_t lang) const {
+	size_t n = 0;
+	if (type) {
+		TypeMap::const_iterator iter = this->types.find((resid)type);
+		if (iter != this->types.end()) { iter->second->visit(lang, f, param, n); }
+	} else {
+		for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end() && i->second->visit(lang, f, param, n); ++i);
+	}
+	return n;
+}
 std::vector<const_resid> Rsrc::getNames(const_resid type) const {
 	TypeMap::const_iterator iter = this->types.find((resid)type);
 	return iter == types.end() ? std::vector<const_resid>() : iter->second->getNames();
@@ -337,19 +373,45 @@ size_t Rsrc::getHeaderSize() const {
 	return size;
 }
 size_t Rsrc::getThisHeaderSize() const { return sizeof(ResourceDirectory)+this->types.size()*sizeof(ResourceDirectoryEntry); }
-void* Rsrc::compile(size_t *size, uint32_t startVA) {
+void* Rsrc::compile(size_t *size, uint32_t startVA) { size_t entries; return this->compile(size, startVA, &entries); }
+CompiledRsrc* Rsrc::precompile() {
+	size_t size, entries;
+	bytes data = this->compile(&size, 0, &entries);
+	return new CompiledRsrc(data, size, entries, (this->getHeaderSize() - entries) / sizeof(ResourceDataEntry));
+}
+bytes Rsrc::compile(size_t *size, uint32_t startVA, size_t* entries) {
 	this->cleanup();
 
 	size_t dataSize = this->getDataSize();
 	size_t headerSize = roundUpTo<4>(this->getHeaderSize()); // uint32 alignment
-	
-	*size = headerSize + dataSize;
+
+	// The data entries stay in the order of the directories but the data itself is placed by the layout
+	std::vector<const ResourceLang*> langs;
+	std::vector<std::pair<size_t, size_t> > order; // rank of the type and index of the resource
+	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i) {
+		size_t rank = this->getLayoutRank(i->first), first = langs.size();
+		i->second->collect(langs);
+		for (size_t j = first; j < langs.size(); ++j) { order.push_back(std::make_pair(rank, j)); }
+	}
+	if (this->layout) { std::sort(order.begin(), order.end()); }
+	std::vector<size_t> positions(langs.size());
+	size_t posData = headerSize + dataSize;
+	for (size_t i = 0; i < langs.size(); ++i) { posData -= roundUpTo<4>(langs[i]->getDataSize()); } // the names come before the data
+	for (size_t i = 0; i < order.size(); ++i) {
+		size_t j = order[i].second, sz = langs[j]->getDataSize();
+		if (this->layout && this->layout->pageSize && sz >= this->layout->largeSize)
+			posData = (posData + this->layout->pageSize - 1) / this->layout->pageSize * this->layout->pageSize;
+		positions[j] = posData;
+		posData += roundUpTo<4>(sz);
+	}
+
+	*size = posData;
 
 	bytes data = (bytes)memset(malloc(*size), 0, *size);
 	
 	size_t pos = 0;
 	size_t posDir = this->getThisHeaderSize();
-	size_t posData = headerSize;
+	posData = headerSize;
 
 	WriteResDir(data, pos, this->types.begin(), this->types.end());
 
@@ -360,28 +422,78 @@ void* Rsrc::compile(size_t *size, uint32_t startVA) {
 		i->second->writeNameDirs(data, pos, posDir, posData);
 	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i)
 		i->second->writeLangDirs(data, pos, posDir);
-	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i)
-		i->second->writeData(data, pos, posData, startVA);
+	*entries = pos;
+	for (size_t j = 0; j < langs.size(); ++j, pos += sizeof(ResourceDataEntry))
+		langs[j]->writeData(data, pos, positions[j], startVA);
 
 	return data;
 }
+size_t Rsrc::getLayoutRank(const_resid type) const {
+	// Types in the layout are 0 to count-1, all other types are after them
+	if (!this->layout) { return 0; }
+	ResCmp c;
+	for (size_t i = 0; i < this->layout->count; ++i)
+		if (!c(type, this->layout->types[i]) && !c(this->layout->types[i], type)) { return i; }
+	return this->layout->count;
+}
+static const const_resid StartupTypes[] = { ResType::MANIFEST, ResType::VERSION, ResType::GROUP_ICON, ResType::GROUP_CURSOR }; // read when the program starts or is shown
+const RsrcLayout RsrcLayout::STARTUP = { StartupTypes, ARRAYSIZE(StartupTypes), 0x1000, 0x10000 };
+void Rsrc::setLayout(const RsrcLayout* layout) { if (layout != this->layout) { this->layout = layout; this->modified = true; } }
+const RsrcLayout* Rsrc::getLayout() const { return this->layout; }
+bool Rsrc::isModified() const {
+	if (this->modified) { return true; }
+	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i)
+		if (i->second->isModified()) { return true; }
+	return false;
+}
+size_t Rsrc::getPatchSize(const_bytes section, size_t size, uint32_t startVA) const {
+	if (this->modified) { return (size_t)-1; }
+	size_t extra = 0;
+	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i)
+		if (!i->second->getPatchSize(section, size, startVA, extra)) { return (size_t)-1; }
+	return (extra > size / 2) ? (size_t)-1 : extra; // the old data of resources that grew is left behind, so once a lot is appended compile to get rid of it
+}
+void Rsrc::saved(size_t entries) {
+	this->modified = false;
+	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i)
+		i->second->saved(entries);
+}
+void Rsrc::patch(bytes section, size_t size, uint32_t startVA) {
+	size_t pos = roundUpTo<4>(size);
+	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i)
+		i->second->patch(section, startVA, pos);
+}
 size_t Rsrc::getRESSize() const {
-	size_t size = RESHeaderSize;
+	size_t size = GetRESHeaderSize(0, 0);
 	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i)
 		size += i->second->getRESSize();
 	return size;
 }
+size_t Rsrc::getRESFileSize() { this->cleanup(); return this->getRESSize(); }
 void* Rsrc::compileRES(size_t *size) {
+	*size = this->getRESFileSize();
+	bytes data = (bytes)malloc(*size);
+	if (!data) { *size = 0; return NULL; }
+	BufferSink sink(data);
+	this->compileRES(sink);
+	return data;
+}
+bool Rsrc::compileRES(DataSink& sink) {
 	this->cleanup();
 
-	*size = this->getRESSize();
-	bytes data = (bytes)memset(malloc(*size), 0, *size);
-	size_t pos = WriteRESHeader(data, 0, 0, 0, 0);
+	StagingSink hdr(sink);
+	if (!WriteRESHeader(hdr, 0, 0, 0, 0) || !hdr.flush()) { return false; } // the empty entry
 
 	for (TypeMap::const_iterator i = this->types.begin(); i != this->types.end(); ++i)
-		i->second->writeRESData(data, pos);
+		if (!i->second->writeRESData(sink)) { return false; }
 
-	return data;
+	return true;
+}
+bool Rsrc::compileRES(DataSource& ds) {
+	size_t size = this->getRESFileSize();
+	if (ds.isreadonly() || (ds.size() != size && !ds.resize(size))) { return false; }
+	DataSourceSink sink(ds);
+	return this->compileRES(sink);
 }
 #pragma endregion
 
@@ -389,7 +501,7 @@ void* Rsrc::compileRES(size_t *size) {
 ///////////////////////////////////////////////////////////////////////////////
 ///// ResourceType
 ///////////////////////////////////////////////////////////////////////////////
-ResourceType::ResourceType(const_resid type, const_bytes data, size_t size, uint32_t start, uint32_t startVA, ResourceDirectoryEntry entry) : type(dup(type)) {
+ResourceType::ResourceType(const_resid type, const_bytes data, size_t size, uint32_t start, uint32_t startVA, ResourceDirectoryEntry entry) : type(dup(type)), modified(false) {
 	uint32_t nEntries;
 	ResourceDirectoryEntry *entries = GetEntries(data, size, start+entry.OffsetToDirectory, &nEntries);
 	for (uint16_t i = 0; i < nEntries; i++) {
@@ -398,9 +510,10 @@ ResourceType::ResourceType(const_resid type, const_bytes data, size_t size, uint
 		this->names[name] = new ResourceName(name, data, size, start, startVA, entries[i]);
 	}
 }
-ResourceType::ResourceType(const_resid type, const_resid name, uint16_t lang, const void* data, size_t size) : type(dup(type)) {
-	//this->names.set(dup(name), new ResourceName(name, lang, data, size));
-	this->names[dup(name)] = new ResourceName(name, lang, data, size);
+ResourceType::ResourceType(const_resid type) : type(dup(type)), modified(true) { }
+ResourceType::ResourceType(const ResourceType& t) : type(dup(t.type)), modified(true) {
+	for (NameMap::const_iterator i = t.names.begin(); i != t.names.end(); ++i)
+		this->names.insert(this->names.end(), NameMap::value_type(dup(i->first), new ResourceName(*i->second)));
 }
 ResourceType::~ResourceType() {
 	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i) {
@@ -417,6 +530,7 @@ bool ResourceType::cleanup() {
 			free_id(i->first);
 			delete i->second;
 			this->names.erase(i++);
+			this->modified = true;
 		} else { ++i; }
 	}
 	return this->isEmpty();
@@ -446,17 +560,30 @@ bool ResourceType::remove(const_resid name, uint16_t lang) {
 		free_id(iter->first);
 		delete iter->second;
 		this->names.erase(iter);
+		this->modified = true;
 	}
 	return b;
 }
-bool ResourceType::add(const_resid name, uint16_t lang, const void* data, size_t size, Overwrite overwrite) {
+ResourceName* ResourceType::getOrCreate(const_resid name, Overwrite overwrite) {
 	NameMap::iterator iter = this->names.find((resid)name);
-	if (iter == this->names.end() && (overwrite == ALWAYS || overwrite == NEVER)) {
-		//this->names.set(dup(name), new ResourceName(name, lang, data, size));
-		this->names[dup(name)] = new ResourceName(name, lang, data, size);
-		return true;
+	if (iter == this->names.end()) {
+		if (overwrite == ONLY) { return NULL; }
+		iter = this->names.insert(NameMap::value_type(dup(name), new ResourceName(name))).first;
+		this->modified = true;
 	}
-	return iter->second->add(lang, data, size, overwrite);
+	return iter->second;
+}
+bool ResourceType::add(const_resid name, uint16_t lang, const void* data, size_t size, Overwrite overwrite) {
+	ResourceName* n = this->getOrCreate(name, overwrite);
+	return n && n->add(lang, data, size, overwrite);
+}
+bool ResourceType::add(const_resid name, uint16_t lang, const void* data, size_t size, ResourcePayload::Deleter deleter, void* owner, Overwrite overwrite) {
+	return this->add(name, lang, ResourcePayload::Adopt(data, size, deleter, owner), overwrite);
+}
+bool ResourceType::add(const_resid name, uint16_t lang, ResourcePayload* p, Overwrite overwrite) {
+	ResourceName* n = this->getOrCreate(name, overwrite);
+	if (!n) { p->release(); return false; }
+	return n->add(lang, p, overwrite);
 }
 bool ResourceType::isEmpty() const { return this->names.empty(); }
 ResourceName* ResourceType::operator[](const_resid name) {
@@ -503,19 +630,46 @@ void ResourceType::writeLangDirs(bytes data, size_t& pos, size_t& posDir) const
 	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i)
 		i->second->writeLangDirs(data, pos, posDir);
 }
-void ResourceType::writeData(bytes data, size_t& posDataEntry, size_t& posData, uint32_t startVA) const {
+void ResourceType::collect(std::vector<const ResourceLang*>& langs) const {
 	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i)
-		i->second->writeData(data, posDataEntry, posData, startVA);
+		i->second->collect(langs);
 }
 size_t ResourceType::getRESSize() const {
-	size_t xlen = GetRESHeaderIDExtraLen(this->type), size = 0;
+	size_t size = 0;
 	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i)
-		size += i->second->getRESSize(xlen);
+		size += i->second->getRESSize(this->type);
 	return size;
 }
-void ResourceType::writeRESData(bytes data, size_t& pos) const {
+bool ResourceType::visit(uint16_t lang, ResourceVisitor f, void* param, size_t& n) const {
 	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i)
-		i->second->writeRESData(data, pos, this->type);
+		if (!i->second->visit(this->type, lang, f, param, n)) { return false; }
+	return true;
+}
+bool ResourceType::isModified() const {
+	if (this->modified) { return true; }
+	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i)
+		if (i->second->isModified()) { return true; }
+	return false;
+}
+bool ResourceType::getPatchSize(const_bytes section, size_t size, uint32_t startVA, size_t& extra) const {
+	if (this->modified) { return false; }
+	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i)
+		if (!i->second->getPatchSize(section, size, startVA, extra)) { return false; }
+	return true;
+}
+void ResourceType::patch(bytes section, uint32_t startVA, size_t& pos) {
+	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i)
+		i->second->patch(section, startVA, pos);
+}
+void ResourceType::saved(size_t& posDataEntry) {
+	this->modified = false;
+	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i)
+		i->second->saved(posDataEntry);
+}
+bool ResourceType::writeRESData(DataSink& sink) const {
+	for (NameMap::const_iterator i = this->names.begin(); i != this->names.end(); ++i)
+		if (!i->second->writeRESData(sink, this->type)) { return false; }
+	return true;
 }
 #pragma endregion
 
@@ -523,16 +677,17 @@ void ResourceType::writeRESData(bytes data, size_t& pos) const {
 ///////////////////////////////////////////////////////////////////////////////
 ///// ResourceName
 ///////////////////////////////////////////////////////////////////////////////
-ResourceName::ResourceName(const_resid name, const_bytes data, size_t size, uint32_t start, uint32_t startVA, ResourceDirectoryEntry entry) : name(dup(name)) {
+ResourceName::ResourceName(const_resid name, const_bytes data, size_t size, uint32_t start, uint32_t startVA, ResourceDirectoryEntry entry) : name(dup(name)), modified(false) {
 	uint32_t nEntries;
 	ResourceDirectoryEntry *entries = GetEntries(data, size, start+entry.OffsetToDirectory, &nEntries);
 	for (uint16_t i = 0; i < nEntries; i++)
 		//this->langs.set(entries[i].Id, new ResourceLang(entries[i].Id, data, size, start, startVA, entries[i]));
 		this->langs[entries[i].Id] = new ResourceLang(entries[i].Id, data, size, start, startVA, entries[i]);
 }
-ResourceName::ResourceName(const_resid name, uint16_t lang, const void* data, size_t size) : name(dup(name)) {
-	//this->langs.set(lang, new ResourceLang(lang, data, size));
-	this->langs[lang] = new ResourceLang(lang, data, size);
+ResourceName::ResourceName(const_resid name) : name(dup(name)), modified(true) { }
+ResourceName::ResourceName(const ResourceName& n) : name(dup(n.name)), modified(true) {
+	for (LangMap::const_iterator i = n.langs.begin(); i != n.langs.end(); ++i)
+		this->langs.insert(this->langs.end(), LangMap::value_type(i->first, new ResourceLang(*i->second)));
 }
 ResourceName::~ResourceName() {
 	for (LangMap::const_iterator i = this->langs.begin(); i != this->langs.end(); ++i) {
@@ -547,6 +702,7 @@ bool ResourceName::cleanup() {
 		if (i->second->getDataSize() == 0) {
 			delete i->second;
 			this->langs.erase(i++);
+			this->modified = true;
 		} else { ++i; }
 	}
 	return this->isEmpty();
@@ -577,19 +733,31 @@ bool ResourceName::remove(uint16_t lang) {
 		return false;
 	delete iter->second;
 	this->langs.erase(iter);
+	this->modified = true;
 	return true;
 }
 bool ResourceName::add(uint16_t lang, const void* data, size_t size, Overwrite overwrite) {
 	LangMap::iterator iter = this->langs.find(lang);
 	if (iter == this->langs.end() && (overwrite == ALWAYS || overwrite == NEVER)) {
 		//this->langs.set(lang, new ResourceLang(lang, data, size));
-		this->langs[lang] = new ResourceLang(lang, data, size);
+		this->langs[lang] = new ResourceLang(lang, ResourcePayload::Create(data, size));
+		this->modified = true;
 		return true;
-	} else if (overwrite == ALWAYS || overwrite == ONLY) {
+	} else if (iter != this->langs.end() && (overwrite == ALWAYS || overwrite == ONLY)) {
 		return iter->second->set(data, size);
 	}
 	return false;
 }
+bool ResourceName::add(uint16_t lang, const void* data, size_t size, ResourcePayload::Deleter deleter, void* owner, Overwrite overwrite) {
+	return this->add(lang, ResourcePayload::Adopt(data, size, deleter, owner), overwrite);
+}
+bool ResourceName::add(uint16_t lang, ResourcePayload* p, Overwrite overwrite) {
+	LangMap::iterator iter = this->langs.find(lang);
+	if (iter == this->langs.end() ? overwrite == ONLY : overwrite == NEVER) { p->release(); return false; }
+	if (iter == this->langs.end()) { this->langs[lang] = new ResourceLang(lang, p); this->modified = true; }
+	else { iter->second->set(p); }
+	return true;
+}
 bool ResourceName::isEmpty() const { return this->langs.empty(); }
 ResourceLang* ResourceName::operator[](uint16_t lang) {
 	LangMap::iterator iter = this->langs.find(lang);
@@ -634,19 +802,54 @@ void ResourceName::writeLangDirs(bytes data, size_t& pos, size_t& posDir) const
 		pos += sizeof(ResourceDirectoryEntry);
 	}
 }
-void ResourceName::writeData(bytes data, size_t& posDataEntry, size_t& posData, uint32_t startVA) const {
+void ResourceName::collect(std::vector<const ResourceLang*>& langs) const {
 	for (LangMap::const_iterator i = this->langs.begin(); i != this->langs.end(); ++i)
-		i->second->writeData(data, posDataEntry, posData, startVA);
+		langs.push_back(i->second);
 }
-size_t ResourceName::getRESSize(size_t addl_hdr_size) const {
-	size_t xlen = addl_hdr_size + GetRESHeaderIDExtraLen(this->name), size = 0;
+size_t ResourceName::getRESSize(const_resid type) const {
+	size_t size = 0;
 	for (LangMap::const_iterator i = this->langs.begin(); i != this->langs.end(); ++i)
-		size += i->second->getRESSize(xlen);
+		size += i->second->getRESSize(type, this->name);
 	return size;
 }
-void ResourceName::writeRESData(bytes data, size_t& pos, const_resid type) const {
+bool ResourceName::visit(const_resid type, uint16_t lang, ResourceVisitor f, void* param, size_t& n) const {
+	LangMap::const_iterator i = this->langs.begin(), end = this->langs.end();
+	if (lang != Rsrc::ANY_LANG) { // only the one language
+		i = this->langs.find(lang);
+		if (i != end) { end = i; ++end; }
+	}
+	for (; i != end; ++i) {
+		const ResourcePayload* p = i->second->payload;
+		++n;
+		if (!f(type, this->name, i->first, p->data, p->size, param)) { return false; }
+	}
+	return true;
+}
+bool ResourceName::isModified() const {
+	if (this->modified) { return true; }
+	for (LangMap::const_iterator i = this->langs.begin(); i != this->langs.end(); ++i)
+		if (i->second->isModified()) { return true; }
+	return false;
+}
+bool ResourceName::getPatchSize(const_bytes section, size_t size, uint32_t startVA, size_t& extra) const {
+	if (this->modified) { return false; }
+	for (LangMap::const_iterator i = this->langs.begin(); i != this->langs.end(); ++i)
+		if (!i->second->getPatchSize(section, size, startVA, extra)) { return false; }
+	return true;
+}
+void ResourceName::patch(bytes section, uint32_t startVA, size_t& pos) {
+	for (LangMap::const_iterator i = this->langs.begin(); i != this->langs.end(); ++i)
+		i->second->patch(section, startVA, pos);
+}
+void ResourceName::saved(size_t& posDataEntry) {
+	this->modified = false;
 	for (LangMap::const_iterator i = this->langs.begin(); i != this->langs.end(); ++i)
-		i->second->writeRESData(data, pos, type, this->name);
+		i->second->saved(posDataEntry);
+}
+bool ResourceName::writeRESData(DataSink& sink, const_resid type) const {
+	for (LangMap::const_iterator i = this->langs.begin(); i != this->langs.end(); ++i)
+		if (!i->second->writeRESData(sink, type, this->name)) { return false; }
+	return true;
 }
 
 #pragma endregion
@@ -655,43 +858,189 @@ void ResourceName::writeRESData(bytes data, size_t& pos, const_resid type) const
 ///////////////////////////////////////////////////////////////////////////////
 ///// ResourceLang
 ///////////////////////////////////////////////////////////////////////////////
-ResourceLang::ResourceLang(uint16_t lang, const_bytes data, size_t size, uint32_t start, uint32_t startVA, ResourceDirectoryEntry entry) : lang(lang) {
+ResourcePayload* ResourcePayload::Create(const void* data, size_t size, bool borrow) {
+	ResourcePayload* p = (ResourcePayload*)malloc(sizeof(ResourcePayload) + (borrow ? 0 : size));
+	p->refs = 1;
+	p->size = size;
+	p->data = borrow ? data : ((size == 0) ? (void*)(p + 1) : memcpy(p + 1, data, size));
+	p->deleter = NULL;
+	p->owner = NULL;
+	return p;
+}
+ResourcePayload* ResourcePayload::Adopt(const void* data, size_t size, Deleter deleter, void* owner) {
+	ResourcePayload* p = (ResourcePayload*)malloc(sizeof(ResourcePayload));
+	p->refs = 1;
+	p->size = size;
+	p->data = data;
+	p->deleter = deleter;
+	p->owner = owner;
+	return p;
+}
+ResourcePayload* ResourcePayload::Part(ResourcePayload* whole, const void* data, size_t size) { return Adopt(data, size, &ReleaseWhole, whole->ref()); }
+void ResourcePayload::ReleaseWhole(void* whole) { ((ResourcePayload*)whole)->release(); }
+ResourceLang::ResourceLang(uint16_t lang, const_bytes data, size_t size, uint32_t start, uint32_t startVA, ResourceDirectoryEntry entry) : lang(lang), modified(false), entryPos(entry.OffsetToData) {
 	if (start+entry.OffsetToData+sizeof(ResourceDataEntry) > size) { throw resLoadFailure; }
 	ResourceDataEntry de = *(ResourceDataEntry*)(data+start+entry.OffsetToData);
 	if (start+de.OffsetToData-startVA+de.Size > size) { throw resLoadFailure; }
-	this->data = malloc(this->length = de.Size);
-	if (this->length == 0) { return; }
-	memcpy(this->data, data+start+de.OffsetToData-startVA, this->length);
+	this->payload = ResourcePayload::Create(data+start+de.OffsetToData-startVA, de.Size);
+	this->slot = de.Size;
 }
-ResourceLang::ResourceLang(uint16_t lang, const void* data, size_t size) : lang(lang), length(size) {
-	this->data = memcpy(malloc(size), data, length);
-}
-ResourceLang::~ResourceLang() { free(this->data); }
+ResourceLang::ResourceLang(uint16_t lang, ResourcePayload* payload) : lang(lang), payload(payload), modified(true), entryPos(NOT_SAVED), slot(0) { }
+ResourceLang::ResourceLang(const ResourceLang& l) : lang(l.lang), payload(l.payload->ref()), modified(true), entryPos(NOT_SAVED), slot(0) { } // a clone is not in any section
+ResourceLang::~ResourceLang() { this->payload->release(); }
 const_resid ResourceLang::getId() const { return MakeResID(this->lang); }
-void* ResourceLang::get(size_t *size) const { return memcpy(malloc(this->length), this->data, *size = this->length); }
+void* ResourceLang::get(size_t *size) const { return memcpy(malloc(this->payload->size), this->payload->data, *size = this->payload->size); }
+const void* ResourceLang::getView(size_t *size) const { *size = this->payload->size; return this->payload->data; }
 bool ResourceLang::set(const void* dat, size_t size) {
-	if (this->length != size)
-	{
-		free(this->data);
-		this->data = malloc(this->length = size);
-	}
-	memcpy(this->data, dat, size);
+	ResourcePayload* p = this->payload;
+	this->modified = true;
+	if (p->isWritable() && p->size == size) { memmove((void*)p->data, dat, size); return true; } // no one else can see it
+	this->set(ResourcePayload::Create(dat, size)); // copy-on-write, dat may point into the old payload
 	return true;
 }
-size_t ResourceLang::getDataSize() const		{ return this->length; }
+bool ResourceLang::set(const void* dat, size_t size, ResourcePayload::Deleter deleter, void* owner) { this->set(ResourcePayload::Adopt(dat, size, deleter, owner)); return true; }
+void ResourceLang::set(ResourcePayload* p) {
+	ResourcePayload* old = this->payload;
+	this->payload = p;
+	this->modified = true;
+	old->release();
+}
+size_t ResourceLang::getDataSize() const		{ return this->payload->size; }
 size_t ResourceLang::getHeaderSize() const		{ return sizeof(ResourceDataEntry); }
 size_t ResourceLang::getThisHeaderSize() const	{ return sizeof(ResourceDataEntry); }
-void ResourceLang::writeData(bytes dat, size_t& posDataEntry, size_t& posData, size_t startVA) const {
-	ResourceDataEntry de = {(uint32_t)(posData+startVA), (uint32_t)this->length, 0, 0}; // needs to be an RVA
+void ResourceLang::writeData(bytes dat, size_t posDataEntry, size_t posData, uint32_t startVA) const {
+	ResourceDataEntry de = {(uint32_t)(posData+startVA), (uint32_t)this->payload->size, 0, 0}; // needs to be an RVA
 	memcpy(dat+posDataEntry, &de, sizeof(ResourceDataEntry));
+	memcpy(dat+posData, this->payload->data, this->payload->size);
+}
+size_t ResourceLang::getRESSize(const_resid type, const_resid name) const { return GetRESHeaderSize(type, name) + roundUpTo<4>(this->payload->size); }
+bool ResourceLang::writeRESData(DataSink& sink, const_resid type, const_resid name) const {
+	static const byte zeros[4] = { 0, 0, 0, 0 };
+	StagingSink s(sink); // small resources go out in the same write as their header
+	size_t size = this->payload->size;
+	return WriteRESHeader(s, type, name, this->lang, size) && s.write(this->payload->data, size) && s.write(zeros, roundUpTo<4>(size) - size) && s.flush();
+}
+bool ResourceLang::isModified() const { return this->modified; }
+bool ResourceLang::getPatchSize(const_bytes section, size_t size, uint32_t startVA, size_t& extra) const {
+	if (!this->modified) { return true; }
+	if (this->entryPos == NOT_SAVED || this->payload->size == 0) { return false; } // new resources need new directories and empty ones are removed
+	if (this->entryPos > size || size - this->entryPos < sizeof(ResourceDataEntry)) { return false; }
+	ResourceDataEntry de;
+	memcpy(&de, section+this->entryPos, sizeof(ResourceDataEntry));
+	if (de.OffsetToData < startVA || de.OffsetToData - startVA > size || size - (de.OffsetToData - startVA) < this->slot) { return false; }
+	if (this->payload->size > this->slot) { extra += roundUpTo<4>(this->payload->size); }
+	return true;
+}
+void ResourceLang::patch(bytes section, uint32_t startVA, size_t& pos) {
+	if (!this->modified) { return; }
+	ResourceDataEntry de;
+	memcpy(&de, section+this->entryPos, sizeof(ResourceDataEntry));
+	size_t size = this->payload->size;
+	if (size <= this->slot) { // fits where the old data was
+		bytes d = section + (de.OffsetToData - startVA);
+		memcpy(d, this->payload->data, size);
+		memset(d+size, 0, this->slot-size);
+	} else { // goes after everything else
+		memcpy(section+pos, this->payload->data, size);
+		memset(section+pos+size, 0, roundUpTo<4>(size)-size);
+		de.OffsetToData = (uint32_t)(pos+startVA);
+		this->slot = (uint32_t)roundUpTo<4>(size);
+		pos += this->slot;
+	}
+	de.Size = (uint32_t)size;
+	memcpy(section+this->entryPos, &de, sizeof(ResourceDataEntry));
+	this->modified = false;
+}
+void ResourceLang::saved(size_t& posDataEntry) {
+	this->modified = false;
+	this->entryPos = (uint32_t)posDataEntry;
+	this->slot = (uint32_t)roundUpTo<4>(this->payload->size);
 	posDataEntry += sizeof(ResourceDataEntry);
-	memcpy(dat+posData, this->data, this->length);
-	posData += roundUpTo<4>(this->length);
-}
-size_t ResourceLang::getRESSize(size_t addl_hdr_size) const { return roundUpTo<4>(this->length + RESHeaderSize + addl_hdr_size); }
-void ResourceLang::writeRESData(bytes dat, size_t& pos, const_resid type, const_resid name) const {
-	pos += WriteRESHeader(dat+pos, type, name, this->lang, this->length);
-	memcpy(dat+pos, this->data, this->length);
-	pos = roundUpTo<4>(pos + this->length);
+}
+#pragma endregion
+
+#pragma region CompiledRsrc
+///////////////////////////////////////////////////////////////////////////////
+///// CompiledRsrc
+///////////////////////////////////////////////////////////////////////////////
+CompiledRsrc::CompiledRsrc(bytes data, size_t size, size_t entries, size_t nEntries) : data(data), size(size), entries(entries), nEntries(nEntries) { }
+CompiledRsrc::~CompiledRsrc() { free(this->data); }
+size_t CompiledRsrc::getSize() const { return this->size; }
+void CompiledRsrc::write(bytes dest, uint32_t startVA) const {
+	memcpy(dest, this->data, this->size);
+	bytes e = dest + this->entries; // OffsetToData is the first field of each entry and was compiled for an address of 0
+	for (size_t i = 0; i < this->nEntries; ++i, e += sizeof(ResourceDataEntry)) {
+		uint32_t rva;
+		memcpy(&rva, e, sizeof(uint32_t));
+		rva += startVA;
+		memcpy(e, &rva, sizeof(uint32_t));
+	}
+}
+#pragma endregion
+
+#pragma region RESReader
+///////////////////////////////////////////////////////////////////////////////
+///// RESReader
+///////////////////////////////////////////////////////////////////////////////
+RESReader::RESReader(const void* data, size_t size) : data((const_bytes)data), size(data ? size : 0), pos(0), error(false) { }
+bool RESReader::readName(const_bytes hdr, size_t hdrSize, size_t& p, Name* n) {
+	uint16_t c;
+	if (hdrSize - p < sizeof(uint32_t)) { return false; }
+	memcpy(&c, hdr+p, sizeof(uint16_t));
+	if (c == 0xFFFF) {
+		memcpy(&n->id, hdr+p+sizeof(uint16_t), sizeof(uint16_t));
+		n->str = utf16_view();
+		p += sizeof(uint32_t);
+		return true;
+	}
+	size_t len = 0;
+	for (;;) {
+		if ((hdrSize - p) / sizeof(uint16_t) <= len) { return false; }
+		memcpy(&c, hdr+p+len*sizeof(uint16_t), sizeof(uint16_t));
+		if (c == 0) { break; }
+		++len;
+	}
+	n->id = 0;
+	n->str = utf16_view((const uint16_t*)(hdr+p), len);
+	p += (len + 1) * sizeof(uint16_t);
+	return true;
+}
+bool RESReader::next(Entry* e) {
+	while (!this->error && this->size - this->pos >= sizeof(uint32_t)*2) {
+		const_bytes hdr = this->data + this->pos;
+		uint32_t dataSize, hdrSize;
+		memcpy(&dataSize, hdr, sizeof(uint32_t));
+		memcpy(&hdrSize, hdr+sizeof(uint32_t), sizeof(uint32_t));
+		size_t p = sizeof(uint32_t)*2;
+		if (hdrSize < p + RESHeaderTrailerSize || hdrSize > this->size - this->pos || dataSize > this->size - this->pos - hdrSize ||
+			!this->readName(hdr, hdrSize, p, &e->type) || !this->readName(hdr, hdrSize, p, &e->name) || p > hdrSize - RESHeaderTrailerSize) {
+			this->error = true;
+			return false;
+		}
+
+		// The fixed part is read from the end of the header since some writers do not align it
+		p = hdrSize - RESHeaderTrailerSize;
+		memcpy(&e->dataVersion, hdr+p, sizeof(uint32_t));
+		memcpy(&e->memoryFlags, hdr+p+4, sizeof(uint16_t));
+		memcpy(&e->lang, hdr+p+6, sizeof(uint16_t));
+		memcpy(&e->version, hdr+p+8, sizeof(uint32_t));
+		memcpy(&e->characteristics, hdr+p+12, sizeof(uint32_t));
+		e->data = hdr + hdrSize;
+		e->size = dataSize;
+
+		size_t next = roundUpTo<4>(this->pos + hdrSize + dataSize);
+		this->pos = (next > this->size) ? this->size : next;
+		if (dataSize == 0 && e->type.str.empty() && e->type.id == 0 && e->name.str.empty() && e->name.id == 0) { continue; } // the empty entry
+		return true;
+	}
+	return false;
+}
+bool RESReader::hasError() const { return this->error; }
+size_t RESReader::position() const { return this->pos; }
+bool RESReader::IsValid(const void* data, size_t size) {
+	RESReader r(data, size);
+	Entry e;
+	while (r.next(&e));
+	return !r.hasError();
 }
 #pragma endregion
@@ -26,16 +26,26 @@
 #ifndef _DECLARE_ALL_PE_FILE_RESOURCES_
 
 class Rsrc;
+class CompiledRsrc;
 
 #else
 
 #include "PEDataTypes.h"
+#include "PEDataSource.h"
 
 #include <map>
 #include <vector>
 
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1600)
+#define PE_HAS_MOVE // the adopting overloads that take a std::vector or std::unique_ptr are available
+#include <memory>
+#include <utility>
+#endif
+
 namespace PE {
 
+class File;
+
 // A comparator for resource names
 struct ResCmp { bool operator()(const_resid a, const_resid b) const; };
 
@@ -49,16 +59,51 @@ private:
 	virtual size_t getThisHeaderSize() const = 0;
 };
 
+// The data of a resource, which is shared between clones of a tree and is reference counted
+// It is never changed while shared, so setting a resource whose data is shared replaces it (copy-on-write)
+struct ResourcePayload {
+	typedef void (*Deleter)(void* owner);
+
+	volatile long refs;
+	size_t size;
+	const void* data; // right after this unless borrowed or adopted
+	Deleter deleter; // called with owner when the last reference is released, only for adopted data
+	void* owner;
+
+	static ResourcePayload* Create(const void* data, size_t size, bool borrow = false); // if borrow the data must outlive the payload
+	static ResourcePayload* Adopt(const void* data, size_t size, Deleter deleter, void* owner); // takes ownership of the data without copying it
+	static ResourcePayload* Part(ResourcePayload* whole, const void* data, size_t size); // a view of part of whole's data that keeps a reference to it, never written
+	inline ResourcePayload* ref() { Internal::AtomicIncrement(&this->refs); return this; }
+	inline void release() { if (Internal::AtomicDecrement(&this->refs) == 0) { if (this->deleter) { this->deleter(this->owner); } free(this); } }
+	inline bool isWritable() const { return this->refs == 1 && (this->data == this + 1 || (this->deleter && this->deleter != &ReleaseWhole)); } // owned and not shared
+
+	template<typename T> static void Delete(void* owner) { delete (T*)owner; } // a deleter for an owner created with new
+private:
+	static void ReleaseWhole(void* whole);
+public:
+};
+
+// Called for every resource when visiting a tree, the data is a view that is valid until the resource is changed or removed
+typedef bool (*ResourceVisitor)(const_resid type, const_resid name, uint16_t lang, const void* data, size_t size, void* param); // return false to stop
+
+// The adopting overloads take ownership of data, which is released with deleter(owner) once no tree uses it. Ownership is
+// taken even when they fail, for example a malloc-ed buffer can be given with deleter free and owner data.
+
 // The final resource directory, contains the data for the resource
 class ResourceLang : Resource {
 	friend class ResourceName;
+	friend class Rsrc;
 
 	uint16_t lang;
-	void* data;
-	size_t length;
+	ResourcePayload* payload;
+	bool modified; // the data changed since it was loaded or saved
+	uint32_t entryPos, slot; // the position of the data entry in the .rsrc section and the room for the data there, entryPos is NOT_SAVED if not in the section
+	static const uint32_t NOT_SAVED = 0xFFFFFFFF;
 
 	ResourceLang(uint16_t lang, const_bytes data, size_t size, uint32_t start, uint32_t startVA, Image::ResourceDirectoryEntry entry);
-	ResourceLang(uint16_t lang, const void* data, size_t size);
+	ResourceLang(uint16_t lang, ResourcePayload* payload); // takes the reference
+	ResourceLang(const ResourceLang& l); // shares the payload
+	ResourceLang& operator=(const ResourceLang&);
 public:
 	~ResourceLang();
 
@@ -66,16 +111,33 @@ public:
 
 	bool isLoaded() const;
 	void* get(size_t* size) const; // must be freed
+	const void* getView(size_t* size) const; // not copied, valid until the resource is changed or removed
 	bool set(const void* data, size_t size);
+	bool set(const void* data, size_t size, ResourcePayload::Deleter deleter, void* owner); // adopts data
+	bool isModified() const;
+#ifdef PE_HAS_MOVE
+	template<typename T> inline bool set(std::vector<T>&& data) {
+		std::vector<T>* v = new std::vector<T>(std::move(data));
+		return this->set(v->empty() ? NULL : &(*v)[0], v->size() * sizeof(T), &ResourcePayload::Delete<std::vector<T> >, v);
+	}
+	template<typename T, typename D> inline bool set(std::unique_ptr<T[], D>&& data, size_t size) { // size is in bytes
+		std::unique_ptr<T[], D>* p = new std::unique_ptr<T[], D>(std::move(data));
+		return this->set(p->get(), size, &ResourcePayload::Delete<std::unique_ptr<T[], D> >, p);
+	}
+#endif
 
 private:
+	void set(ResourcePayload* p); // takes the reference
+	bool getPatchSize(const_bytes section, size_t size, uint32_t startVA, size_t& extra) const;
+	void patch(bytes section, uint32_t startVA, size_t& pos);
+	void saved(size_t& posDataEntry);
 	virtual size_t getDataSize() const;
 	virtual size_t getHeaderSize() const;
 	virtual size_t getThisHeaderSize() const;
-	void writeData(bytes data, size_t& posDataEntry, size_t& posData, size_t startVA) const;
+	void writeData(bytes data, size_t posDataEntry, size_t posData, uint32_t startVA) const;
 
-	virtual size_t getRESSize(size_t addl_hdr_size) const;
-	void writeRESData(bytes data, size_t& pos, const_resid type, const_resid name) const;
+	size_t getRESSize(const_resid type, const_resid name) const;
+	bool writeRESData(DataSink& sink, const_resid type, const_resid name) const;
 };
 
 // The named resource directory, the second level
@@ -86,9 +148,12 @@ class ResourceName : Resource {
 
 	typedef std::map<uint16_t, ResourceLang*> LangMap;
 	LangMap langs;
+	bool modified; // languages were added or removed since it was loaded or saved
 
 	ResourceName(const_resid name, const_bytes data, size_t size, uint32_t start, uint32_t startVA, Image::ResourceDirectoryEntry entry);
-	ResourceName(const_resid name, uint16_t lang, const void* data, size_t size);
+	ResourceName(const_resid name);
+	ResourceName(const ResourceName& n); // shares the payloads
+	ResourceName& operator=(const ResourceName&);
 public:
 	~ResourceName();
 
@@ -100,6 +165,17 @@ public:
 	void* get(uint16_t* lang, size_t* size) const;
 	bool remove(uint16_t lang);
 	bool add(uint16_t lang, const void* data, size_t size, Overwrite overwrite = ALWAYS);
+	bool add(uint16_t lang, const void* data, size_t size, ResourcePayload::Deleter deleter, void* owner, Overwrite overwrite = ALWAYS); // adopts data
+#ifdef PE_HAS_MOVE
+	template<typename T> inline bool add(uint16_t lang, std::vector<T>&& data, Overwrite overwrite = ALWAYS) {
+		std::vector<T>* v = new std::vector<T>(std::move(data));
+		return this->add(lang, v->empty() ? NULL : &(*v)[0], v->size() * sizeof(T), &ResourcePayload::Delete<std::vector<T> >, v, overwrite);
+	}
+	template<typename T, typename D> inline bool add(uint16_t lang, std::unique_ptr<T[], D>&& data, size_t size, Overwrite overwrite = ALWAYS) { // size is in bytes
+		std::unique_ptr<T[], D>* p = new std::unique_ptr<T[], D>(std::move(data));
+		return this->add(lang, p->get(), size, &ResourcePayload::Delete<std::unique_ptr<T[], D> >, p, overwrite);
+	}
+#endif
 
 	bool isEmpty() const;
 	
@@ -108,16 +184,25 @@ public:
 
 	std::vector<uint16_t> getLangs() const;
 
+	bool isModified() const;
+
 private:
 	bool cleanup();
 	virtual size_t getDataSize() const;
 	virtual size_t getHeaderSize() const;
 	virtual size_t getThisHeaderSize() const;
 	void writeLangDirs(bytes data, size_t& pos, size_t& posDir) const;
-	void writeData(bytes data, size_t& posDataEntry, size_t& posData, uint32_t startVA) const;
+	void collect(std::vector<const ResourceLang*>& langs) const;
+
+	bool add(uint16_t lang, ResourcePayload* p, Overwrite overwrite); // takes the reference
+
+	size_t getRESSize(const_resid type) const;
+	bool writeRESData(DataSink& sink, const_resid type) const;
+	bool visit(const_resid type, uint16_t lang, ResourceVisitor f, void* param, size_t& n) const;
 
-	virtual size_t getRESSize(size_t addl_hdr_size) const;
-	void writeRESData(bytes data, size_t& pos, const_resid type) const;
+	bool getPatchSize(const_bytes section, size_t size, uint32_t startVA, size_t& extra) const;
+	void patch(bytes section, uint32_t startVA, size_t& pos);
+	void saved(size_t& posDataEntry);
 };
 
 // The typed resource directory, the first level
@@ -127,9 +212,12 @@ class ResourceType : Resource {
 	resid type;
 	typedef std::map<resid, ResourceName*, ResCmp> NameMap;
 	NameMap names;
+	bool modified; // names were added or removed since it was loaded or saved
 
 	ResourceType(const_resid type, const_bytes data, size_t size, uint32_t start, uint32_t startVA, Image::ResourceDirectoryEntry entry);
-	ResourceType(const_resid type, const_resid name, uint16_t lang, const void* data, size_t size);
+	ResourceType(const_resid type);
+	ResourceType(const ResourceType& t); // shares the payloads
+	ResourceType& operator=(const ResourceType&);
 public:
 	~ResourceType();
 
@@ -141,6 +229,7 @@ public:
 	void* get (const_resid name, uint16_t* lang, size_t* size) const;
 	bool remove(const_resid name, uint16_t lang);
 	bool add(const_resid name, uint16_t lang, const void* data, size_t size, Overwrite overwrite = ALWAYS);
+	bool add(const_resid name, uint16_t lang, const void* data, size_t size, ResourcePayload::Deleter deleter, void* owner, Overwrite overwrite = ALWAYS); // adopts data
 
 	bool isEmpty() const;
 	
@@ -150,6 +239,8 @@ public:
 	std::vector<const_resid> getNames() const;
 	std::vector<uint16_t> getLangs(const_resid name) const;
 
+	bool isModified() const;
+
 private:
 	bool cleanup();
 	virtual size_t getDataSize() const;
@@ -157,25 +248,55 @@ private:
 	virtual size_t getThisHeaderSize() const;
 	void writeNameDirs(bytes data, size_t& pos, size_t& posDir, size_t& posData) const;
 	void writeLangDirs(bytes data, size_t& pos, size_t& posDir) const;
-	void writeData(bytes data, size_t& posDataEntry, size_t& posData, uint32_t startVA) const;
+	void collect(std::vector<const ResourceLang*>& langs) const;
+
+	ResourceName* getOrCreate(const_resid name, Overwrite overwrite); // only creates it if overwrite is not ONLY
+	bool add(const_resid name, uint16_t lang, ResourcePayload* p, Overwrite overwrite); // takes the reference
+
+	size_t getRESSize() const;
+	bool writeRESData(DataSink& sink) const;
+	bool visit(uint16_t lang, ResourceVisitor f, void* param, size_t& n) const;
+
+	bool getPatchSize(const_bytes section, size_t size, uint32_t startVA, size_t& extra) const;
+	void patch(bytes section, uint32_t startVA, size_t& pos);
+	void saved(size_t& posDataEntry);
+};
+
+class CompiledRsrc;
+
+// Where Rsrc::compile places the data of the resources, the directories and data entries are always in order
+// Without a layout the data is in the order of the directories, which scatters the resources that are read first
+struct RsrcLayout {
+	const const_resid* types; // the types whose data is placed first, in this order, the data of each type is together
+	size_t count;
+	uint32_t pageSize; // if not 0 the data of large resources starts on a page (from the start of the section)
+	size_t largeSize;
 
-	virtual size_t getRESSize() const;
-	void writeRESData(bytes data, size_t& pos) const;
+	static const RsrcLayout STARTUP; // the manifest, version, and icon and cursor groups first, 4 KB pages for 64 KB and larger
 };
 
 class Rsrc : Resource {
+	friend class File;
+
 	typedef std::map<resid, ResourceType*, ResCmp> TypeMap;
 	TypeMap types;
+	bool modified; // types were added or removed since it was loaded or saved
+	const RsrcLayout* layout;
 
 	Rsrc(const_bytes data, size_t size, Image::SectionHeader *section); // creates from ".rsrc" section in PE file
-	Rsrc(const_bytes data, size_t size); // creates from RES file
+	Rsrc(const_bytes data, size_t size, bool borrow); // creates from RES file
 	Rsrc(); // creates empty
+	Rsrc(const Rsrc& r); // shares the payloads
+	Rsrc& operator=(const Rsrc&);
 public:
 	~Rsrc();
 	
 	static Rsrc* createFromRSRCSection(const_bytes data, size_t size, Image::SectionHeader *section);
-	static Rsrc* createFromRESFile(const_bytes data, size_t size);
+	static Rsrc* createFromRESFile(const_bytes data, size_t size, bool borrow = false); // if borrow the resources point into data (e.g. a mapped RES file) until they are changed, so it must outlive them
 	static Rsrc* createEmpty();
+	// Copies the directories but shares the data of every resource, which is only copied once it is changed in one of
+	// the trees. Different trees sharing data can be used from different threads.
+	Rsrc* clone() const;
 
 	const_resid getId() const;
 
@@ -185,6 +306,23 @@ public:
 	void* get (const_resid type, const_resid name, uint16_t* lang, size_t* size) const;
 	bool remove(const_resid type, const_resid name, uint16_t lang);
 	bool add(const_resid type, const_resid name, uint16_t lang, const void* data, size_t size, Overwrite overwrite = ALWAYS);
+	bool add(const_resid type, const_resid name, uint16_t lang, const void* data, size_t size, ResourcePayload::Deleter deleter, void* owner, Overwrite overwrite = ALWAYS); // adopts data
+#ifdef PE_HAS_MOVE
+	template<typename T> inline bool add(const_resid type, const_resid name, uint16_t lang, std::vector<T>&& data, Overwrite overwrite = ALWAYS) {
+		std::vector<T>* v = new std::vector<T>(std::move(data));
+		return this->add(type, name, lang, v->empty() ? NULL : &(*v)[0], v->size() * sizeof(T), &ResourcePayload::Delete<std::vector<T> >, v, overwrite);
+	}
+	template<typename T, typename D> inline bool add(const_resid type, const_resid name, uint16_t lang, std::unique_ptr<T[], D>&& data, size_t size, Overwrite overwrite = ALWAYS) { // size is in bytes
+		std::unique_ptr<T[], D>* p = new std::unique_ptr<T[], D>(std::move(data));
+		return this->add(type, name, lang, p->get(), size, &ResourcePayload::Delete<std::unique_ptr<T[], D> >, p, overwrite);
+	}
+#endif
+	// Adds every resource of a RES file straight from its data, returns the number added or -1 if the file is malformed (then nothing is added)
+	// If borrow the resources point into data until they are changed, so it must outlive them
+	size_t addRES(const_bytes data, size_t size, Overwrite overwrite = ALWAYS, bool borrow = false);
+	// As above but the resources point into the payload of the whole RES file (e.g. one adopting a mapping of it), which is released
+	// once none of them use it anymore. Takes the reference.
+	size_t addRES(ResourcePayload* res, Overwrite overwrite = ALWAYS);
 	
 	bool isEmpty() const;
 	
@@ -195,15 +333,89 @@ public:
 	std::vector<const_resid> getNames(const_resid type) const;
 	std::vector<uint16_t> getLangs(const_resid type, const_resid name) const;
 
+	// Walks the whole tree once in order without allocating anything, calling f for every resource
+	// The type can be NULL for all types and lang can be ANY_LANG for all languages, returns the number visited
+	static const uint16_t ANY_LANG = 0xFFFF;
+	size_t visit(ResourceVisitor f, void* param, const_resid type = NULL, uint16_t lang = ANY_LANG) const;
+
 	bool cleanup();
+	// The layout is used when compiling, NULL for the default, it must outlive the tree (and its clones). Changing it marks the tree
+	// modified so the next save compiles. Later saves that only patch data keep the placement, resources that grew are appended.
+	void setLayout(const RsrcLayout* layout);
+	const RsrcLayout* getLayout() const;
 	void* compile(size_t* size, uint32_t startVA); // calls cleanup
-	void* compileRES(size_t* size); // calls cleanup
+
+	// Incremental saving: a tree loaded from a .rsrc section remembers where each resource is in it (as does a tree after
+	// File::save compiles it), so if only the data of existing resources changed they can be written over their old data
+	// or, if they grew, appended to the end of the section while everything else stays where it is.
+	bool isModified() const;
+	// Gets the number of bytes that need to be appended to the section of size bytes to patch it or -1 if it must be compiled
+	size_t getPatchSize(const_bytes section, size_t size, uint32_t startVA) const;
+	void patch(bytes section, size_t size, uint32_t startVA); // the section needs room for getPatchSize bytes after size rounded up to 4
+	CompiledRsrc* precompile(); // calls cleanup, compiles once so it can be placed at any address, see File::replaceResources
+	void* compileRES(size_t* size); // calls cleanup, returns NULL if the memory cannot be allocated
+	bool compileRES(DataSink& sink); // calls cleanup, streams the RES file without building it in memory
+	bool compileRES(DataSource& ds); // calls cleanup, resizes ds once to fit then streams the RES file into it
+	size_t getRESFileSize(); // calls cleanup
 
 private:
 	virtual size_t getDataSize() const;
 	virtual size_t getHeaderSize() const;
 	virtual size_t getThisHeaderSize() const;
-	virtual size_t getRESSize() const;
+	size_t getRESSize() const;
+	ResourceType* getOrCreate(const_resid type, Overwrite overwrite); // only creates it if overwrite is not ONLY
+	bool add(const_resid type, const_resid name, uint16_t lang, ResourcePayload* p, Overwrite overwrite); // takes the reference
+	size_t addRES(const_bytes data, size_t size, Overwrite overwrite, bool borrow, ResourcePayload* whole);
+	size_t getLayoutRank(const_resid type) const;
+	bytes compile(size_t* size, uint32_t startVA, size_t* entries); // entries is set to the position of the first data entry
+	void saved(size_t entries); // the last compile was saved as the section so the tree tracks that layout
+};
+
+// A compiled resource section that can be placed at any address, the only things that depend on the address are the
+// RVAs in the data entries, which are all next to each other after the directories so they can be fixed up quickly
+class CompiledRsrc {
+	friend class Rsrc;
+
+	bytes data;
+	size_t size;
+	size_t entries, nEntries; // the position and number of the data entries
+
+	CompiledRsrc(bytes data, size_t size, size_t entries, size_t nEntries);
+	CompiledRsrc(const CompiledRsrc&);
+	CompiledRsrc& operator=(const CompiledRsrc&);
+public:
+	~CompiledRsrc();
+
+	size_t getSize() const;
+	void write(bytes dest, uint32_t startVA) const; // copies it into dest, which must have getSize() bytes, and fixes the RVAs for startVA
+};
+
+// Reads the entries of a RES file one at a time directly from its data (which can be mapped), nothing is copied
+class RESReader {
+public:
+	struct Name {
+		uint16_t id;
+		utf16_view str; // not empty if this is a string
+	};
+	struct Entry {
+		Name type, name;
+		uint16_t lang;
+		uint16_t memoryFlags;
+		uint32_t dataVersion, version, characteristics;
+		const_bytes data;
+		size_t size;
+	};
+private:
+	const_bytes data;
+	size_t size, pos;
+	bool error;
+	bool readName(const_bytes hdr, size_t hdrSize, size_t& p, Name* n);
+public:
+	RESReader(const void* data, size_t size);
+	bool next(Entry* e); // returns false at the end or if the data is malformed, the empty entry at the start is skipped
+	bool hasError() const; // the data was malformed
+	size_t position() const;
+	static bool IsValid(const void* data, size_t size); // reads every entry header, which only checks the headers and their sizes
 };
 
 }
@@ -0,0 +1,142 @@
+// pe-file: library for reading and manipulating pe-files
+// Copyright (C) 2012  Jeffrey Bush  jeff@coderforlife.com
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef __cplusplus_cli
+#pragma unmanaged
+#endif
+
+#include "PEHash.h"
+
+#include <string.h>
+
+using namespace PE;
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+inline static uint32_t GetBE32(const byte* p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+inline static void PutBE32(byte* p, uint32_t x) { p[0] = (byte)(x >> 24); p[1] = (byte)(x >> 16); p[2] = (byte)(x >> 8); p[3] = (byte)x; }
+
+#pragma region Block Hasher
+///////////////////////////////////////////////////////////////////////////////
+///// Block Hasher
+///////////////////////////////////////////////////////////////////////////////
+void BlockHasher::update(const void* data, size_t size) {
+	const byte* d = (const byte*)data;
+	this->total += size;
+	if (this->used) {
+		size_t n = 64 - this->used;
+		if (n > size) { n = size; }
+		memcpy(this->block + this->used, d, n);
+		this->used += n; d += n; size -= n;
+		if (this->used < 64) { return; }
+		this->compress(this->block);
+		this->used = 0;
+	}
+	for (; size >= 64; d += 64, size -= 64) { this->compress(d); } // full blocks are compressed directly from the data
+	if (size) { memcpy(this->block, d, size); this->used = size; }
+}
+void BlockHasher::pad() {
+	uint64_t bits = this->total * 8;
+	this->block[this->used++] = 0x80;
+	if (this->used > 56) {
+		memset(this->block + this->used, 0, 64 - this->used);
+		this->compress(this->block);
+		this->used = 0;
+	}
+	memset(this->block + this->used, 0, 56 - this->used);
+	PutBE32(this->block + 56, (uint32_t)(bits >> 32));
+	PutBE32(this->block + 60, (uint32_t)bits);
+	this->compress(this->block);
+	this->used = 0;
+}
+#pragma endregion
+
+#pragma region SHA-1
+///////////////////////////////////////////////////////////////////////////////
+///// SHA-1
+///////////////////////////////////////////////////////////////////////////////
+SHA1::SHA1() { this->reset(); }
+size_t SHA1::digestSize() const { return DIGEST_SIZE; }
+void SHA1::reset() {
+	this->h[0] = 0x67452301; this->h[1] = 0xEFCDAB89; this->h[2] = 0x98BADCFE; this->h[3] = 0x10325476; this->h[4] = 0xC3D2E1F0;
+	this->used = 0;
+	this->total = 0;
+}
+void SHA1::compress(const byte* block) {
+	uint32_t w[80];
+	for (int i = 0; i < 16; ++i) { w[i] = GetBE32(block + 4*i); }
+	for (int i = 16; i < 80; ++i) { uint32_t x = w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16]; w[i] = ROTL(x, 1); }
+	uint32_t a = this->h[0], b = this->h[1], c = this->h[2], d = this->h[3], e = this->h[4];
+	for (int i = 0; i < 80; ++i) {
+		uint32_t f, k;
+		if      (i < 20) { f = (b & c) | (~b & d);           k = 0x5A827999; }
+		else if (i < 40) { f = b ^ c ^ d;                    k = 0x6ED9EBA1; }
+		else if (i < 60) { f = (b & c) | (b & d) | (c & d);  k = 0x8F1BBCDC; }
+		else             { f = b ^ c ^ d;                    k = 0xCA62C1D6; }
+		uint32_t t = ROTL(a, 5) + f + e + k + w[i];
+		e = d; d = c; c = ROTL(b, 30); b = a; a = t;
+	}
+	this->h[0] += a; this->h[1] += b; this->h[2] += c; this->h[3] += d; this->h[4] += e;
+}
+void SHA1::finish(byte* digest) {
+	this->pad();
+	for (int i = 0; i < 5; ++i) { PutBE32(digest + 4*i, this->h[i]); }
+}
+#pragma endregion
+
+#pragma region SHA-256
+///////////////////////////////////////////////////////////////////////////////
+///// SHA-256
+///////////////////////////////////////////////////////////////////////////////
+static const uint32_t SHA256_K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+SHA256::SHA256() { this->reset(); }
+size_t SHA256::digestSize() const { return DIGEST_SIZE; }
+void SHA256::reset() {
+	this->h[0] = 0x6a09e667; this->h[1] = 0xbb67ae85; this->h[2] = 0x3c6ef372; this->h[3] = 0xa54ff53a;
+	this->h[4] = 0x510e527f; this->h[5] = 0x9b05688c; this->h[6] = 0x1f83d9ab; this->h[7] = 0x5be0cd19;
+	this->used = 0;
+	this->total = 0;
+}
+void SHA256::compress(const byte* block) {
+	uint32_t w[64];
+	for (int i = 0; i < 16; ++i) { w[i] = GetBE32(block + 4*i); }
+	for (int i = 16; i < 64; ++i) {
+		uint32_t s0 = ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+		uint32_t s1 = ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+	uint32_t a = this->h[0], b = this->h[1], c = this->h[2], d = this->h[3], e = this->h[4], f = this->h[5], g = this->h[6], h = this->h[7];
+	for (int i = 0; i < 64; ++i) {
+		uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+		uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+	}
+	this->h[0] += a; this->h[1] += b; this->h[2] += c; this->h[3] += d; this->h[4] += e; this->h[5] += f; this->h[6] += g; this->h[7] += h;
+}
+void SHA256::finish(byte* digest) {
+	this->pad();
+	for (int i = 0; i < 8; ++i) { PutBE32(digest + 4*i, this->h[i]); }
+}
+#pragma endregion
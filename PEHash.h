@@ -0,0 +1,70 @@
+// pe-file: library for reading and manipulating pe-files
+// Copyright (C) 2012  Jeffrey Bush  jeff@coderforlife.com
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Implements streaming SHA-1 and SHA-256 for hashing images without any external dependencies
+
+#ifndef PE_HASH_H
+#define PE_HASH_H
+
+#include "PEDataTypes.h"
+
+namespace PE {
+	// A streaming hash, data is given with any number of update calls and then finish gives the digest
+	class Hasher {
+	public:
+		virtual ~Hasher() { }
+		virtual size_t digestSize() const = 0;
+		virtual void reset() = 0;
+		virtual void update(const void* data, size_t size) = 0;
+		virtual void finish(byte* digest) = 0; // digest must be digestSize() bytes, must reset before reusing
+	};
+
+	// Shared block buffering for the Merkle-Damgard hashes below
+	class BlockHasher : public Hasher {
+	protected:
+		byte block[64];
+		size_t used;
+		uint64_t total;
+		virtual void compress(const byte* block) = 0;
+		void pad(); // adds the final padding and length, leaving the state ready to be output
+	public:
+		virtual void update(const void* data, size_t size);
+	};
+
+	class SHA1 : public BlockHasher {
+		uint32_t h[5];
+		virtual void compress(const byte* block);
+	public:
+		static const size_t DIGEST_SIZE = 20;
+		SHA1();
+		virtual size_t digestSize() const;
+		virtual void reset();
+		virtual void finish(byte* digest);
+	};
+
+	class SHA256 : public BlockHasher {
+		uint32_t h[8];
+		virtual void compress(const byte* block);
+	public:
+		static const size_t DIGEST_SIZE = 32;
+		SHA256();
+		virtual size_t digestSize() const;
+		virtual void reset();
+		virtual void finish(byte* digest);
+	};
+}
+
+#endif
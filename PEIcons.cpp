@@ -0,0 +1,281 @@
+// pe-file: library for reading and manipulating pe-files
+// Copyright (C) 2012  Jeffrey Bush  jeff@coderforlife.com
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef __cplusplus_cli
+#pragma unmanaged
+#endif
+
+#include "PEIcons.h"
+
+#include <string.h>
+#include <set>
+
+using namespace PE;
+using namespace PE::Icons;
+
+inline static uint16_t GetLE16(const_bytes p) { uint16_t x; memcpy(&x, p, sizeof(x)); return x; }
+inline static uint32_t GetLE32(const_bytes p) { uint32_t x; memcpy(&x, p, sizeof(x)); return x; }
+inline static uint16_t ImageType(bool cursor) { return cursor ? (uint16_t)IconDir::CURSOR : (uint16_t)IconDir::ICON; } // casts avoid odr-using the constants
+inline static const_resid GroupResType(bool cursor) { return cursor ? ResType::GROUP_CURSOR : ResType::GROUP_ICON; }
+inline static const_resid ImageResType(bool cursor) { return cursor ? ResType::CURSOR : ResType::ICON; }
+
+// Gets the planes and bit count from the header of an image, if it is a bitmap, PNG images are always 32-bit
+static void GetImageFormat(const_bytes img, size_t size, uint16_t* planes, uint16_t* bitCount) {
+	static const byte PNG[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	if (size >= 8 && memcmp(img, PNG, 8) == 0) { *planes = 1; *bitCount = 32; }
+	else if (size >= 16 && GetLE32(img) >= 40) { *planes = GetLE16(img+12); *bitCount = GetLE16(img+14); } // BITMAPINFOHEADER or later
+}
+
+#pragma region Icon Group
+///////////////////////////////////////////////////////////////////////////////
+///// Icon Group
+///////////////////////////////////////////////////////////////////////////////
+IconGroup::IconGroup() : cursor(false) { }
+bool IconGroup::parse(const_bytes group, size_t size, bool cursor) {
+	this->images.clear();
+	this->cursor = cursor;
+	if (size < sizeof(IconDir)) { return false; }
+	IconDir dir;
+	memcpy(&dir, group, sizeof(IconDir));
+	if (dir.Reserved != 0 || dir.Type != ImageType(cursor) || (size - sizeof(IconDir)) / sizeof(GroupIconDirEntry) < dir.Count) { return false; }
+	CASSERT(sizeof(GroupIconDirEntry) == sizeof(GroupCursorDirEntry));
+	this->images.resize(dir.Count);
+	for (uint16_t i = 0; i < dir.Count; ++i) {
+		const_bytes e = group + sizeof(IconDir) + i * sizeof(GroupIconDirEntry);
+		Entry& img = this->images[i];
+		memset(&img, 0, sizeof(Entry));
+		if (cursor) {
+			GroupCursorDirEntry c;
+			memcpy(&c, e, sizeof(c));
+			img.Id = c.Id; img.Width = c.Width; img.Height = c.Height / 2; img.Planes = c.Planes; img.BitCount = c.BitCount;
+		} else {
+			GroupIconDirEntry c;
+			memcpy(&c, e, sizeof(c));
+			img.Id = c.Id; img.Width = c.Width ? c.Width : 256; img.Height = c.Height ? c.Height : 256;
+			img.ColorCount = c.ColorCount; img.Planes = c.Planes; img.BitCount = c.BitCount;
+		}
+	}
+	return true;
+}
+void IconGroup::setData(Entry& img, const_bytes data, size_t size) {
+	if (!this->cursor) { img.Data = data; img.Size = size; }
+	else if (size >= 2*sizeof(uint16_t)) {
+		img.HotspotX = GetLE16(data);
+		img.HotspotY = GetLE16(data+2);
+		img.Data = data + 2*sizeof(uint16_t);
+		img.Size = size - 2*sizeof(uint16_t);
+	}
+}
+bool IconGroup::load(const void* peData, size_t peSize, const_resid name, uint16_t lang, bool cursor) {
+	const_bytes d = (const_bytes)peData;
+	File::DirectQuery g = { GroupResType(cursor), name, lang, false, 0, 0, 0 };
+	if (!File::GetResourcesDirect(peData, peSize, &g, 1) || !this->parse(d + g.offset, g.size, cursor)) { this->images.clear(); return false; }
+	size_t n = this->images.size();
+	if (n == 0) { return true; }
+
+	// Find all of the images at once, preferring the language of the group
+	std::vector<File::DirectQuery> qs(n);
+	for (size_t i = 0; i < n; ++i) {
+		File::DirectQuery q = { ImageResType(cursor), MakeResID(this->images[i].Id), g.lang, false, 0, 0, 0 };
+		qs[i] = q;
+	}
+	if (File::GetResourcesDirect(peData, peSize, &qs[0], n) < n) {
+		std::vector<size_t> missing;
+		std::vector<File::DirectQuery> qs2;
+		for (size_t i = 0; i < n; ++i) {
+			if (!qs[i].found) { missing.push_back(i); qs2.push_back(qs[i]); qs2.back().lang = File::ANY_LANG; }
+		}
+		File::GetResourcesDirect(peData, peSize, &qs2[0], qs2.size());
+		for (size_t i = 0; i < missing.size(); ++i) { qs[missing[i]] = qs2[i]; }
+	}
+	for (size_t i = 0; i < n; ++i) {
+		if (qs[i].found) { this->setData(this->images[i], d + qs[i].offset, qs[i].size); }
+	}
+	return true;
+}
+bool IconGroup::load(const Rsrc* r, const_resid name, uint16_t lang, bool cursor) {
+	this->images.clear();
+	this->cursor = cursor;
+	const ResourceType* groups = (*r)[GroupResType(cursor)];
+	if (!groups) { return false; }
+	if (name == File::ANY_NAME) {
+		std::vector<const_resid> names = groups->getNames();
+		if (names.empty()) { return false; }
+		name = names[0];
+	}
+	const ResourceName* group = (*groups)[name];
+	if (!group || (lang == File::ANY_LANG && !group->exists(&lang))) { return false; }
+	const ResourceLang* gl = (*group)[lang];
+	size_t size;
+	if (!gl || !this->parse((const_bytes)gl->getView(&size), size, cursor)) { this->images.clear(); return false; }
+
+	const ResourceType* imgs = (*r)[ImageResType(cursor)];
+	if (!imgs) { return true; }
+	for (size_t i = 0; i < this->images.size(); ++i) {
+		const ResourceName* n = (*imgs)[MakeResID(this->images[i].Id)];
+		if (!n) { continue; }
+		const ResourceLang* l = (*n)[lang];
+		uint16_t first;
+		if (!l && n->exists(&first)) { l = (*n)[first]; }
+		if (l) {
+			const_bytes data = (const_bytes)l->getView(&size);
+			this->setData(this->images[i], data, size);
+		}
+	}
+	return true;
+}
+bool IconGroup::isCursor() const { return this->cursor; }
+bool IconGroup::isComplete() const {
+	for (size_t i = 0; i < this->images.size(); ++i)
+		if (!this->images[i].Data) { return false; }
+	return true;
+}
+size_t IconGroup::count() const { return this->images.size(); }
+const IconGroup::Entry& IconGroup::operator[](size_t i) const { return this->images[i]; }
+size_t IconGroup::getFileSize() const {
+	size_t size = sizeof(IconDir);
+	for (size_t i = 0; i < this->images.size(); ++i)
+		if (this->images[i].Data) { size += sizeof(IconDirEntry) + this->images[i].Size; }
+	return size;
+}
+bool IconGroup::write(DataSink& sink) const {
+	// The directory is built first, then the images are written straight from where they are
+	std::vector<byte> hdr(sizeof(IconDir));
+	IconDir dir = { 0, ImageType(this->cursor), 0 };
+	uint32_t offset = sizeof(IconDir);
+	for (size_t i = 0; i < this->images.size(); ++i)
+		if (this->images[i].Data) { ++dir.Count; offset += sizeof(IconDirEntry); }
+	memcpy(&hdr[0], &dir, sizeof(IconDir));
+	for (size_t i = 0; i < this->images.size(); ++i) {
+		const Entry& img = this->images[i];
+		if (!img.Data) { continue; }
+		IconDirEntry e = { (uint8_t)img.Width, (uint8_t)img.Height, img.ColorCount, 0,
+			this->cursor ? img.HotspotX : img.Planes, this->cursor ? img.HotspotY : img.BitCount, (uint32_t)img.Size, offset };
+		hdr.insert(hdr.end(), (const_bytes)&e, (const_bytes)(&e+1));
+		offset += (uint32_t)img.Size;
+	}
+	if (!sink.write(&hdr[0], hdr.size())) { return false; }
+	for (size_t i = 0; i < this->images.size(); ++i)
+		if (this->images[i].Data && !sink.write(this->images[i].Data, this->images[i].Size)) { return false; }
+	return true;
+}
+bool IconGroup::save(const_str file) const {
+	FileDataSink sink(file);
+	return sink.isopen() && this->write(sink);
+}
+#pragma endregion
+
+#pragma region Replacing
+///////////////////////////////////////////////////////////////////////////////
+///// Replacing
+///////////////////////////////////////////////////////////////////////////////
+static void GetGroupIds(const ResourceLang* l, bool cursor, std::set<uint16_t>& ids) {
+	size_t size;
+	const_bytes data = (const_bytes)l->getView(&size);
+	IconDir dir;
+	if (size < sizeof(IconDir)) { return; }
+	memcpy(&dir, data, sizeof(IconDir));
+	if (dir.Type != ImageType(cursor)) { return; }
+	for (size_t i = 0; i < dir.Count && sizeof(IconDir) + (i+1) * sizeof(GroupIconDirEntry) <= size; ++i)
+		ids.insert(GetLE16(data + sizeof(IconDir) + (i+1) * sizeof(GroupIconDirEntry) - sizeof(uint16_t)));
+}
+bool PE::Icons::ReplaceIconGroup(Rsrc* r, const_resid name, uint16_t lang, const void* ico, size_t size, bool cursor) {
+	const_bytes d = (const_bytes)ico;
+	const const_resid groupType = GroupResType(cursor), imgType = ImageResType(cursor);
+
+	// Check the .ico or .cur file
+	IconDir dir;
+	if (size < sizeof(IconDir)) { return false; }
+	memcpy(&dir, d, sizeof(IconDir));
+	if (dir.Reserved != 0 || dir.Type != ImageType(cursor) || dir.Count == 0 || (size - sizeof(IconDir)) / sizeof(IconDirEntry) < dir.Count) { return false; }
+	std::vector<IconDirEntry> entries(dir.Count);
+	memcpy(&entries[0], d + sizeof(IconDir), dir.Count * sizeof(IconDirEntry));
+	for (uint16_t i = 0; i < dir.Count; ++i)
+		if (entries[i].ImageOffset > size || entries[i].BytesInRes > size - entries[i].ImageOffset) { return false; }
+
+	// Allocate the new IDs after the largest existing one
+	uint32_t next = 1;
+	std::vector<const_resid> names = r->getNames(imgType);
+	for (size_t i = 0; i < names.size(); ++i)
+		if (IsIntResID(names[i]) && ResID2Int(names[i]) >= next) { next = ResID2Int(names[i]) + 1; }
+	if (next + dir.Count > 0x10000) { return false; }
+
+	// Get the images the group currently uses
+	std::set<uint16_t> old;
+	const ResourceType* groups = (*r)[groupType];
+	const ResourceName* group = groups ? (*groups)[name] : NULL;
+	const ResourceLang* gl = group ? (*group)[lang] : NULL;
+	if (gl) { GetGroupIds(gl, cursor, old); }
+
+	// Build the group and the cursor images before changing anything
+	std::vector<byte> grp(sizeof(IconDir) + dir.Count * sizeof(GroupIconDirEntry));
+	std::vector<std::vector<byte> > curs(cursor ? dir.Count : 0);
+	memcpy(&grp[0], &dir, sizeof(IconDir));
+	for (uint16_t i = 0; i < dir.Count; ++i) {
+		const IconDirEntry& e = entries[i];
+		const_bytes img = d + e.ImageOffset;
+		uint16_t id = (uint16_t)(next + i), planes = cursor ? 1 : e.Planes, bitCount = cursor ? 0 : e.BitCount;
+		if (cursor || !planes || !bitCount) { GetImageFormat(img, e.BytesInRes, &planes, &bitCount); }
+		bytes ge = &grp[sizeof(IconDir) + i * sizeof(GroupIconDirEntry)];
+		if (cursor) {
+			GroupCursorDirEntry c = { (uint16_t)(e.Width ? e.Width : 256), (uint16_t)(2 * (e.Height ? e.Height : 256)), planes, bitCount, (uint32_t)(e.BytesInRes + 2*sizeof(uint16_t)), id };
+			memcpy(ge, &c, sizeof(c));
+			// Cursor resources start with the hotspot, which is in the planes and bit count of the .cur entry
+			std::vector<byte>& cur = curs[i];
+			cur.resize(2*sizeof(uint16_t) + e.BytesInRes);
+			memcpy(&cur[0], &e.Planes, sizeof(uint16_t));
+			memcpy(&cur[2], &e.BitCount, sizeof(uint16_t));
+			if (e.BytesInRes) { memcpy(&cur[4], img, e.BytesInRes); }
+		} else {
+			GroupIconDirEntry c = { e.Width, e.Height, e.ColorCount, 0, planes, bitCount, e.BytesInRes, id };
+			memcpy(ge, &c, sizeof(c));
+		}
+	}
+
+	// Add the images then the group, if any of it fails the images already added are removed so nothing changes
+	uint16_t added = 0;
+	for (; added < dir.Count; ++added) {
+		const_bytes img = cursor ? &curs[added][0] : d + entries[added].ImageOffset;
+		size_t imgSize = cursor ? curs[added].size() : entries[added].BytesInRes;
+		if (!r->add(imgType, MakeResID((uint16_t)(next + added)), lang, img, imgSize)) { break; }
+	}
+	if (added < dir.Count || !r->add(groupType, name, lang, &grp[0], grp.size())) {
+		for (uint16_t i = 0; i < added; ++i) { r->remove(imgType, MakeResID((uint16_t)(next + i)), lang); }
+		return false;
+	}
+
+	// Remove the old images that no other group uses
+	if (!old.empty()) {
+		std::set<uint16_t> used;
+		groups = (*r)[groupType];
+		std::vector<const_resid> gnames = groups->getNames();
+		for (size_t i = 0; i < gnames.size(); ++i) {
+			const ResourceName* n = (*groups)[gnames[i]];
+			std::vector<uint16_t> langs = n->getLangs();
+			for (size_t j = 0; j < langs.size(); ++j)
+				if (langs[j] != lang || ResCmp()(gnames[i], name) || ResCmp()(name, gnames[i])) { GetGroupIds((*n)[langs[j]], cursor, used); }
+		}
+		for (std::set<uint16_t>::const_iterator i = old.begin(); i != old.end(); ++i) {
+			if (used.find(*i) != used.end()) { continue; }
+			const ResourceType* imgs = (*r)[imgType];
+			const ResourceName* n = imgs ? (*imgs)[MakeResID(*i)] : NULL;
+			std::vector<uint16_t> langs = n ? n->getLangs() : std::vector<uint16_t>();
+			for (size_t j = 0; j < langs.size(); ++j) { r->remove(imgType, MakeResID(*i), langs[j]); } // in every language, only the ID is in the group
+		}
+	}
+	return true;
+}
+#pragma endregion
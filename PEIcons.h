@@ -0,0 +1,98 @@
+// pe-file: library for reading and manipulating pe-files
+// Copyright (C) 2012  Jeffrey Bush  jeff@coderforlife.com
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Implements resolving icon and cursor groups to their images, writing them as .ico and .cur files, and replacing them
+
+#ifndef PE_ICONS_H
+#define PE_ICONS_H
+
+#include "PEDataTypes.h"
+#include "PEDataSource.h"
+#include "PEFile.h"
+
+#include <vector>
+
+namespace PE { namespace Icons {
+	#include "pshpack2.h"
+	struct IconDir { // ICONDIR / GRPICONDIR
+		static const uint16_t ICON = 1, CURSOR = 2;
+		uint16_t Reserved, Type, Count;
+	};
+	struct IconDirEntry { // ICONDIRENTRY in .ico and .cur files
+		uint8_t Width, Height, ColorCount, Reserved; // 0 is 256 for width and height
+		uint16_t Planes, BitCount; // the hotspot in .cur files
+		uint32_t BytesInRes, ImageOffset;
+	};
+	struct GroupIconDirEntry { // GRPICONDIRENTRY in GROUP_ICON resources
+		uint8_t Width, Height, ColorCount, Reserved;
+		uint16_t Planes, BitCount;
+		uint32_t BytesInRes;
+		uint16_t Id;
+	};
+	struct GroupCursorDirEntry { // CURSORDIR + the rest of a GRPICONDIRENTRY in GROUP_CURSOR resources
+		uint16_t Width, Height; // the height includes the mask so it is doubled
+		uint16_t Planes, BitCount;
+		uint32_t BytesInRes;
+		uint16_t Id;
+	};
+	#include "poppack.h"
+
+	// An icon or cursor group resolved to the ICON or CURSOR resources it refers to
+	// The image data points directly into the data the group was resolved from, nothing is copied
+	class IconGroup {
+	public:
+		struct Entry {
+			uint16_t Id;
+			uint16_t Width, Height; // in pixels
+			uint8_t ColorCount;
+			uint16_t Planes, BitCount;
+			uint16_t HotspotX, HotspotY; // only for cursors
+			const_bytes Data; // NULL if the resource is missing, for cursors this is after the hotspot
+			size_t Size;
+		};
+	private:
+		bool cursor;
+		std::vector<Entry> images;
+
+		bool parse(const_bytes group, size_t size, bool cursor);
+		void setData(Entry& img, const_bytes data, size_t size);
+	public:
+		IconGroup();
+
+		// Resolves a group in the raw data of a PE file, all of the images are found in a single walk (see File::GetResourcesDirect)
+		// The name can be File::ANY_NAME and the lang can be File::ANY_LANG
+		bool load(const void* peData, size_t peSize, const_resid name, uint16_t lang = File::ANY_LANG, bool cursor = false);
+		// Resolves a group in resources being edited, the data is valid until the resources are changed
+		bool load(const Rsrc* r, const_resid name, uint16_t lang, bool cursor = false);
+
+		bool isCursor() const;
+		bool isComplete() const; // all of the images were found
+		size_t count() const;
+		const Entry& operator[](size_t i) const;
+
+		size_t getFileSize() const; // of the .ico or .cur file, missing images are skipped
+		bool write(DataSink& sink) const; // writes the .ico or .cur file
+		bool save(const_str file) const;
+	};
+
+	// Replaces an icon group with the images in an .ico file (or a cursor group with a .cur file) in a single edit of the
+	// resources. The images are added with new IDs after the largest existing one and the old images of the group are
+	// removed (in every language) unless another group also uses them. The group is created if it does not exist. If
+	// anything fails the resources are left as they were.
+	bool ReplaceIconGroup(Rsrc* r, const_resid name, uint16_t lang, const void* ico, size_t size, bool cursor = false);
+} }
+
+#endif
@@ -0,0 +1,85 @@
+// pe-file: library for reading and manipulating pe-files
+// Copyright (C) 2012  Jeffrey Bush  jeff@coderforlife.com
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Implements views of the image headers that are specialized at compile time for 32-bit (PE32) or 64-bit (PE32+)
+// images so that code walking the image is compiled once per bitness instead of testing the bitness for every entry
+
+#ifndef PE_IMAGE_VIEW_H
+#define PE_IMAGE_VIEW_H
+
+#include "PEDataTypes.h"
+
+namespace PE {
+
+	// The bitness traits, all offsets are from the start of the NT headers
+	struct PE32 {
+		typedef Image::NTHeaders32 NTHeaders;
+		typedef Image::OptionalHeader32 OptionalHeader;
+		typedef uint32_t Thunk; // IMAGE_THUNK_DATA32
+		static const uint16_t MAGIC = Image::OptionalHeader32::SIGNATURE;
+		static const Thunk ORDINAL_FLAG = 0x80000000u; // IMAGE_ORDINAL_FLAG32
+		static const uint16_t RELOC_TYPE = Image::BaseRelocation::HIGHLOW;
+		static const size_t OPTIONAL_HEADER_OFFSET = sizeof(uint32_t) + sizeof(Image::FileHeader);
+		static const size_t DATA_DIRECTORY_OFFSET = OPTIONAL_HEADER_OFFSET + sizeof(Image::OptionalHeader) + 6*sizeof(uint32_t);
+		inline static uint64_t ImageBase(const Image::OptionalHeader* opt) { return opt->ImageBase32; }
+	};
+	struct PE32Plus {
+		typedef Image::NTHeaders64 NTHeaders;
+		typedef Image::OptionalHeader64 OptionalHeader;
+		typedef uint64_t Thunk; // IMAGE_THUNK_DATA64
+		static const uint16_t MAGIC = Image::OptionalHeader64::SIGNATURE;
+		static const Thunk ORDINAL_FLAG = 0x8000000000000000ull; // IMAGE_ORDINAL_FLAG64
+		static const uint16_t RELOC_TYPE = Image::BaseRelocation::DIR64;
+		static const size_t OPTIONAL_HEADER_OFFSET = sizeof(uint32_t) + sizeof(Image::FileHeader);
+		static const size_t DATA_DIRECTORY_OFFSET = OPTIONAL_HEADER_OFFSET + sizeof(Image::OptionalHeader) + 4*sizeof(uint64_t) + 2*sizeof(uint32_t);
+		inline static uint64_t ImageBase(const Image::OptionalHeader* opt) { return opt->ImageBase64; }
+	};
+
+	// A view of a mapped image of a known bitness, the data must not be resized while the view is in use
+	// A const view only gives const pointers into the image
+	template<typename T> class ImageView {
+		bytes d;
+		size_t peOffset;
+	public:
+		typedef T Traits;
+		typedef typename T::NTHeaders NTHeaders;
+		typedef typename T::OptionalHeader OptionalHeader;
+		typedef typename T::Thunk Thunk;
+
+		inline ImageView(bytes data, size_t peOffset) : d(data), peOffset(peOffset) { }
+
+		inline bytes data() { return this->d; }
+		inline const_bytes data() const { return this->d; }
+		inline NTHeaders* nt() { return (NTHeaders*)(this->d + this->peOffset); }
+		inline const NTHeaders* nt() const { return (const NTHeaders*)(this->d + this->peOffset); }
+		inline Image::FileHeader* header() { return &this->nt()->FileHeader; }
+		inline const Image::FileHeader* header() const { return &this->nt()->FileHeader; }
+		inline OptionalHeader* opt() { return &this->nt()->OptionalHeader; }
+		inline const OptionalHeader* opt() const { return &this->nt()->OptionalHeader; }
+		inline uint64_t imageBase() const { return T::ImageBase(this->opt()); }
+		inline uint32_t dataDirectoryCount() const { return this->opt()->NumberOfRvaAndSizes; }
+		inline Image::DataDirectory* dataDirectory() { return (Image::DataDirectory*)(this->d + this->peOffset + T::DATA_DIRECTORY_OFFSET); }
+		inline const Image::DataDirectory* dataDirectory() const { return (const Image::DataDirectory*)(this->d + this->peOffset + T::DATA_DIRECTORY_OFFSET); }
+		inline uint16_t sectionCount() const { return this->header()->NumberOfSections; }
+		inline Image::SectionHeader* sections() { return (Image::SectionHeader*)(this->d + this->peOffset + T::OPTIONAL_HEADER_OFFSET + this->header()->SizeOfOptionalHeader); }
+		inline const Image::SectionHeader* sections() const { return (const Image::SectionHeader*)(this->d + this->peOffset + T::OPTIONAL_HEADER_OFFSET + this->header()->SizeOfOptionalHeader); }
+
+		inline static bool IsOrdinal(Thunk t) { return (t & T::ORDINAL_FLAG) != 0; }
+		inline static uint16_t Ordinal(Thunk t) { return (uint16_t)(t & 0xFFFF); }
+	};
+}
+
+#endif
@@ -0,0 +1,141 @@
+// pe-file: library for reading and manipulating pe-files
+// Copyright (C) 2012  Jeffrey Bush  jeff@coderforlife.com
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef __cplusplus_cli
+#pragma unmanaged
+#endif
+
+#include "PEMessageTable.h"
+
+#include <string.h>
+#include <algorithm>
+
+using namespace PE;
+
+MessageTable::MessageTable() : data(NULL) { }
+bool MessageTable::load(const void* data, size_t size) {
+	const_bytes d = (const_bytes)data;
+	this->data = NULL;
+	this->ranges.clear();
+	this->entries.clear();
+	uint32_t nBlocks;
+	if (!d || size < sizeof(uint32_t)) { return false; }
+	memcpy(&nBlocks, d, sizeof(uint32_t));
+	if ((size - sizeof(uint32_t)) / sizeof(MessageResourceBlock) < nBlocks) { return false; }
+
+	// Index every entry of every block, the entries of a block are one after another
+	this->ranges.reserve(nBlocks);
+	for (uint32_t b = 0; b < nBlocks; ++b) {
+		MessageResourceBlock block;
+		memcpy(&block, d + sizeof(uint32_t) + b * sizeof(MessageResourceBlock), sizeof(MessageResourceBlock));
+		if (block.HighId < block.LowId || block.HighId - block.LowId >= size) { continue; } // there cannot be more entries than bytes
+		Range r = { block.LowId, block.HighId, this->entries.size() };
+		size_t pos = block.OffsetToEntries;
+		for (uint32_t id = block.LowId; ; ++id) {
+			MessageResourceEntry e;
+			if (pos <= size && size - pos >= sizeof(MessageResourceEntry)) { memcpy(&e, d + pos, sizeof(MessageResourceEntry)); } else { e.Length = 0; }
+			if (e.Length < sizeof(MessageResourceEntry) || e.Length > size - pos) { // the rest of the block is invalid
+				this->entries.resize(this->entries.size() + (block.HighId - id) + 1, (uint32_t)NONE);
+				break;
+			}
+			this->entries.push_back((uint32_t)pos);
+			pos += e.Length;
+			if (id == block.HighId) { break; }
+		}
+		this->ranges.push_back(r);
+	}
+	std::sort(this->ranges.begin(), this->ranges.end());
+	this->data = d;
+	return true;
+}
+bool MessageTable::load(const void* peData, size_t peSize, const_resid name, uint16_t lang) {
+	File::DirectQuery q = { ResType::MESSAGETABLE, name, lang, false, 0, 0, 0 };
+	if (!File::GetResourcesDirect(peData, peSize, &q, 1)) { this->load(NULL, 0); return false; }
+	return this->load((const_bytes)peData + q.offset, q.size);
+}
+bool MessageTable::load(const Rsrc* r, const_resid name, uint16_t lang) {
+	const ResourceType* t = (*r)[ResType::MESSAGETABLE];
+	if (t && name == File::ANY_NAME) {
+		std::vector<const_resid> names = t->getNames();
+		name = names.empty() ? NULL : names[0];
+	}
+	const ResourceName* n = (t && name) ? (*t)[name] : NULL;
+	if (!n || (lang == File::ANY_LANG && !n->exists(&lang))) { this->load(NULL, 0); return false; }
+	const ResourceLang* l = (*n)[lang];
+	size_t size = 0;
+	const void* data = l ? l->getView(&size) : NULL;
+	return this->load(data, size);
+}
+bool MessageTable::isLoaded() const { return this->data != NULL; }
+size_t MessageTable::count() const { return this->entries.size(); }
+
+bool MessageTable::getEntry(uint32_t id, size_t i, Message* m) const {
+	if (this->entries[i] == NONE) { return false; }
+	const_bytes e = this->data + this->entries[i];
+	MessageResourceEntry hdr;
+	memcpy(&hdr, e, sizeof(MessageResourceEntry));
+	const_bytes text = e + sizeof(MessageResourceEntry);
+	size_t size = hdr.Length - sizeof(MessageResourceEntry);
+	m->Id = id;
+	m->IsUnicode = (hdr.Flags & MessageResourceEntry::UNICODE_TEXT) != 0;
+	if (m->IsUnicode) {
+		const uint16_t* s = (const uint16_t*)text;
+		size_t len = size / sizeof(uint16_t);
+		while (len && s[len-1] == 0) { --len; } // the null terminator and padding
+		m->Ansi = NULL;
+		m->Unicode = utf16_view(s, len);
+		m->Length = len;
+	} else {
+		const char* s = (const char*)text;
+		size_t len = size;
+		while (len && s[len-1] == 0) { --len; }
+		m->Ansi = s;
+		m->Unicode = utf16_view();
+		m->Length = len;
+	}
+	return true;
+}
+bool MessageTable::find(uint32_t id, Message* m) const {
+	Range key = { id, id, 0 };
+	std::vector<Range>::const_iterator r = std::upper_bound(this->ranges.begin(), this->ranges.end(), key);
+	if (r == this->ranges.begin()) { return false; }
+	--r;
+	return id <= r->high && this->getEntry(id, r->first + (id - r->low), m);
+}
+bool MessageTable::get(size_t i, Message* m) const {
+	// The ranges are sorted by ID but the entries are in the order of the blocks in the data
+	for (size_t r = 0; r < this->ranges.size(); ++r) {
+		size_t n = (size_t)(this->ranges[r].high - this->ranges[r].low) + 1;
+		if (i < n) { return this->getEntry(this->ranges[r].low + (uint32_t)i, this->ranges[r].first + i, m); }
+		i -= n;
+	}
+	return false;
+}
+size_t MessageTable::visit(MessageVisitor f, void* param) const {
+	size_t n = 0;
+	Message m;
+	for (size_t r = 0; r < this->ranges.size(); ++r) {
+		const Range& range = this->ranges[r];
+		for (uint32_t id = range.low; ; ++id) {
+			if (this->getEntry(id, range.first + (id - range.low), &m)) {
+				++n;
+				if (!f(m, param)) { return n; }
+			}
+			if (id == range.high) { break; }
+		}
+	}
+	return n;
+}
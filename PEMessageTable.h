@@ -0,0 +1,83 @@
+// pe-file: library for reading and manipulating pe-files
+// Copyright (C) 2012  Jeffrey Bush  jeff@coderforlife.com
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Implements indexed access to the message tables (MESSAGETABLE resources) of PE files
+
+#ifndef PE_MESSAGE_TABLE_H
+#define PE_MESSAGE_TABLE_H
+
+#include "PEDataTypes.h"
+#include "PEFile.h"
+
+#include <vector>
+
+namespace PE {
+	#include "pshpack2.h"
+	struct MessageResourceBlock { // MESSAGE_RESOURCE_BLOCK
+		uint32_t LowId, HighId;
+		uint32_t OffsetToEntries;
+	};
+	struct MessageResourceEntry { // MESSAGE_RESOURCE_ENTRY, followed by the text
+		static const uint16_t UNICODE_TEXT = 0x0001;
+		uint16_t Length; // including this header
+		uint16_t Flags;
+	};
+	#include "poppack.h"
+
+	// A message table, the ranges of the blocks are parsed once and every entry is indexed so that looking up a message
+	// is a binary search of the ranges. The messages point directly into the data they were loaded from.
+	class MessageTable {
+	public:
+		struct Message {
+			uint32_t Id;
+			bool IsUnicode;
+			const char* Ansi;	// when not IsUnicode, in the code page of the resource
+			utf16_view Unicode;	// when IsUnicode
+			size_t Length;		// in characters, without the null terminator or padding
+		};
+		typedef bool (*MessageVisitor)(const Message& m, void* param); // return false to stop
+	private:
+		struct Range {
+			uint32_t low, high;
+			size_t first; // index into entries
+			inline bool operator <(const Range& b) const { return this->low < b.low; }
+		};
+		const_bytes data;
+		std::vector<Range> ranges;
+		std::vector<uint32_t> entries; // offsets of every entry or NONE if it is invalid
+		static const uint32_t NONE = 0xFFFFFFFF;
+
+		bool getEntry(uint32_t id, size_t i, Message* m) const;
+	public:
+		MessageTable();
+
+		// Parses the message table resource data, which must stay around as long as the table is used
+		bool load(const void* data, size_t size);
+		// Loads the message table from the raw data of a PE file, the name can be File::ANY_NAME and lang can be File::ANY_LANG
+		bool load(const void* peData, size_t peSize, const_resid name, uint16_t lang = File::ANY_LANG);
+		// Loads the message table from resources being edited, the messages are valid until the resources are changed
+		bool load(const Rsrc* r, const_resid name, uint16_t lang);
+
+		bool isLoaded() const;
+		size_t count() const; // number of message IDs covered, including invalid entries
+
+		bool find(uint32_t id, Message* m) const;
+		bool get(size_t i, Message* m) const; // the i-th message in order of ID, for iterating over all of them
+		size_t visit(MessageVisitor f, void* param) const; // calls f for every valid message in order of ID, returns the number visited
+	};
+}
+
+#endif
@@ -0,0 +1,335 @@
+// pe-file: library for reading and manipulating pe-files
+// Copyright (C) 2012  Jeffrey Bush  jeff@coderforlife.com
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef __cplusplus_cli
+#pragma unmanaged
+#endif
+
+#include "PEResourceIndex.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#ifdef USE_WINDOWS_API
+#ifdef ARRAYSIZE
+#undef ARRAYSIZE
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace PE;
+using namespace PE::Internal;
+using namespace std;
+
+#pragma region Index Format
+///////////////////////////////////////////////////////////////////////////////
+///// Index Format
+///////////////////////////////////////////////////////////////////////////////
+// The file is a header, the entries sorted by (type, name, lang), then the string pool
+// A type or name with the high bit set is an offset into the string pool of a length-prefixed UTF-16 string
+// Strings sort before integer ids like in the resource directory, strings are ordered by code unit then length
+static const char INDEX_MAGIC[8] = { 'P', 'E', 'R', 'S', 'R', 'C', 'I', 'X' };
+static const uint32_t INDEX_VERSION = 2; // version 1 put integer ids first
+static const uint32_t INDEX_STRING = 0x80000000;
+struct IndexHeader {
+	char magic[8];
+	uint32_t version, count;
+	uint64_t device, inode, size, mtime;
+	uint32_t stringsOffset, stringsSize;
+};
+struct IndexEntry {
+	uint32_t type, name, lang;
+	uint32_t offset, size, codepage;
+};
+
+// A type or name being compared, which may be a wildcard that sorts before everything
+struct IndexId {
+	bool any, isStr;
+	uint16_t id;
+	utf16_view str;
+};
+static int CompareIds(const IndexId& a, const IndexId& b) {
+	if (a.any || b.any)		{ return (a.any ? 0 : 1) - (b.any ? 0 : 1); }
+	if (a.isStr != b.isStr)	{ return a.isStr ? -1 : 1; }
+	if (!a.isStr)			{ return (int)a.id - (int)b.id; }
+	size_t len = (a.str.length < b.str.length) ? a.str.length : b.str.length;
+	for (size_t i = 0; i < len; ++i)
+		if (a.str[i] != b.str[i]) { return (int)a.str[i] - (int)b.str[i]; }
+	return (a.str.length == b.str.length) ? 0 : ((a.str.length < b.str.length) ? -1 : 1);
+}
+static IndexId DecodeId(uint32_t v, const_bytes strings, size_t stringsSize) {
+	IndexId x = { false, (v & INDEX_STRING) != 0, 0, utf16_view() };
+	if (!x.isStr) { x.id = (uint16_t)v; return x; }
+	size_t off = v & ~INDEX_STRING;
+	if (off <= stringsSize && stringsSize - off >= sizeof(uint16_t)) {
+		const uint16_t* s = (const uint16_t*)(strings + off);
+		if ((stringsSize - off - sizeof(uint16_t)) / sizeof(uint16_t) >= s[0]) { x.str = utf16_view(s+1, s[0]); }
+	}
+	return x;
+}
+#pragma endregion
+
+#pragma region File Identity
+///////////////////////////////////////////////////////////////////////////////
+///// File Identity
+///////////////////////////////////////////////////////////////////////////////
+#ifndef USE_WINDOWS_API
+static bool ToNarrowPath(const_str path, vector<char>& out) {
+	size_t len = wcstombs(NULL, path, 0);
+	if (len == (size_t)-1) { return false; }
+	out.resize(len + 1);
+	wcstombs(&out[0], path, len + 1);
+	return true;
+}
+#endif
+bool ResourceIndex::GetFileKey(const_str file, FileKey* key) {
+#ifdef USE_WINDOWS_API
+	HANDLE f = CreateFile(file, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+	if (f == INVALID_HANDLE_VALUE) { return false; }
+	BY_HANDLE_FILE_INFORMATION info;
+	bool retval = GetFileInformationByHandle(f, &info) != 0;
+	CloseHandle(f);
+	if (!retval) { return false; }
+	key->device = info.dwVolumeSerialNumber;
+	key->inode = (((uint64_t)info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+	key->size = (((uint64_t)info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+	key->mtime = (((uint64_t)info.ftLastWriteTime.dwHighDateTime) << 32) | info.ftLastWriteTime.dwLowDateTime;
+#else
+	vector<char> path;
+	struct stat sb;
+	if (!ToNarrowPath(file, path) || stat(&path[0], &sb) == -1) { return false; }
+	key->device = (uint64_t)sb.st_dev;
+	key->inode = (uint64_t)sb.st_ino;
+	key->size = (uint64_t)sb.st_size;
+#if defined(__APPLE__)
+	key->mtime = (uint64_t)sb.st_mtimespec.tv_sec * 1000000000 + sb.st_mtimespec.tv_nsec;
+#else
+	key->mtime = (uint64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+#endif
+#endif
+	return true;
+}
+#pragma endregion
+
+#pragma region Building
+///////////////////////////////////////////////////////////////////////////////
+///// Building
+///////////////////////////////////////////////////////////////////////////////
+struct IndexBuilder {
+	vector<IndexEntry> entries;
+	vector<uint16_t> strings;
+	uint32_t add(const File::DirectName& n) {
+		if (n.str.empty()) { return n.id; }
+		uint32_t off = (uint32_t)(this->strings.size() * sizeof(uint16_t));
+		this->strings.push_back((uint16_t)n.str.length);
+		this->strings.insert(this->strings.end(), n.str.data, n.str.data + n.str.length);
+		return off | INDEX_STRING;
+	}
+};
+struct IndexEntryLess {
+	const_bytes strings;
+	size_t stringsSize;
+	bool operator()(const IndexEntry& a, const IndexEntry& b) const {
+		int c = CompareIds(DecodeId(a.type, this->strings, this->stringsSize), DecodeId(b.type, this->strings, this->stringsSize));
+		if (c == 0) { c = CompareIds(DecodeId(a.name, this->strings, this->stringsSize), DecodeId(b.name, this->strings, this->stringsSize)); }
+		return (c == 0) ? a.lang < b.lang : c < 0;
+	}
+};
+static bool AddIndexEntry(const File::DirectName& type, const File::DirectName& name, const File::DirectQuery& res, void* param) {
+	IndexBuilder* b = (IndexBuilder*)param;
+	IndexEntry e;
+	e.type = b->add(type);
+	e.name = b->add(name);
+	e.lang = res.lang;
+	e.offset = res.offset;
+	e.size = res.size;
+	e.codepage = res.codepage;
+	b->entries.push_back(e);
+	return true;
+}
+static bool WriteAll(
+#ifdef USE_WINDOWS_API
+	HANDLE f,
+#else
+	int f,
+#endif
+	const void* data, size_t size) {
+	const_bytes d = (const_bytes)data;
+	while (size) {
+#ifdef USE_WINDOWS_API
+		DWORD w = 0;
+		if (!WriteFile(f, d, (DWORD)((size > 0x40000000) ? 0x40000000 : size), &w, NULL)) { return false; }
+#else
+		ssize_t w = write(f, d, size);
+		if (w < 0) { if (errno == EINTR) { continue; } return false; }
+#endif
+		d += w;
+		size -= w;
+	}
+	return true;
+}
+bool ResourceIndex::Build(const_str peFile, const_str indexFile) {
+	FileKey key, key2;
+	if (!GetFileKey(peFile, &key)) { return false; }
+
+	// Collect and sort the resources
+	IndexBuilder b;
+	DataSource pe(new MemoryMappedDataSource(peFile, true));
+	if (!pe.isopen()) { pe.close(); return false; }
+	{
+		PinnedView pin(pe);
+		File::EnumerateResourcesDirect(pin.data(), pin.size(), AddIndexEntry, &b);
+	}
+	pe.close();
+	if (!GetFileKey(peFile, &key2) || !(key == key2)) { return false; } // changed while reading
+	IndexEntryLess less = { b.strings.empty() ? NULL : (const_bytes)&b.strings[0], b.strings.size() * sizeof(uint16_t) };
+	sort(b.entries.begin(), b.entries.end(), less);
+
+	IndexHeader h;
+	memcpy(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	h.version = INDEX_VERSION;
+	h.count = (uint32_t)b.entries.size();
+	h.device = key.device; h.inode = key.inode; h.size = key.size; h.mtime = key.mtime;
+	h.stringsOffset = (uint32_t)(sizeof(IndexHeader) + b.entries.size() * sizeof(IndexEntry));
+	h.stringsSize = (uint32_t)(b.strings.size() * sizeof(uint16_t));
+
+	// Write to a temporary file then move it into place so readers in other processes never see a partial index
+	bool ok;
+#ifdef USE_WINDOWS_API
+	wchar_t tmp[LARGE_PATH];
+	_snwprintf(tmp, LARGE_PATH, L"%s.%lu.tmp", indexFile, (unsigned long)GetCurrentProcessId());
+	tmp[LARGE_PATH-1] = 0;
+	HANDLE f = CreateFile(tmp, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (f == INVALID_HANDLE_VALUE) { return false; }
+	ok = WriteAll(f, &h, sizeof(h)) &&
+		(b.entries.empty() || WriteAll(f, &b.entries[0], b.entries.size() * sizeof(IndexEntry))) &&
+		(b.strings.empty() || WriteAll(f, &b.strings[0], h.stringsSize));
+	CloseHandle(f);
+	ok = ok && MoveFileEx(tmp, indexFile, MOVEFILE_REPLACE_EXISTING) != 0;
+	if (!ok) { DeleteFile(tmp); }
+#else
+	vector<char> path;
+	if (!ToNarrowPath(indexFile, path)) { return false; }
+	char pid[32];
+	snprintf(pid, sizeof(pid), ".%ld.tmp", (long)getpid());
+	string tmp = string(&path[0]) + pid;
+	int f = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (f == -1) { return false; }
+	ok = WriteAll(f, &h, sizeof(h)) &&
+		(b.entries.empty() || WriteAll(f, &b.entries[0], b.entries.size() * sizeof(IndexEntry))) &&
+		(b.strings.empty() || WriteAll(f, &b.strings[0], h.stringsSize));
+	ok = (::close(f) == 0) && ok;
+	ok = ok && rename(tmp.c_str(), &path[0]) == 0;
+	if (!ok) { unlink(tmp.c_str()); }
+#endif
+	return ok;
+}
+#pragma endregion
+
+#pragma region Opening and Lookups
+///////////////////////////////////////////////////////////////////////////////
+///// Opening and Lookups
+///////////////////////////////////////////////////////////////////////////////
+ResourceIndex::ResourceIndex(const_str peFile, const_str indexFile, bool build) : data(NULL), n(0), entries(NULL), strings(NULL), stringsSize(0) {
+	FileKey key;
+	if (!GetFileKey(peFile, &key)) { return; }
+	if (!this->open(indexFile, key) && build && Build(peFile, indexFile)) { this->open(indexFile, key); }
+}
+ResourceIndex::~ResourceIndex() { this->data.close(); }
+bool ResourceIndex::open(const_str indexFile, const FileKey& key) {
+	this->data.close();
+	this->data = DataSource(new MemoryMappedDataSource(indexFile, true));
+	if (!this->data.isopen()) { this->data.close(); return false; }
+
+	// Check the header against the PE file and the size of the index
+	const_bytes d = (const_bytes)(this->data + 0);
+	const IndexHeader* h = (const IndexHeader*)d;
+	size_t size = this->data.size();
+	if (size < sizeof(IndexHeader) || memcmp(h->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || h->version != INDEX_VERSION ||
+		h->device != key.device || h->inode != key.inode || h->size != key.size || h->mtime != key.mtime ||
+		(size - sizeof(IndexHeader)) / sizeof(IndexEntry) < h->count ||
+		h->stringsOffset != sizeof(IndexHeader) + h->count * sizeof(IndexEntry) || size - h->stringsOffset < h->stringsSize) { this->data.close(); return false; }
+
+	// The index is mapped read-only and never resized so plain pointers into it stay valid
+	this->n = h->count;
+	this->entries = h + 1;
+	this->strings = d + h->stringsOffset;
+	this->stringsSize = h->stringsSize;
+	return true;
+}
+bool ResourceIndex::isValid() const { return this->data.isopen(); }
+size_t ResourceIndex::count() const { return this->n; }
+
+static IndexId QueryId(const_resid r, vector<uint16_t>& buf) {
+	IndexId x = { r == File::ANY_NAME, !IsIntResID(r), 0, utf16_view() };
+	if (x.any) { return x; }
+	if (!x.isStr) { x.id = ResID2Int(r); return x; }
+	buf.clear();
+	for (; *r; ++r) {
+		uint32_t c = (uint32_t)*r;
+		if (c >= 0x10000) { c -= 0x10000; buf.push_back((uint16_t)(0xD800 + (c >> 10))); buf.push_back((uint16_t)(0xDC00 + (c & 0x3FF))); }
+		else { buf.push_back((uint16_t)c); }
+	}
+	x.str = buf.empty() ? utf16_view() : utf16_view(&buf[0], buf.size());
+	return x;
+}
+bool ResourceIndex::find(File::DirectQuery& q) const {
+	q.found = false; q.offset = 0; q.size = 0; q.codepage = 0;
+	if (!this->entries) { return false; }
+	vector<uint16_t> tbuf, nbuf;
+	IndexId type = QueryId(q.type, tbuf), name = QueryId(q.name, nbuf);
+	if (type.any) { return false; } // only names can be any
+
+	// Binary search for the first entry that is not before (type, name), wildcards sort first
+	const IndexEntry* e = (const IndexEntry*)this->entries;
+	size_t lo = 0, hi = this->n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int c = CompareIds(DecodeId(e[mid].type, this->strings, this->stringsSize), type);
+		if (c == 0) { c = CompareIds(DecodeId(e[mid].name, this->strings, this->stringsSize), name); }
+		if (c < 0) { lo = mid + 1; } else { hi = mid; }
+	}
+
+	// Scan the matching entries for the language
+	for (; lo < this->n; ++lo) {
+		if (CompareIds(DecodeId(e[lo].type, this->strings, this->stringsSize), type) != 0 ||
+			(!name.any && CompareIds(DecodeId(e[lo].name, this->strings, this->stringsSize), name) != 0)) { break; }
+		if (q.lang == File::ANY_LANG || e[lo].lang == q.lang) {
+			q.found = true;
+			q.lang = (uint16_t)e[lo].lang;
+			q.offset = e[lo].offset;
+			q.size = e[lo].size;
+			q.codepage = e[lo].codepage;
+			return true;
+		}
+	}
+	return false;
+}
+size_t ResourceIndex::find(File::DirectQuery* queries, size_t count) const {
+	size_t found = 0;
+	for (size_t i = 0; i < count; ++i)
+		if (this->find(queries[i])) { ++found; }
+	return found;
+}
+#pragma endregion
@@ -0,0 +1,65 @@
+// pe-file: library for reading and manipulating pe-files
+// Copyright (C) 2012  Jeffrey Bush  jeff@coderforlife.com
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Implements a persistent index of the resources in a PE file
+
+#ifndef PE_RESOURCE_INDEX_H
+#define PE_RESOURCE_INDEX_H
+
+#include "PEDataTypes.h"
+#include "PEDataSource.h"
+#include "PEFile.h"
+
+namespace PE {
+	// A sorted (type, name, lang) -> (offset, size, codepage) table of the resources of a PE file, kept in a sidecar file
+	// so that later opens, from any process, answer lookups by mapping the index instead of walking the resource directory.
+	// The index records the identity of the PE file (device, inode, size, and modification time) and is stale once that
+	// changes. The offsets are file offsets in the PE file.
+	class ResourceIndex {
+	public:
+		struct FileKey {
+			uint64_t device, inode, size, mtime;
+			inline bool operator ==(const FileKey& b) const { return this->device == b.device && this->inode == b.inode && this->size == b.size && this->mtime == b.mtime; }
+		};
+		static bool GetFileKey(const_str file, FileKey* key);
+
+		static bool Build(const_str peFile, const_str indexFile); // (re)writes the index atomically
+
+	private:
+		DataSource data;
+		size_t n;
+		const void* entries;
+		const_bytes strings;
+		size_t stringsSize;
+
+		ResourceIndex(const ResourceIndex&);
+		ResourceIndex& operator =(const ResourceIndex&);
+		bool open(const_str indexFile, const FileKey& key);
+	public:
+		ResourceIndex(const_str peFile, const_str indexFile, bool build = true); // a missing or stale index is rebuilt if build is true
+		~ResourceIndex();
+
+		bool isValid() const;
+		size_t count() const;
+
+		// Same as File::GetResourcesDirect (including ANY_NAME and ANY_LANG) but answered from the index, which is in the order
+		// of a well-formed resource directory (named entries first, each level sorted)
+		bool find(File::DirectQuery& q) const;
+		size_t find(File::DirectQuery* queries, size_t count) const; // returns the number found
+	};
+}
+
+#endif
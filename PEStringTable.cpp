@@ -0,0 +1,183 @@
+// pe-file: library for reading and manipulating pe-files
+// Copyright (C) 2012  Jeffrey Bush  jeff@coderforlife.com
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef __cplusplus_cli
+#pragma unmanaged
+#endif
+
+#include "PEStringTable.h"
+
+#include <string.h>
+#include <map>
+
+using namespace PE;
+
+// Decodes the (up to) 16 strings of a block, a truncated block leaves the rest of the strings empty
+static void DecodeBlock(const_bytes data, size_t size, utf16_view* strings) {
+	size_t pos = 0;
+	for (size_t i = 0; i < StringTable::STRINGS_PER_BLOCK; ++i) {
+		if (size - pos < sizeof(uint16_t)) { break; }
+		uint16_t len;
+		memcpy(&len, data+pos, sizeof(uint16_t));
+		pos += sizeof(uint16_t);
+		if ((size - pos) / sizeof(uint16_t) < len) { break; }
+		strings[i] = utf16_view((const uint16_t*)(data+pos), len);
+		pos += len * sizeof(uint16_t);
+	}
+}
+
+#pragma region Loading
+///////////////////////////////////////////////////////////////////////////////
+///// Loading
+///////////////////////////////////////////////////////////////////////////////
+StringTable::StringTable() : lang(0), blocks(BLOCK_COUNT, (uint32_t)NONE) { }
+void StringTable::addBlock(uint16_t name, const_bytes data, size_t size) {
+	if (name == 0 || name > BLOCK_COUNT || this->blocks[name-1] != NONE) { return; }
+	uint32_t b = (uint32_t)this->strings.size();
+	this->strings.resize(b + STRINGS_PER_BLOCK);
+	DecodeBlock(data, size, &this->strings[b]);
+	this->blocks[name-1] = b;
+}
+
+struct DirectLoad {
+	const_bytes data;
+	std::vector<StringTable>* tables;
+	bool all;
+};
+bool StringTable::AddDirect(const File::DirectName& type, const File::DirectName& name, const File::DirectQuery& res, void* param) {
+	if (!type.str.empty() || type.id != ResID2Int(ResType::STRING) || !name.str.empty()) { return true; }
+	DirectLoad* d = (DirectLoad*)param;
+	std::vector<StringTable>& tables = *d->tables;
+	size_t i = 0;
+	while (i < tables.size() && tables[i].lang != res.lang) { ++i; }
+	if (i == tables.size()) {
+		if (!d->all) { return true; }
+		tables.push_back(StringTable());
+		tables[i].lang = res.lang;
+	}
+	tables[i].addBlock(name.id, d->data + res.offset, res.size);
+	return true;
+}
+bool StringTable::load(const void* peData, size_t peSize, uint16_t lang) {
+	std::vector<StringTable> tables(1);
+	tables[0].lang = lang;
+	DirectLoad d = { (const_bytes)peData, &tables, false };
+	File::EnumerateResourcesDirect(peData, peSize, &StringTable::AddDirect, &d);
+	this->lang = lang;
+	this->blocks.swap(tables[0].blocks);
+	this->strings.swap(tables[0].strings);
+	return !this->strings.empty();
+}
+size_t StringTable::LoadAll(const void* peData, size_t peSize, std::vector<StringTable>& tables) {
+	tables.clear();
+	DirectLoad d = { (const_bytes)peData, &tables, true };
+	File::EnumerateResourcesDirect(peData, peSize, &StringTable::AddDirect, &d);
+	return tables.size();
+}
+bool StringTable::load(const Rsrc* r, uint16_t lang) {
+	this->lang = lang;
+	this->blocks.assign(BLOCK_COUNT, (uint32_t)NONE);
+	this->strings.clear();
+	const ResourceType* t = (*r)[ResType::STRING];
+	if (!t) { return false; }
+	std::vector<const_resid> names = t->getNames();
+	for (size_t i = 0; i < names.size(); ++i) {
+		const ResourceLang* l;
+		if (!IsIntResID(names[i]) || (l = (*(*t)[names[i]])[lang]) == NULL) { continue; }
+		size_t size;
+		const_bytes data = (const_bytes)l->getView(&size);
+		this->addBlock(ResID2Int(names[i]), data, size);
+	}
+	return !this->strings.empty();
+}
+bool StringTable::load(const File& f, uint16_t lang) { return f.isLoaded() && this->load(f.getResources(), lang); }
+#pragma endregion
+
+#pragma region Access
+///////////////////////////////////////////////////////////////////////////////
+///// Access
+///////////////////////////////////////////////////////////////////////////////
+uint16_t StringTable::getLang() const { return this->lang; }
+bool StringTable::isEmpty() const { return this->count() == 0; }
+size_t StringTable::count() const {
+	size_t n = 0;
+	for (size_t i = 0; i < this->strings.size(); ++i)
+		if (!this->strings[i].empty()) { ++n; }
+	return n;
+}
+size_t StringTable::visit(StringVisitor f, void* param) const {
+	size_t n = 0;
+	for (size_t b = 0; b < BLOCK_COUNT; ++b) {
+		if (this->blocks[b] == NONE) { continue; }
+		const utf16_view* s = &this->strings[this->blocks[b]];
+		for (size_t i = 0; i < STRINGS_PER_BLOCK; ++i) {
+			if (s[i].empty()) { continue; }
+			++n;
+			if (!f((uint16_t)(b * STRINGS_PER_BLOCK + i), s[i], param)) { return n; }
+		}
+	}
+	return n;
+}
+#pragma endregion
+
+#pragma region Replacing
+///////////////////////////////////////////////////////////////////////////////
+///// Replacing
+///////////////////////////////////////////////////////////////////////////////
+struct Block { utf16_view s[StringTable::STRINGS_PER_BLOCK]; };
+bool StringTable::Replace(Rsrc* r, uint16_t lang, const Change* changes, size_t count) {
+	// Decode each affected block once and apply the changes to it
+	typedef std::map<uint16_t, Block> Blocks;
+	Blocks blocks;
+	for (size_t i = 0; i < count; ++i) {
+		uint16_t name = BlockName(changes[i].id);
+		Blocks::iterator b = blocks.find(name);
+		if (b == blocks.end()) {
+			b = blocks.insert(Blocks::value_type(name, Block())).first;
+			const ResourceType* t = (*r)[ResType::STRING];
+			const ResourceName* n = t ? (*t)[MakeResID(name)] : NULL;
+			const ResourceLang* l = n ? (*n)[lang] : NULL;
+			if (l) {
+				size_t size;
+				const_bytes data = (const_bytes)l->getView(&size);
+				DecodeBlock(data, size, b->second.s);
+			}
+		}
+		b->second.s[changes[i].id & 0xF] = changes[i].value;
+	}
+
+	// Encode all of the blocks before changing any since the strings may point into any of them
+	std::vector<std::vector<uint16_t> > data(blocks.size());
+	size_t j = 0;
+	for (Blocks::const_iterator b = blocks.begin(); b != blocks.end(); ++b, ++j) {
+		bool empty = true;
+		for (size_t i = 0; i < STRINGS_PER_BLOCK; ++i) {
+			const utf16_view& s = b->second.s[i];
+			data[j].push_back((uint16_t)s.length);
+			data[j].insert(data[j].end(), s.data, s.data + s.length);
+			empty = empty && s.empty();
+		}
+		if (empty) { data[j].clear(); }
+	}
+	j = 0;
+	for (Blocks::const_iterator b = blocks.begin(); b != blocks.end(); ++b, ++j) {
+		if (data[j].empty()) { r->remove(ResType::STRING, MakeResID(b->first), lang); } // a block without any strings is removed
+		else if (!r->add(ResType::STRING, MakeResID(b->first), lang, &data[j][0], data[j].size() * sizeof(uint16_t))) { return false; }
+	}
+	return true;
+}
+bool StringTable::Replace(File& f, uint16_t lang, const Change* changes, size_t count) { return f.isLoaded() && !f.isReadOnly() && Replace(f.getResources(), lang, changes, count); }
+#pragma endregion
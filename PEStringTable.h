@@ -0,0 +1,82 @@
+// pe-file: library for reading and manipulating pe-files
+// Copyright (C) 2012  Jeffrey Bush  jeff@coderforlife.com
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Implements indexed access to the string tables (STRING resources) of PE files
+
+#ifndef PE_STRING_TABLE_H
+#define PE_STRING_TABLE_H
+
+#include "PEDataTypes.h"
+#include "PEFile.h"
+
+#include <vector>
+
+namespace PE {
+	// The strings of a single language, STRING resources are blocks of 16 length-prefixed UTF-16 strings where block n
+	// (the name of the resource) holds the strings with IDs (n-1)*16 to (n-1)*16+15. All of the blocks are decoded once
+	// when loaded so that every lookup is O(1). The strings point directly into the data they were loaded from.
+	class StringTable {
+	public:
+		static const size_t STRINGS_PER_BLOCK = 16;
+		static const size_t BLOCK_COUNT = 0x10000 / STRINGS_PER_BLOCK;
+		inline static uint16_t BlockName(uint16_t id) { return (uint16_t)((id >> 4) + 1); }
+
+		// A change for Replace, an empty value removes the string
+		struct Change {
+			uint16_t id;
+			utf16_view value;
+		};
+
+		typedef bool (*StringVisitor)(uint16_t id, const utf16_view& s, void* param); // return false to stop
+	private:
+		uint16_t lang;
+		std::vector<uint32_t> blocks; // index into strings of each block or NONE
+		std::vector<utf16_view> strings;
+		static const uint32_t NONE = 0xFFFFFFFF;
+
+		void addBlock(uint16_t name, const_bytes data, size_t size);
+		static bool AddDirect(const File::DirectName& type, const File::DirectName& name, const File::DirectQuery& res, void* param);
+	public:
+		StringTable();
+
+		// Loads the strings of a language from the raw data of a PE file
+		bool load(const void* peData, size_t peSize, uint16_t lang);
+		// Loads the strings of a language from resources being edited, they are valid until the resources are changed
+		bool load(const Rsrc* r, uint16_t lang);
+		bool load(const File& f, uint16_t lang); // from the resources of the file, including unsaved changes
+		// Loads the strings of every language from the raw data of a PE file in a single walk of the resources
+		static size_t LoadAll(const void* peData, size_t peSize, std::vector<StringTable>& tables);
+
+		uint16_t getLang() const;
+		bool isEmpty() const;
+		size_t count() const; // number of non-empty strings
+
+		inline bool exists(uint16_t id) const { return !this->get(id).empty(); }
+		inline utf16_view get(uint16_t id) const { // empty if it does not exist
+			uint32_t b = this->blocks[id >> 4];
+			return (b == NONE) ? utf16_view() : this->strings[b + (id & 0xF)];
+		}
+
+		size_t visit(StringVisitor f, void* param) const; // calls f for every non-empty string in order of ID, returns the number visited
+
+		// Changes many strings of a language, each affected block is decoded and rebuilt once
+		// The values may point into the strings being replaced
+		static bool Replace(Rsrc* r, uint16_t lang, const Change* changes, size_t count);
+		static bool Replace(File& f, uint16_t lang, const Change* changes, size_t count); // changes are written when the file is saved
+	};
+}
+
+#endif
@@ -21,7 +21,6 @@
 #include "PEVersion.h"
 
 #include <string.h>
-#include <wchar.h>
 #include <vector>
 
 using namespace PE;
@@ -44,16 +43,6 @@ struct Block16 {
 };
 typedef std::vector<Block16>::iterator B16iter;
 
-struct Block32 {
-	uint16_t size;     // size including key, value, and children
-	uint16_t val_size;
-	uint16_t type;     // 0x0000 for a binary value, 0x0001 for a string value
-	wchar_t* key;
-	bytes value;
-	std::vector<Block32> children;
-};
-typedef std::vector<Block32>::iterator B32iter;
-
 static Block16 GetBlock16(const void* ver, bool recurse) {
 	uint16_t* words = (uint16_t*)ver;
 
@@ -75,58 +64,256 @@ static Block16 GetBlock16(const void* ver, bool recurse) {
 	return b;
 }
 
-static Block32 GetBlock32(const void* ver, bool recurse) {
-	uint16_t* words = (uint16_t*)ver;
+bool VersionBlock::Parse(const void* data, size_t size, VersionBlock* b) {
+	const uint16_t* words = (const uint16_t*)data;
+	if (size < 3 * sizeof(uint16_t)) { return false; }
+	b->Start = (const_bytes)data;
+	b->Size = words[0];
+	b->ValueSize = words[1];
+	b->Type = words[2];
+	if (b->Size < 3 * sizeof(uint16_t) || b->Size > size) { return false; }
 
-	Block32 b = { words[0], words[1], words[2], (wchar_t*)(words+3) };
-	b.value = ((bytes)ver) + roundUpTo<sizeof(uint32_t)>(3 * sizeof(uint16_t) + (wcslen(b.key) + 1) * sizeof(wchar_t));
-	
-	//if (*((char*)&b.type) >= ' ') { /* error: actually a 16-bit block*/ }
+	// Key, must be null-terminated within the block
+	const uint16_t *key = words + 3, *k = key, *end = (const uint16_t*)(b->Start + (b->Size & ~1));
+	while (k < end && *k) { ++k; }
+	if (k == end) { return false; }
+	b->Key = utf16_view(key, k - key);
 
-	if (recurse) {
-		bytes end = (bytes)ver+b.size;
-		bytes child = b.value + roundUpTo<sizeof(uint32_t)>(b.val_size);
-		while (child < end) {
-			Block32 c = GetBlock32(child, true);
-			b.children.push_back(c);
-			child += c.size;
-		}
+	// Value, some tools write the size of text values in bytes instead of characters so it is clamped to the block
+	size_t val = roundUpTo<sizeof(uint32_t)>((const_bytes)(k + 1) - b->Start);
+	b->ValueBytes = (b->Type == 1) ? b->ValueSize * sizeof(uint16_t) : b->ValueSize;
+	if (val > b->Size) {
+		if (b->ValueBytes) { return false; }
+		val = b->Size;
+	} else if (val + b->ValueBytes > b->Size) {
+		b->ValueBytes = b->Size - val;
 	}
+	b->Value = b->Start + val;
+	return true;
+}
+utf16_view VersionBlock::Text() const {
+	utf16_view s((const uint16_t*)this->Value, this->ValueBytes / sizeof(uint16_t));
+	while (s.length && s.data[s.length-1] == 0) { --s.length; }
+	return s;
+}
+const_bytes VersionBlock::ChildrenStart() const {
+	size_t off = roundUpTo<sizeof(uint32_t)>((this->Value - this->Start) + this->ValueBytes);
+	return this->Start + ((off < this->Size) ? off : this->Size);
+}
+const_bytes VersionBlock::End() const { return this->Start + this->Size; }
 
-	return b;
+VersionBlockIterator::VersionBlockIterator(const VersionBlock& parent) : pos(parent.ChildrenStart()), end(parent.End()), malformed(false) { }
+VersionBlockIterator::VersionBlockIterator(const void* first, const void* end) : pos((const_bytes)first), end((const_bytes)end), malformed(false) { }
+bool VersionBlockIterator::next() {
+	if (this->pos >= this->end) { return false; }
+	if (!VersionBlock::Parse(this->pos, this->end - this->pos, &this->b)) { this->pos = this->end; this->malformed = true; return false; }
+	this->pos += roundUpTo<sizeof(uint32_t)>(this->b.Size);
+	return true;
+}
+
+static bool VisitVersionBlock(const VersionBlock& b, int depth, VersionVisitor visitor, void* param) {
+	if (!visitor(b, depth, param)) { return false; }
+	VersionBlockIterator i(b);
+	while (i.next())
+		if (!VisitVersionBlock(*i, depth + 1, visitor, param)) { return false; }
+	return !i.isMalformed();
+}
+bool PE::Version::VisitVersionBlocks(const void* ver, size_t size, VersionVisitor visitor, void* param) {
+	VersionBlock root;
+	return ver && VersionBlock::Parse(ver, size, &root) && VisitVersionBlock(root, 0, visitor, param);
+}
+
+bool PE::Version::QueryVersionValue(const void* ver, size_t size, const char* path, VersionBlock* b) {
+	if (!ver || !path || !VersionBlock::Parse(ver, size, b)) { return false; }
+	for (;;) {
+		while (*path == '\\') { ++path; }
+		if (!*path) { return true; }
+		const char* end = path;
+		while (*end && *end != '\\') { ++end; }
+		bool found = false;
+		for (VersionBlockIterator i(*b); !found && i.next(); )
+			if (i->Key.equals(path, end - path, true)) { *b = *i; found = true; }
+		if (!found) { return false; }
+		path = end;
+	}
+}
+utf16_view PE::Version::QueryVersionString(const void* ver, size_t size, const char* path) {
+	VersionBlock b;
+	return (QueryVersionValue(ver, size, path, &b) && b.Type == 1) ? b.Text() : utf16_view();
+}
+
+static std::wstring ToWString(const utf16_view& s) {
+	std::wstring w;
+	w.reserve(s.length);
+	for (size_t i = 0; i < s.length; ++i) {
+		uint32_t c = s[i];
+		// wchar_t is UTF-32 on most non-Windows platforms so surrogate pairs are combined
+		if (sizeof(wchar_t) > sizeof(uint16_t) && c >= 0xD800 && c < 0xDC00 && i + 1 < s.length && s[i+1] >= 0xDC00 && s[i+1] < 0xE000)
+			c = 0x10000 + ((c - 0xD800) << 10) + (s[++i] - 0xDC00);
+		w.push_back((wchar_t)c);
+	}
+	return w;
+}
+static bool ParseLangAndCodePage(const utf16_view& s, LangAndCodePage* lcp) {
+	// The key of a StringTable is 8 hex digits, the language followed by the code page
+	if (s.length != 8) { return false; }
+	uint32_t x = 0;
+	for (size_t i = 0; i < 8; ++i) {
+		uint16_t c = s[i];
+		if      (c >= '0' && c <= '9') { c -= '0'; }
+		else if (c >= 'a' && c <= 'f') { c -= 'a' - 10; }
+		else if (c >= 'A' && c <= 'F') { c -= 'A' - 10; }
+		else { return false; }
+		x = (x << 4) | c;
+	}
+	lcp->Language = (uint16_t)(x >> 16);
+	lcp->CodePage = (uint16_t)x;
+	return true;
 }
 
-static FileVersionBasicInfo *GetFileVersionBasicInfo(Block32 root) {
-	if (wcscmp(root.key, L"VS_VERSION_INFO") != 0 || root.type != 0x0000 || root.val_size != 52) { return NULL; } // error!
-	FileVersionBasicInfo *v = (FileVersionBasicInfo*)root.value;
+FileVersionBasicInfo *FileVersionBasicInfo::Get(void* ver) { return ver ? Get(ver, *(uint16_t*)ver) : NULL; }
+FileVersionBasicInfo *FileVersionBasicInfo::Get(void* ver, size_t size) {
+	VersionBlock root;
+	if (!ver || !VersionBlock::Parse(ver, size, &root)) { return NULL; }
+	if (!root.Key.equals("VS_VERSION_INFO") || root.Type != 0x0000 || root.ValueSize != 52) { return NULL; } // error!
+	FileVersionBasicInfo *v = (FileVersionBasicInfo*)root.Value;
 	if (v->Signature != FileVersionBasicInfo::SIGNATURE || v->StrucVersion.Major != 1 || v->StrucVersion.Minor != 0) { return NULL; } // error!
 	return v;
 }
-FileVersionBasicInfo *FileVersionBasicInfo::Get(void* ver) { return ver ? GetFileVersionBasicInfo(GetBlock32(ver, false)) : NULL; }
 
-FileVersionInfo::FileVersionInfo(void* ver) : Basic(NULL) {
-	if (ver == NULL) { return; }
-	Block32 root = GetBlock32(ver, true);
-	this->Basic = GetFileVersionBasicInfo(root);
+FileVersionInfo::FileVersionInfo(void* ver) : Basic(NULL) { if (ver) { *this = FileVersionInfo(ver, *(uint16_t*)ver); } }
+FileVersionInfo::FileVersionInfo(void* ver, size_t size) : Basic(FileVersionBasicInfo::Get(ver, size)) {
 	if (this->Basic == NULL) { return; } // error!
+	VersionBlock root;
+	VersionBlock::Parse(ver, size, &root);
 
-	for (B32iter i = root.children.begin(); i != root.children.end(); ++i) {
-		if (wcscmp(i->key, L"StringFileInfo") == 0) {
-			for (B32iter j = i->children.begin(); j != i->children.end(); ++j) {
-				if (j->val_size == 0) {
-					LangAndCodePage lcp; // TODO: convert j->key to LCP
+	for (VersionBlockIterator i(root); i.next(); ) {
+		if (i->Key.equals("StringFileInfo")) {
+			for (VersionBlockIterator j(*i); j.next(); ) {
+				if (j->ValueSize == 0) {
+					LangAndCodePage lcp;
+					ParseLangAndCodePage(j->Key, &lcp);
 					StringFileInfo& sfi = this->Strings[lcp];
-					for (B32iter k = j->children.begin(); k != j->children.end(); ++k) {
-						sfi[k->key] = std::wstring((wchar_t*)k->value, k->val_size / sizeof(wchar_t));
-					}
+					for (VersionBlockIterator k(*j); k.next(); )
+						sfi[ToWString(k->Key)] = ToWString(k->Text());
 				}
 			}
-		} else if (wcscmp(i->key, L"VarFileInfo") == 0) {
-			for (B32iter j = i->children.begin(); j != i->children.end(); ++j) {
-				if (wcscmp(j->key, L"Translation") == 0 && j->val_size == sizeof(LangAndCodePage)) {
-					this->Strings.insert(make_pair(*(LangAndCodePage*)j->value, FileVersionInfo::StringFileInfo()));
+		} else if (i->Key.equals("VarFileInfo")) {
+			for (VersionBlockIterator j(*i); j.next(); ) {
+				if (j->Key.equals("Translation")) {
+					const LangAndCodePage* t = (const LangAndCodePage*)j->Value;
+					for (size_t n = j->ValueBytes / sizeof(LangAndCodePage); n; --n, ++t)
+						this->Strings.insert(make_pair(*t, FileVersionInfo::StringFileInfo()));
 				}
 			}
 		} else { /* Ignore the unknown block */ }
 	}
 }
+
+static void ToUTF16(const_str s, std::vector<uint16_t>& out) {
+	for (; *s; ++s) {
+		uint32_t c = (uint32_t)*s;
+		if (c >= 0x10000) { c -= 0x10000; out.push_back((uint16_t)(0xD800 + (c >> 10))); out.push_back((uint16_t)(0xDC00 + (c & 0x3FF))); }
+		else { out.push_back((uint16_t)c); }
+	}
+}
+static void Put16(std::vector<byte>& out, uint16_t x) { out.push_back((byte)x); out.push_back((byte)(x >> 8)); }
+static void PutText(std::vector<byte>& out, const utf16_view& s) {
+	for (size_t i = 0; i < s.length; ++i) { Put16(out, s[i]); }
+	Put16(out, 0);
+}
+static void Pad(std::vector<byte>& out) { while (out.size() & 3) { out.push_back(0); } }
+static bool WriteBlockHeader(std::vector<byte>& out, uint16_t valSize, uint16_t type, const utf16_view& key) {
+	Put16(out, 0); // size, set once the block is complete
+	Put16(out, valSize);
+	Put16(out, type);
+	PutText(out, key);
+	Pad(out);
+	return true;
+}
+static bool FinishBlock(std::vector<byte>& out, size_t start) {
+	size_t size = out.size() - start;
+	if (size > 0xFFFF) { return false; }
+	out[start] = (byte)size; out[start+1] = (byte)(size >> 8);
+	return true;
+}
+// Writes b and its children to out, replacing the value of the block at target and appending a new text child to the block at parent
+static bool WriteBlock(std::vector<byte>& out, const VersionBlock& b, const_bytes target, const_bytes parent, const utf16_view& key, const utf16_view& value) {
+	size_t start = out.size();
+	if (b.Start == target) {
+		WriteBlockHeader(out, (uint16_t)(value.length + 1), 1, b.Key);
+		PutText(out, value);
+	} else {
+		WriteBlockHeader(out, b.ValueSize, b.Type, b.Key);
+		out.insert(out.end(), b.Value, b.Value + b.ValueBytes);
+	}
+	for (VersionBlockIterator i(b); i.next(); ) {
+		Pad(out);
+		if (!WriteBlock(out, *i, target, parent, key, value)) { return false; }
+	}
+	if (b.Start == parent) {
+		Pad(out);
+		size_t s = out.size();
+		WriteBlockHeader(out, (uint16_t)(value.length + 1), 1, key);
+		PutText(out, value);
+		if (!FinishBlock(out, s)) { return false; }
+	}
+	return FinishBlock(out, start);
+}
+
+VersionEditor::VersionEditor(void* ver, size_t size) : ver((bytes)ver), size(size), owned(false) { }
+VersionEditor::~VersionEditor() { if (this->owned) { free(this->ver); } }
+bool VersionEditor::isValid() const { return FileVersionBasicInfo::Get(this->ver, this->size) != NULL; }
+bool VersionEditor::isInPlace() const { return !this->owned; }
+const void* VersionEditor::get(size_t* size) const { *size = this->size; return this->ver; }
+FileVersionBasicInfo* VersionEditor::getBasicInfo() { return FileVersionBasicInfo::Get(this->ver, this->size); }
+bool VersionEditor::reserialize(const_bytes target, const_bytes parent, const utf16_view& key, const utf16_view& value) {
+	VersionBlock root;
+	std::vector<byte> out;
+	out.reserve(this->size + 2 * (key.length + value.length) + 16);
+	if (!VersionBlock::Parse(this->ver, this->size, &root) || !WriteBlock(out, root, target, parent, key, value)) { return false; }
+	bytes v = (bytes)malloc(out.size());
+	if (!v) { return false; }
+	memcpy(v, &out[0], out.size());
+	if (this->owned) { free(this->ver); }
+	this->ver = v;
+	this->size = out.size();
+	this->owned = true;
+	return true;
+}
+bool VersionEditor::setString(const char* path, const utf16_view& value) {
+	if (!this->isValid() || value.length >= 0x7FFF) { return false; }
+
+	// Find the block or its parent
+	const char* name = path + strlen(path);
+	while (name > path && name[-1] == '\\') { --name; } // ignore trailing separators
+	const char* name_end = name;
+	while (name > path && name[-1] != '\\') { --name; }
+	if (name == name_end) { return false; }
+	VersionBlock b;
+	if (!QueryVersionValue(this->ver, this->size, path, &b)) {
+		std::string parentPath(path, name);
+		if (!QueryVersionValue(this->ver, this->size, parentPath.c_str(), &b)) { return false; }
+		std::vector<uint16_t> key;
+		for (const char* c = name; c < name_end; ++c) { key.push_back((unsigned char)*c); } // each byte is a character, as when looking it up
+		return this->reserialize(NULL, b.Start, utf16_view(&key[0], key.size()), value);
+	}
+
+	// Change it in place if it fits, padding with nulls
+	size_t needed = (value.length + 1) * sizeof(uint16_t);
+	if (b.Value + needed <= b.End() && (b.Type == 1 || b.ValueBytes == 0) && b.ChildrenStart() == b.End()) {
+		bytes v = this->ver + (b.Value - this->ver);
+		if (value.length) { memcpy(v, value.data, value.length * sizeof(uint16_t)); }
+		memset(v + value.length * sizeof(uint16_t), 0, (b.End() - b.Value) - value.length * sizeof(uint16_t));
+		uint16_t* words = (uint16_t*)(this->ver + (b.Start - this->ver));
+		words[1] = (uint16_t)(value.length + 1); // ValueSize
+		words[2] = 1; // Type is text
+		return true;
+	}
+	return this->reserialize(b.Start, NULL, utf16_view(), value);
+}
+bool VersionEditor::setString(const char* path, const_str value) {
+	std::vector<uint16_t> v;
+	ToUTF16(value, v);
+	return this->setString(path, v.empty() ? utf16_view() : utf16_view(&v[0], v.size()));
+}
@@ -44,6 +44,7 @@ namespace PE { namespace Version {
 		static const uint32_t SIGNATURE = 0xFEEF04BD;
 
 		static FileVersionBasicInfo* Get(void* ver);
+		static FileVersionBasicInfo* Get(void* ver, size_t size);
 
 		uint32_t Signature;
 		SmallVersion StrucVersion;
@@ -117,9 +118,78 @@ namespace PE { namespace Version {
 		uint64_t FileDate;
 	};
 
+	// A single block (VS_VERSIONINFO, StringFileInfo, StringTable, String, VarFileInfo, Var) of a version resource
+	// The key and value point directly into the resource data, nothing is copied
+	struct VersionBlock {
+		const_bytes Start;		// the start of the block in the resource data
+		uint16_t Size;			// size including key, value, and children
+		uint16_t ValueSize;		// in characters for a text value, in bytes otherwise
+		uint16_t Type;			// 0x0000 for a binary value, 0x0001 for a text value
+		utf16_view Key;
+		const_bytes Value;
+		size_t ValueBytes;
+
+		// Reads a block, checking that it fits in size bytes
+		static bool Parse(const void* data, size_t size, VersionBlock* b);
+
+		utf16_view Text() const; // the value as text, without any null terminator
+		const_bytes ChildrenStart() const;
+		const_bytes End() const;
+	};
+
+	// Iterates over the children of a block without allocating:
+	//   for (VersionBlockIterator i(parent); i.next(); ) { i->Key ... }
+	class VersionBlockIterator {
+		const_bytes pos, end;
+		VersionBlock b;
+		bool malformed;
+	public:
+		VersionBlockIterator(const VersionBlock& parent);
+		VersionBlockIterator(const void* first, const void* end);
+		bool next(); // moves to the next block, false once there are no more (or the data is malformed)
+		inline bool isMalformed() const { return this->malformed; } // a block could not be read, which stopped next()
+		inline const VersionBlock& operator *() const { return this->b; }
+		inline const VersionBlock* operator->() const { return &this->b; }
+	};
+
+	// Visits every block depth-first, the root having a depth of 0, stops early when the visitor returns false
+	// Returns false if the resource is malformed or the visitor stopped
+	typedef bool (*VersionVisitor)(const VersionBlock& b, int depth, void* param);
+	bool VisitVersionBlocks(const void* ver, size_t size, VersionVisitor visitor, void* param);
+
+	// Looks up a block by path like VerQueryValue, e.g. "\\StringFileInfo\\040904b0\\ProductVersion"
+	// The path is matched case-insensitively, "\\" is the root block (whose value is the FileVersionBasicInfo)
+	bool QueryVersionValue(const void* ver, size_t size, const char* path, VersionBlock* b);
+	utf16_view QueryVersionString(const void* ver, size_t size, const char* path); // empty if not found or not text
+
+	// Edits a version resource. The basic info and strings that fit in the space of the old value are changed in place,
+	// otherwise the resource is re-serialized into a new buffer owned by the editor (see isInPlace and get).
+	class VersionEditor {
+		bytes ver;
+		size_t size;
+		bool owned;
+
+		VersionEditor(const VersionEditor&);
+		VersionEditor& operator =(const VersionEditor&);
+		bool reserialize(const_bytes target, const_bytes parent, const utf16_view& key, const utf16_view& value);
+	public:
+		VersionEditor(void* ver, size_t size);
+		~VersionEditor();
+
+		bool isValid() const;
+		bool isInPlace() const; // true until an edit had to re-serialize the resource
+		const void* get(size_t* size) const; // the current resource data, owned by the editor once not in place
+
+		FileVersionBasicInfo* getBasicInfo(); // modifiable
+		// Sets a text value by path like "\\StringFileInfo\\040904b0\\ProductVersion", adding it to its parent if missing
+		bool setString(const char* path, const utf16_view& value);
+		bool setString(const char* path, const_str value);
+	};
+
 	// This data is not modifiable (except the basic info), all strings are copies
 	struct FileVersionInfo {
 		FileVersionInfo(void* ver);
+		FileVersionInfo(void* ver, size_t size);
 
 		FileVersionBasicInfo* Basic;
 
@@ -5,7 +5,7 @@
 
 :: -s
 set FLAGS=-Wall -Wno-unknown-pragmas -static-libgcc -static-libstdc++ -O3 -D UNICODE -D _UNICODE
-set FILES=PEFile.cpp PEFileResources.cpp PEDataSource.cpp PEVersion.cpp
+set FILES=PEFile.cpp PEFileResources.cpp PEDataSource.cpp PEVersion.cpp PEResourceIndex.cpp PEHash.cpp PEAnalysis.cpp PEIcons.cpp PEStringTable.cpp PEMessageTable.cpp
 
 echo Compiling 32-bit...
 i686-w64-mingw32-g++ %FLAGS% -c %FILES%
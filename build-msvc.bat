@@ -17,7 +17,7 @@
 @echo Compiling with toolchain at "%DIR%"
 
 @set FLAGS=/nologo /MT /MP /D NDEBUG /W4 /wd4201 /wd4480 /O2 /GS /GL /EHa /D _UNICODE /D UNICODE
-@set FILES=PEFile.cpp PEFileResources.cpp PEDataSource.cpp PEVersion.cpp
+@set FILES=PEFile.cpp PEFileResources.cpp PEDataSource.cpp PEVersion.cpp PEResourceIndex.cpp PEHash.cpp PEAnalysis.cpp PEIcons.cpp PEStringTable.cpp PEMessageTable.cpp
 
 @echo Compiling 32-bit...
 @call "%DIR%\..\..\VC\vcvarsall.bat" x86